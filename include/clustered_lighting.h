@@ -0,0 +1,281 @@
+// Clustered Light Culling
+//
+// The view frustum is cut into a grid of froxels: CLUSTER_X * CLUSTER_Y
+// screen tiles, each split into CLUSTER_Z slices whose depth grows
+// exponentially from the near to the far plane. Every frame build() bins
+// the point lights on the CPU, by the view-space box around each light's
+// sphere of influence, and uploads three buffer textures:
+//   lights    RGBA32F, two texels per light: view position and radius,
+//             then colour and shadow map index
+//   clusters  RG32UI, per froxel the first entry in the index list and the
+//             number of lights
+//   indices   R32UI, light indices grouped by froxel
+// A fragment looks its froxel up from gl_FragCoord and view depth and only
+// loops over the lights binned there.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <gl_env.h>
+#include <gl_state.h>
+
+#include <glm/glm.hpp>
+
+namespace Lighting {
+struct PointLight {
+  glm::vec3 position;
+  float radius;  // no light reaches beyond
+  glm::vec3 color;
+  int shadowMap;  // -1 for none
+};
+
+// Distance at which a light of _color under 1 / (1 + _linear * d +
+// _quadratic * d * d) attenuation drops below one 8-bit step
+inline float attenuationRadius(const glm::vec3& _color, float _linear,
+                               float _quadratic) {
+  float peak = std::max(std::max(_color.r, _color.g), _color.b);
+  float c = 1.0f - peak * 256.0f;
+  if (c >= 0.0f)
+    return 0.0f;
+  return (-_linear + std::sqrt(_linear * _linear - 4.0f * _quadratic * c)) /
+         (2.0f * _quadratic);
+}
+
+struct ClusterStats {
+  unsigned int lightNum;      // lights overlapping the frustum
+  unsigned int entryNum;      // light indices over all froxels
+  unsigned int maxPerCluster;
+};
+
+class ClusterGrid {
+ public:
+  static const int CLUSTER_X = 16;
+  static const int CLUSTER_Y = 9;
+  static const int CLUSTER_Z = 24;
+  static const int CLUSTER_NUM = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+
+  enum Channel {
+    CHANNEL_LIGHTS,
+    CHANNEL_CLUSTERS,
+    CHANNEL_INDICES,
+    CHANNEL_NUM
+  };
+
+ private:
+  GLuint buffer[CHANNEL_NUM];
+  GLuint texture[CHANNEL_NUM];
+  size_t bufferBytes[CHANNEL_NUM];
+  float nearPlane;
+  float farPlane;
+  std::vector<glm::vec4> lightData;
+  std::vector<GLuint> clusterData;
+  std::vector<GLuint> indexData;
+  std::vector<GLuint> count;
+  ClusterStats stats;
+
+  // Forbid copying, the GL names are owned
+  ClusterGrid(const ClusterGrid& _copy) = delete;
+  ClusterGrid& operator=(const ClusterGrid& _copy) = delete;
+
+  static GLenum formatOf(int _channel) {
+    switch (_channel) {
+      case CHANNEL_LIGHTS:
+        return GL_RGBA32F;
+      case CHANNEL_CLUSTERS:
+        return GL_RG32UI;
+      default:
+        return GL_R32UI;
+    }
+  }
+
+  int sliceOf(float _depth) const {
+    int slice = (int)(std::log(_depth / nearPlane) /
+                      std::log(farPlane / nearPlane) * CLUSTER_Z);
+    return std::min(std::max(slice, 0), CLUSTER_Z - 1);
+  }
+
+  // Tiles covered by [_min, _max] in NDC, false when outside the screen
+  static bool tileRange(float _min, float _max, int _tiles, int& _first,
+                        int& _last) {
+    if (_max < -1.0f || _min > 1.0f)
+      return false;
+    _first = std::max((int)((_min * 0.5f + 0.5f) * _tiles), 0);
+    _last = std::min((int)((_max * 0.5f + 0.5f) * _tiles), _tiles - 1);
+    return true;
+  }
+
+  // NDC extent along one axis of a view-space box at depths [_near, _far],
+  // the projection divides by the smallest depth where that grows the range
+  static void ndcRange(float _min, float _max, float _near, float _far,
+                       float _scale, float& _ndcMin, float& _ndcMax) {
+    _ndcMin = _min * _scale / (_min < 0.0f ? _near : _far);
+    _ndcMax = _max * _scale / (_max > 0.0f ? _near : _far);
+  }
+
+  void upload(int _channel, const void* _data, size_t _bytes) {
+    // Buffer textures may not be empty
+    static const glm::vec4 zero(0.0f);
+    if (_bytes == 0) {
+      _data = &zero;
+      _bytes = sizeof(zero);
+    }
+    bool dsa = GLState::hasDirectStateAccess();
+    if (dsa) {
+      if (_bytes > bufferBytes[_channel]) {
+        glNamedBufferData(buffer[_channel], _bytes, _data, GL_STREAM_DRAW);
+        glTextureBuffer(texture[_channel], formatOf(_channel),
+                        buffer[_channel]);
+        bufferBytes[_channel] = _bytes;
+      } else {
+        glNamedBufferSubData(buffer[_channel], 0, _bytes, _data);
+      }
+      return;
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer[_channel]);
+    if (_bytes > bufferBytes[_channel]) {
+      glBufferData(GL_TEXTURE_BUFFER, _bytes, _data, GL_STREAM_DRAW);
+      GLState::Cache::current().bindTexture(GL_TEXTURE_BUFFER,
+                                            texture[_channel]);
+      glTexBuffer(GL_TEXTURE_BUFFER, formatOf(_channel), buffer[_channel]);
+      bufferBytes[_channel] = _bytes;
+    } else {
+      glBufferSubData(GL_TEXTURE_BUFFER, 0, _bytes, _data);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  }
+
+ public:
+  ClusterGrid() : nearPlane(0.1f), farPlane(100.0f) {
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+      buffer[i] = texture[i] = 0;
+      bufferBytes[i] = 0;
+    }
+    stats.lightNum = stats.entryNum = stats.maxPerCluster = 0;
+  }
+  // GL names are only held between init() and clear()
+  ~ClusterGrid() {
+    if (available())
+      clear();
+  }
+
+  bool available() const { return buffer[0] != 0; }
+
+  void init() {
+    clear();
+    if (GLState::hasDirectStateAccess()) {
+      glCreateBuffers(CHANNEL_NUM, buffer);
+      glCreateTextures(GL_TEXTURE_BUFFER, CHANNEL_NUM, texture);
+    } else {
+      glGenBuffers(CHANNEL_NUM, buffer);
+      glGenTextures(CHANNEL_NUM, texture);
+    }
+  }
+
+  void clear() {
+    for (int i = 0; i < CHANNEL_NUM; i++) {
+      GLState::Cache::current().forgetTexture(texture[i]);
+      bufferBytes[i] = 0;
+    }
+    glDeleteTextures(CHANNEL_NUM, texture);
+    glDeleteBuffers(CHANNEL_NUM, buffer);
+    for (int i = 0; i < CHANNEL_NUM; i++)
+      buffer[i] = texture[i] = 0;
+  }
+
+  // Bin _lights, given in world space, into the froxels of a symmetric
+  // perspective _projection and upload the result
+  void build(const std::vector<PointLight>& _lights, const glm::mat4& _view,
+             const glm::mat4& _projection) {
+    nearPlane = _projection[3][2] / (_projection[2][2] - 1.0f);
+    farPlane = _projection[3][2] / (_projection[2][2] + 1.0f);
+    float scaleX = _projection[0][0];
+    float scaleY = _projection[1][1];
+
+    struct Range {
+      int x0, x1, y0, y1, z0, z1;
+    };
+    std::vector<Range> ranges;
+    ranges.reserve(_lights.size());
+    lightData.clear();
+    count.assign(CLUSTER_NUM, 0);
+    for (size_t i = 0; i < _lights.size(); i++) {
+      const PointLight& light = _lights[i];
+      glm::vec3 center = glm::vec3(_view * glm::vec4(light.position, 1.0f));
+      float r = light.radius;
+      float depth = -center.z;
+      if (depth + r < nearPlane || depth - r > farPlane)
+        continue;
+      float nearDepth = std::max(depth - r, nearPlane);
+      float farDepth = std::min(depth + r, farPlane);
+      float minX, maxX, minY, maxY;
+      ndcRange(center.x - r, center.x + r, nearDepth, farDepth, scaleX, minX,
+               maxX);
+      ndcRange(center.y - r, center.y + r, nearDepth, farDepth, scaleY, minY,
+               maxY);
+      Range range;
+      if (!tileRange(minX, maxX, CLUSTER_X, range.x0, range.x1) ||
+          !tileRange(minY, maxY, CLUSTER_Y, range.y0, range.y1))
+        continue;
+      range.z0 = sliceOf(nearDepth);
+      range.z1 = sliceOf(farDepth);
+      for (int z = range.z0; z <= range.z1; z++)
+        for (int y = range.y0; y <= range.y1; y++)
+          for (int x = range.x0; x <= range.x1; x++)
+            count[(z * CLUSTER_Y + y) * CLUSTER_X + x]++;
+      ranges.push_back(range);
+      lightData.push_back(glm::vec4(center, r));
+      lightData.push_back(glm::vec4(light.color, (float)light.shadowMap));
+    }
+
+    // Offsets by a prefix sum over the counts, then fill the index list
+    clusterData.resize(CLUSTER_NUM * 2);
+    GLuint offset = 0;
+    stats.maxPerCluster = 0;
+    for (int c = 0; c < CLUSTER_NUM; c++) {
+      clusterData[c * 2] = offset;
+      clusterData[c * 2 + 1] = 0;
+      offset += count[c];
+      stats.maxPerCluster = std::max(stats.maxPerCluster, count[c]);
+    }
+    indexData.resize(offset);
+    for (size_t i = 0; i < ranges.size(); i++) {
+      const Range& range = ranges[i];
+      for (int z = range.z0; z <= range.z1; z++)
+        for (int y = range.y0; y <= range.y1; y++)
+          for (int x = range.x0; x <= range.x1; x++) {
+            GLuint* cluster =
+                &clusterData[((z * CLUSTER_Y + y) * CLUSTER_X + x) * 2];
+            indexData[cluster[0] + cluster[1]++] = (GLuint)i;
+          }
+    }
+    stats.lightNum = (unsigned int)ranges.size();
+    stats.entryNum = offset;
+
+    upload(CHANNEL_LIGHTS, lightData.data(),
+           sizeof(glm::vec4) * lightData.size());
+    upload(CHANNEL_CLUSTERS, clusterData.data(),
+           sizeof(GLuint) * clusterData.size());
+    upload(CHANNEL_INDICES, indexData.data(),
+           sizeof(GLuint) * indexData.size());
+  }
+
+  // Bind the buffer textures to _firstUnit and the units after it, in
+  // Channel order
+  void bind(GLuint _firstUnit) const {
+    for (int i = 0; i < CHANNEL_NUM; i++)
+      GLState::Cache::current().bindTexture(_firstUnit + i, GL_TEXTURE_BUFFER,
+                                            texture[i]);
+  }
+
+  // Slice of view depth d is log(d / near) * depthScale()
+  float getNear() const { return nearPlane; }
+  float depthScale() const {
+    return CLUSTER_Z / std::log(farPlane / nearPlane);
+  }
+
+  const ClusterStats& getStats() const { return stats; }
+};
+}  // namespace Lighting
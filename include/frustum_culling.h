@@ -0,0 +1,200 @@
+// Bounding Volumes & Frustum Culling
+//
+// Planes are kept in structure-of-arrays form so that four of them are
+// tested against a box or sphere with one SSE instruction sequence.
+
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CULLING_USE_SSE 1
+#include <xmmintrin.h>
+#else
+#define CULLING_USE_SSE 0
+#endif
+
+namespace Culling {
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+
+  AABB() : min(FLT_MAX), max(-FLT_MAX) {}
+  AABB(const glm::vec3& _min, const glm::vec3& _max) : min(_min), max(_max) {}
+
+  bool empty() const { return min.x > max.x; }
+  glm::vec3 center() const { return (min + max) * 0.5f; }
+  glm::vec3 extent() const { return (max - min) * 0.5f; }
+
+  void expand(const glm::vec3& _p) {
+    min = glm::min(min, _p);
+    max = glm::max(max, _p);
+  }
+  void expand(const AABB& _box) {
+    if (_box.empty())
+      return;
+    min = glm::min(min, _box.min);
+    max = glm::max(max, _box.max);
+  }
+
+  // Box enclosing this one after an affine transform (Arvo)
+  AABB transformed(const glm::mat4& _m) const {
+    if (empty())
+      return *this;
+    glm::vec3 c = glm::vec3(_m * glm::vec4(center(), 1.0f));
+    glm::vec3 e = extent();
+    glm::vec3 r;
+    for (int i = 0; i < 3; i++)
+      r[i] = std::abs(_m[0][i]) * e.x + std::abs(_m[1][i]) * e.y +
+             std::abs(_m[2][i]) * e.z;
+    return AABB(c - r, c + r);
+  }
+};
+
+struct BoundingSphere {
+  glm::vec3 center;
+  float radius;
+
+  BoundingSphere() : center(0.0f), radius(-1.0f) {}
+  BoundingSphere(const glm::vec3& _c, float _r) : center(_c), radius(_r) {}
+
+  bool empty() const { return radius < 0.0f; }
+};
+
+// Sphere around the box center, tightened by the actual points
+template <typename PointAt>
+BoundingSphere sphereAround(const AABB& _box, size_t _count, PointAt _point) {
+  if (_box.empty())
+    return BoundingSphere();
+  glm::vec3 c = _box.center();
+  float r2 = 0.0f;
+  for (size_t i = 0; i < _count; i++) {
+    glm::vec3 d = _point(i) - c;
+    r2 = std::max(r2, glm::dot(d, d));
+  }
+  return BoundingSphere(c, std::sqrt(r2));
+}
+
+class Frustum {
+ private:
+  // Six planes padded to eight with ones that accept everything
+  alignas(16) float planeX[8];
+  alignas(16) float planeY[8];
+  alignas(16) float planeZ[8];
+  alignas(16) float planeW[8];
+
+ public:
+  Frustum() {
+    for (int i = 0; i < 8; i++) {
+      planeX[i] = planeY[i] = planeZ[i] = 0.0f;
+      planeW[i] = 1.0f;
+    }
+  }
+
+  // Planes of _clip = projection * view * model, so bounds are tested in
+  // the space they were computed in. Normals point inside and are
+  // normalized, distances are in that same space.
+  explicit Frustum(const glm::mat4& _clip) : Frustum() {
+    glm::vec4 row[4];
+    for (int i = 0; i < 4; i++)
+      row[i] = glm::vec4(_clip[0][i], _clip[1][i], _clip[2][i], _clip[3][i]);
+    glm::vec4 plane[6] = {row[3] + row[0], row[3] - row[0], row[3] + row[1],
+                          row[3] - row[1], row[3] + row[2], row[3] - row[2]};
+    for (int i = 0; i < 6; i++) {
+      float len = glm::length(glm::vec3(plane[i]));
+      if (len > 0.0f)
+        plane[i] /= len;
+      planeX[i] = plane[i].x;
+      planeY[i] = plane[i].y;
+      planeZ[i] = plane[i].z;
+      planeW[i] = plane[i].w;
+    }
+  }
+
+  // Plane _i as (normal, distance), for tests run on the GPU
+  glm::vec4 plane(int _i) const {
+    return glm::vec4(planeX[_i], planeY[_i], planeZ[_i], planeW[_i]);
+  }
+
+  bool testAABB(const AABB& _box) const {
+    if (_box.empty())
+      return false;
+    glm::vec3 c = _box.center(), e = _box.extent();
+#if CULLING_USE_SSE
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+    __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+    for (int i = 0; i < 8; i += 4) {
+      __m128 px = _mm_load_ps(planeX + i), py = _mm_load_ps(planeY + i),
+             pz = _mm_load_ps(planeZ + i), pw = _mm_load_ps(planeW + i);
+      __m128 dist = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(cx, px), _mm_mul_ps(cy, py)),
+          _mm_add_ps(_mm_mul_ps(cz, pz), pw));
+      __m128 rad = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(ex, _mm_andnot_ps(signMask, px)),
+                     _mm_mul_ps(ey, _mm_andnot_ps(signMask, py))),
+          _mm_mul_ps(ez, _mm_andnot_ps(signMask, pz)));
+      if (_mm_movemask_ps(
+              _mm_cmplt_ps(_mm_add_ps(dist, rad), _mm_setzero_ps())))
+        return false;
+    }
+    return true;
+#else
+    for (int i = 0; i < 6; i++) {
+      float dist = c.x * planeX[i] + c.y * planeY[i] + c.z * planeZ[i] +
+                   planeW[i];
+      float rad = e.x * std::abs(planeX[i]) + e.y * std::abs(planeY[i]) +
+                  e.z * std::abs(planeZ[i]);
+      if (dist + rad < 0.0f)
+        return false;
+    }
+    return true;
+#endif
+  }
+
+  bool testSphere(const BoundingSphere& _sphere) const {
+    if (_sphere.empty())
+      return false;
+    const glm::vec3& c = _sphere.center;
+#if CULLING_USE_SSE
+    __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+    __m128 negR = _mm_set1_ps(-_sphere.radius);
+    for (int i = 0; i < 8; i += 4) {
+      __m128 dist = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(cx, _mm_load_ps(planeX + i)),
+                     _mm_mul_ps(cy, _mm_load_ps(planeY + i))),
+          _mm_add_ps(_mm_mul_ps(cz, _mm_load_ps(planeZ + i)),
+                     _mm_load_ps(planeW + i)));
+      if (_mm_movemask_ps(_mm_cmplt_ps(dist, negR)))
+        return false;
+    }
+    return true;
+#else
+    for (int i = 0; i < 6; i++) {
+      float dist = c.x * planeX[i] + c.y * planeY[i] + c.z * planeZ[i] +
+                   planeW[i];
+      if (dist < -_sphere.radius)
+        return false;
+    }
+    return true;
+#endif
+  }
+
+  // The sphere rejects most invisible objects cheaply, the box is tighter
+  bool test(const BoundingSphere& _sphere, const AABB& _box) const {
+    return testSphere(_sphere) && testAABB(_box);
+  }
+};
+
+struct CullStats {
+  unsigned int drawn;
+  unsigned int culled;
+  CullStats() : drawn(0), culled(0) {}
+  void reset() { drawn = culled = 0; }
+};
+}  // namespace Culling
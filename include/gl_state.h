@@ -0,0 +1,206 @@
+// GL State Cache
+//
+// Program, vertex array, framebuffer and texture binds go through the
+// Cache, which remembers what is bound and drops calls that would not
+// change anything. Code that binds behind its back, such as the ImGui
+// renderer, has to be followed by invalidate(), and deleted objects have
+// to be forgotten since GL hands their names out again.
+//
+// With direct state access, objects are created and edited by name, and
+// textures bind to a unit without selecting it first.
+
+#pragma once
+
+#include <GL/glew.h>
+
+namespace GLState {
+// The direct state access paths also rely on immutable buffer and texture
+// storage, both part of 4.5
+inline bool hasDirectStateAccess() {
+  return GLEW_VERSION_4_5 ||
+         (GLEW_ARB_direct_state_access && GLEW_ARB_buffer_storage &&
+          GLEW_ARB_texture_storage);
+}
+
+// Binds passed on to GL and binds dropped as redundant since resetStats()
+struct Stats {
+  unsigned int issued;
+  unsigned int filtered;
+};
+
+class Cache {
+ public:
+  static const int TEXTURE_UNIT_NUM = 16;
+
+ private:
+  enum TextureTarget {
+    TARGET_2D,
+    TARGET_2D_ARRAY,
+    TARGET_BUFFER,
+    TARGET_CUBE_MAP,
+    TARGET_NUM
+  };
+
+  // Marks state the cache cannot vouch for, no object has this name
+  static const GLuint UNKNOWN = 0xffffffffu;
+
+  GLuint program;
+  GLuint vertexArray;
+  GLuint framebuffer;
+  GLuint activeUnit;
+  GLuint texture[TEXTURE_UNIT_NUM][TARGET_NUM];
+  bool enabled;
+  Stats stats;
+
+  // Forbid copying, there is one cache per context
+  Cache(const Cache& _copy) = delete;
+  Cache& operator=(const Cache& _copy) = delete;
+
+  Cache() : enabled(true) {
+    invalidate();
+    resetStats();
+  }
+
+  static int targetOf(GLenum _target) {
+    switch (_target) {
+      case GL_TEXTURE_2D:
+        return TARGET_2D;
+      case GL_TEXTURE_2D_ARRAY:
+        return TARGET_2D_ARRAY;
+      case GL_TEXTURE_BUFFER:
+        return TARGET_BUFFER;
+      case GL_TEXTURE_CUBE_MAP:
+        return TARGET_CUBE_MAP;
+      default:
+        return -1;
+    }
+  }
+
+  // Whether a bind of _bound to _state has to reach GL, records the new
+  // state either way. Disabled, every bind reaches GL but still counts as
+  // filtered when it would have been, to measure what the cache saves.
+  bool change(GLuint& _state, GLuint _bound) {
+    bool redundant = _state == _bound;
+    _state = _bound;
+    if (redundant)
+      stats.filtered++;
+    if (redundant && enabled)
+      return false;
+    stats.issued++;
+    return true;
+  }
+
+ public:
+  // The application uses a single context
+  static Cache& current() {
+    static Cache cache;
+    return cache;
+  }
+
+  void useProgram(GLuint _program) {
+    if (change(program, _program))
+      glUseProgram(_program);
+  }
+
+  void bindVertexArray(GLuint _vertexArray) {
+    if (change(vertexArray, _vertexArray))
+      glBindVertexArray(_vertexArray);
+  }
+
+  // Binds both the draw and the read framebuffer
+  void bindFramebuffer(GLuint _framebuffer) {
+    if (change(framebuffer, _framebuffer))
+      glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+  }
+
+  void activeTexture(GLuint _unit) {
+    if (_unit >= TEXTURE_UNIT_NUM) {
+      activeUnit = UNKNOWN;
+      stats.issued++;
+      glActiveTexture(GL_TEXTURE0 + _unit);
+      return;
+    }
+    if (change(activeUnit, _unit))
+      glActiveTexture(GL_TEXTURE0 + _unit);
+  }
+
+  // Bind to the active unit
+  void bindTexture(GLenum _target, GLuint _texture) {
+    int target = targetOf(_target);
+    if (target < 0 || activeUnit == UNKNOWN) {
+      if (target >= 0)
+        for (int u = 0; u < TEXTURE_UNIT_NUM; u++)
+          texture[u][target] = UNKNOWN;
+      stats.issued++;
+      glBindTexture(_target, _texture);
+      return;
+    }
+    if (change(texture[activeUnit][target], _texture))
+      glBindTexture(_target, _texture);
+  }
+
+  void bindTexture(GLuint _unit, GLenum _target, GLuint _texture) {
+    int target = targetOf(_target);
+    bool known = target >= 0 && _unit < TEXTURE_UNIT_NUM;
+    // Skip the unit switch too when the texture is already there
+    if (known && enabled && texture[_unit][target] == _texture) {
+      stats.filtered += activeUnit == _unit ? 1 : 2;
+      return;
+    }
+    if (!hasDirectStateAccess()) {
+      activeTexture(_unit);
+      bindTexture(_target, _texture);
+      return;
+    }
+    if (known && texture[_unit][target] == _texture)
+      stats.filtered++;
+    else
+      stats.issued++;
+    glBindTextureUnit(_unit, _texture);
+    if (!known)
+      return;
+    // Binding 0 clears every target of the unit
+    if (_texture == 0)
+      for (int t = 0; t < TARGET_NUM; t++)
+        texture[_unit][t] = 0;
+    texture[_unit][target] = _texture;
+  }
+
+  // GL unbinds deleted objects from the current context, to be called
+  // along with glDelete*()
+  void forgetProgram(GLuint _program) {
+    if (_program != 0 && program == _program)
+      program = UNKNOWN;
+  }
+  void forgetVertexArray(GLuint _vertexArray) {
+    if (_vertexArray != 0 && vertexArray == _vertexArray)
+      vertexArray = 0;
+  }
+  void forgetFramebuffer(GLuint _framebuffer) {
+    if (_framebuffer != 0 && framebuffer == _framebuffer)
+      framebuffer = 0;
+  }
+  void forgetTexture(GLuint _texture) {
+    if (_texture == 0)
+      return;
+    for (int u = 0; u < TEXTURE_UNIT_NUM; u++)
+      for (int t = 0; t < TARGET_NUM; t++)
+        if (texture[u][t] == _texture)
+          texture[u][t] = 0;
+  }
+
+  // Forget everything, the next bind of each kind reaches GL
+  void invalidate() {
+    program = vertexArray = framebuffer = activeUnit = UNKNOWN;
+    for (int u = 0; u < TEXTURE_UNIT_NUM; u++)
+      for (int t = 0; t < TARGET_NUM; t++)
+        texture[u][t] = UNKNOWN;
+  }
+
+  void setEnabled(bool _enabled) { enabled = _enabled; }
+  bool isEnabled() const { return enabled; }
+
+  const Stats& getStats() const { return stats; }
+  void resetStats() { stats.issued = stats.filtered = 0; }
+};
+}  // namespace GLState
@@ -0,0 +1,88 @@
+// GPU Pass Timer
+//
+// Measures the GPU time between begin() and end() with GL_TIME_ELAPSED
+// queries. Results arrive a few frames late, so the timer cycles through
+// QUERY_NUM queries and only reads those whose result is available; it
+// never waits for the GPU. Only one timer may run at a time.
+
+#pragma once
+
+#include <gl_env.h>
+
+namespace Profiling {
+class GpuTimer {
+ public:
+  static const int QUERY_NUM = 4;
+
+ private:
+  GLuint query[QUERY_NUM];
+  bool issued[QUERY_NUM];
+  int next;
+  bool running;
+  double milliseconds;
+
+  // Forbid copying, the GL names are owned
+  GpuTimer(const GpuTimer& _copy) = delete;
+  GpuTimer& operator=(const GpuTimer& _copy) = delete;
+
+ public:
+  GpuTimer() : next(0), running(false), milliseconds(0.0) {
+    for (int i = 0; i < QUERY_NUM; i++) {
+      query[i] = 0;
+      issued[i] = false;
+    }
+  }
+  // GL names are only held between init() and clear()
+  ~GpuTimer() {
+    if (available())
+      clear();
+  }
+
+  bool available() const { return query[0] != 0; }
+
+  void init() {
+    clear();
+    glGenQueries(QUERY_NUM, query);
+  }
+
+  void clear() {
+    glDeleteQueries(QUERY_NUM, query);
+    for (int i = 0; i < QUERY_NUM; i++) {
+      query[i] = 0;
+      issued[i] = false;
+    }
+    running = false;
+  }
+
+  void begin() {
+    if (!available() || running)
+      return;
+    // The query about to be reused is the oldest, collect it first
+    if (issued[next]) {
+      GLint ready = 0;
+      glGetQueryObjectiv(query[next], GL_QUERY_RESULT_AVAILABLE, &ready);
+      if (ready) {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(query[next], GL_QUERY_RESULT, &nanoseconds);
+        milliseconds = nanoseconds / 1000000.0;
+      }
+    }
+    glBeginQuery(GL_TIME_ELAPSED, query[next]);
+    running = true;
+  }
+
+  // A running timer ignores begin() and a stopped one end(), so a span may
+  // start in whichever of several places runs first
+  void end() {
+    if (!running)
+      return;
+    running = false;
+    glEndQuery(GL_TIME_ELAPSED);
+    issued[next] = true;
+    next = (next + 1) % QUERY_NUM;
+  }
+
+  // The latest result, QUERY_NUM - 1 frames old at best
+  double getMilliseconds() const { return milliseconds; }
+};
+}  // namespace Profiling
@@ -0,0 +1,280 @@
+// Mesh Simplification
+//
+// Quadric error metric simplifier (Garland & Heckbert) built on half-edge
+// collapses: a vertex is only ever merged into one of its neighbours, so
+// every simplified level indexes the vertices of the original mesh and
+// needs nothing but its own index range. Vertices on open borders and on
+// seams (several vertices sharing one position, as left by UV or normal
+// discontinuities) never move, and a caller predicate may forbid further
+// collapses, e.g. between vertices skinned to different bones.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace MeshSimplify {
+// Sum of squared distances to a set of planes, weighted by triangle area
+struct Quadric {
+  double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+  double weight;
+
+  Quadric()
+      : a00(0), a01(0), a02(0), a03(0), a11(0), a12(0), a13(0), a22(0),
+        a23(0), a33(0), weight(0) {}
+
+  static Quadric fromPlane(const glm::dvec3& _n, double _d, double _w) {
+    Quadric q;
+    q.a00 = _w * _n.x * _n.x;
+    q.a01 = _w * _n.x * _n.y;
+    q.a02 = _w * _n.x * _n.z;
+    q.a03 = _w * _n.x * _d;
+    q.a11 = _w * _n.y * _n.y;
+    q.a12 = _w * _n.y * _n.z;
+    q.a13 = _w * _n.y * _d;
+    q.a22 = _w * _n.z * _n.z;
+    q.a23 = _w * _n.z * _d;
+    q.a33 = _w * _d * _d;
+    q.weight = _w;
+    return q;
+  }
+
+  Quadric& operator+=(const Quadric& _q) {
+    a00 += _q.a00;
+    a01 += _q.a01;
+    a02 += _q.a02;
+    a03 += _q.a03;
+    a11 += _q.a11;
+    a12 += _q.a12;
+    a13 += _q.a13;
+    a22 += _q.a22;
+    a23 += _q.a23;
+    a33 += _q.a33;
+    weight += _q.weight;
+    return *this;
+  }
+
+  double evaluate(const glm::vec3& _p) const {
+    double x = _p.x, y = _p.y, z = _p.z;
+    double r = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z +
+               2 * a03 * x + a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+               a22 * z * z + 2 * a23 * z + a33;
+    return r > 0 ? r : 0;
+  }
+};
+
+class Simplifier {
+ public:
+  // Whether vertex _from may be merged into vertex _to
+  typedef std::function<bool(unsigned int _from, unsigned int _to)>
+      CollapsePredicate;
+
+ private:
+  struct Collapse {
+    double cost;
+    unsigned int from;
+    unsigned int to;
+    bool operator<(const Collapse& _other) const {
+      return cost < _other.cost;
+    }
+  };
+
+  std::vector<unsigned int> indices;
+  std::vector<glm::vec3> position;
+  std::vector<Quadric> quadric;
+  std::vector<char> locked;
+  CollapsePredicate canCollapse;
+  float error;
+
+  void lockSeams() {
+    std::vector<unsigned int> order(position.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = (unsigned int)i;
+    auto less = [this](unsigned int _a, unsigned int _b) {
+      const glm::vec3 &a = position[_a], &b = position[_b];
+      if (a.x != b.x)
+        return a.x < b.x;
+      if (a.y != b.y)
+        return a.y < b.y;
+      return a.z < b.z;
+    };
+    std::sort(order.begin(), order.end(), less);
+    for (size_t i = 1; i < order.size(); i++) {
+      if (position[order[i]] == position[order[i - 1]])
+        locked[order[i]] = locked[order[i - 1]] = 1;
+    }
+  }
+
+  // Edges used by one triangle, or by more than two
+  void lockBorders() {
+    std::vector<uint64_t> edges;
+    edges.reserve(indices.size());
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+      for (int k = 0; k < 3; k++) {
+        uint64_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+        edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();) {
+      size_t j = i;
+      while (j < edges.size() && edges[j] == edges[i])
+        j++;
+      if (j - i != 2)
+        locked[edges[i] >> 32] = locked[edges[i] & 0xffffffffu] = 1;
+      i = j;
+    }
+  }
+
+  glm::vec3 triangleNormal(const unsigned int* _t,
+                           unsigned int _from,
+                           unsigned int _to) const {
+    glm::vec3 p[3];
+    for (int k = 0; k < 3; k++)
+      p[k] = position[_t[k] == _from ? _to : _t[k]];
+    return glm::cross(p[1] - p[0], p[2] - p[0]);
+  }
+
+  // Moving _from onto _to must not turn any surviving triangle over
+  bool flips(const std::vector<unsigned int>& _offset,
+             const std::vector<unsigned int>& _adjacency,
+             unsigned int _from,
+             unsigned int _to) const {
+    for (unsigned int a = _offset[_from]; a < _offset[_from + 1]; a++) {
+      const unsigned int* t = &indices[_adjacency[a] * 3];
+      if (t[0] == _to || t[1] == _to || t[2] == _to)
+        continue;
+      glm::vec3 before = triangleNormal(t, _from, _from);
+      glm::vec3 after = triangleNormal(t, _from, _to);
+      if (glm::dot(before, after) <= 0.0f)
+        return true;
+    }
+    return false;
+  }
+
+ public:
+  Simplifier(const unsigned int* _indices,
+             size_t _indexCount,
+             const std::vector<glm::vec3>& _position,
+             CollapsePredicate _canCollapse = CollapsePredicate())
+      : indices(_indices, _indices + _indexCount / 3 * 3),
+        position(_position),
+        quadric(_position.size()),
+        locked(_position.size(), 0),
+        canCollapse(_canCollapse),
+        error(0.0f) {
+    for (size_t t = 0; t < indices.size(); t += 3) {
+      const glm::vec3& p0 = position[indices[t]];
+      glm::dvec3 n = glm::cross(glm::dvec3(position[indices[t + 1]] - p0),
+                                glm::dvec3(position[indices[t + 2]] - p0));
+      double area2 = glm::length(n);
+      if (area2 <= 0.0)
+        continue;
+      n /= area2;
+      Quadric q = Quadric::fromPlane(n, -glm::dot(n, glm::dvec3(p0)),
+                                     area2 * 0.5);
+      for (int k = 0; k < 3; k++)
+        quadric[indices[t + k]] += q;
+    }
+    lockSeams();
+    lockBorders();
+  }
+
+  // Collapse edges, cheapest first, until at most _targetIndexCount indices
+  // remain or no allowed collapse is left. May be called again with a
+  // smaller target to continue from the current result.
+  const std::vector<unsigned int>& simplify(size_t _targetIndexCount) {
+    size_t vertexNum = position.size();
+    std::vector<unsigned int> offset(vertexNum + 1);
+    std::vector<unsigned int> adjacency;
+    std::vector<Collapse> candidates;
+    std::vector<char> touched(vertexNum);
+    while (indices.size() > _targetIndexCount) {
+      size_t triangleNum = indices.size() / 3;
+      std::fill(offset.begin(), offset.end(), 0);
+      for (size_t i = 0; i < indices.size(); i++)
+        offset[indices[i] + 1]++;
+      for (size_t v = 0; v < vertexNum; v++)
+        offset[v + 1] += offset[v];
+      adjacency.resize(indices.size());
+      {
+        std::vector<unsigned int> fill(offset.begin(), offset.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++)
+          adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+      }
+
+      candidates.clear();
+      for (size_t t = 0; t < triangleNum; t++) {
+        for (int k = 0; k < 6; k++) {
+          unsigned int from = indices[t * 3 + k % 3];
+          unsigned int to = indices[t * 3 + (k < 3 ? k + 1 : k + 2) % 3];
+          if (locked[from] || from == to)
+            continue;
+          if (canCollapse && !canCollapse(from, to))
+            continue;
+          Quadric q = quadric[from];
+          q += quadric[to];
+          Collapse collapse = {q.evaluate(position[to]), from, to};
+          candidates.push_back(collapse);
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+
+      // Collapses within one pass touch disjoint neighbourhoods, so the
+      // adjacency built above stays valid for every untouched vertex
+      std::fill(touched.begin(), touched.end(), 0);
+      size_t removeNum = (indices.size() - _targetIndexCount + 2) / 3;
+      size_t removed = 0;
+      size_t collapsed = 0;
+      for (size_t c = 0; c < candidates.size() && removed < removeNum; c++) {
+        unsigned int from = candidates[c].from, to = candidates[c].to;
+        if (touched[from] || touched[to] ||
+            flips(offset, adjacency, from, to))
+          continue;
+        for (unsigned int a = offset[from]; a < offset[from + 1]; a++) {
+          unsigned int* t = &indices[adjacency[a] * 3];
+          bool degenerate = false;
+          for (int k = 0; k < 3; k++) {
+            degenerate |= t[k] == to;
+            touched[t[k]] = 1;
+          }
+          for (int k = 0; k < 3; k++)
+            if (t[k] == from)
+              t[k] = to;
+          if (degenerate)
+            removed++;
+        }
+        Quadric& merged = quadric[to];
+        merged += quadric[from];
+        if (merged.weight > 0.0)
+          error = std::max(
+              error, (float)std::sqrt(candidates[c].cost / merged.weight));
+        collapsed++;
+      }
+      if (collapsed == 0)
+        break;
+
+      size_t kept = 0;
+      for (size_t t = 0; t < indices.size(); t += 3) {
+        unsigned int a = indices[t], b = indices[t + 1], c = indices[t + 2];
+        if (a == b || b == c || a == c)
+          continue;
+        indices[kept++] = a;
+        indices[kept++] = b;
+        indices[kept++] = c;
+      }
+      indices.resize(kept);
+    }
+    return indices;
+  }
+
+  // Largest distance, in mesh units, by which a collapse so far moved the
+  // surface away from the original
+  float getError() const { return error; }
+};
+}  // namespace MeshSimplify
@@ -0,0 +1,201 @@
+// Meshlet Clustering
+//
+// Splits the triangle list of a mesh into small clusters, each with a
+// bounding sphere and a cone bounding its triangle normals. Clusters that
+// lie outside the frustum or face away from the camera can then be dropped
+// before any of their vertices are shaded. The builder reorders the index
+// list so that the triangles of one cluster are contiguous.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <frustum_culling.h>
+
+#include <glm/glm.hpp>
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+namespace Meshlet {
+struct Cluster {
+  // Index range in the scene index buffer and the mesh entry drawing it
+  unsigned int firstIndex;
+  unsigned int indexCount;
+  unsigned int entry;
+  Culling::BoundingSphere sphere;
+  // Sine of the angle between the cone surface and the plane orthogonal to
+  // coneAxis, 1 when the normals spread too much to ever cull the cluster
+  glm::vec3 coneAxis;
+  float coneCutoff;
+
+  Cluster()
+      : firstIndex(0),
+        indexCount(0),
+        entry(0),
+        coneAxis(0.0f, 0.0f, 1.0f),
+        coneCutoff(1.0f) {}
+
+  // True when every triangle faces away from _eye, given in the space the
+  // cluster was built in. Counter-clockwise triangles are front facing.
+  bool backfacing(const glm::vec3& _eye) const {
+    glm::vec3 d = sphere.center - _eye;
+    return glm::dot(d, coneAxis) >=
+           coneCutoff * glm::length(d) + sphere.radius;
+  }
+};
+
+namespace Detail {
+template <typename PositionAt>
+Cluster boundCluster(const unsigned int* _indices,
+                     size_t _indexCount,
+                     const std::vector<unsigned int>& _vertices,
+                     PositionAt& _position) {
+  Cluster cluster;
+  cluster.indexCount = (unsigned int)_indexCount;
+  Culling::AABB box;
+  for (size_t i = 0; i < _vertices.size(); i++)
+    box.expand(_position(_vertices[i]));
+  cluster.sphere = Culling::sphereAround(
+      box, _vertices.size(), [&](size_t i) { return _position(_vertices[i]); });
+
+  std::vector<glm::vec3> normals;
+  normals.reserve(_indexCount / 3);
+  glm::vec3 sum(0.0f);
+  for (size_t i = 0; i + 2 < _indexCount; i += 3) {
+    glm::vec3 p0 = _position(_indices[i]);
+    glm::vec3 n = glm::cross(_position(_indices[i + 1]) - p0,
+                             _position(_indices[i + 2]) - p0);
+    float len = glm::length(n);
+    if (len <= 1e-12f)
+      continue;
+    normals.push_back(n / len);
+    sum += normals.back();
+  }
+  float sumLen = glm::length(sum);
+  if (normals.empty() || sumLen <= 1e-6f)
+    return cluster;
+  glm::vec3 axis = sum / sumLen;
+  float minDot = 1.0f;
+  for (size_t i = 0; i < normals.size(); i++)
+    minDot = std::min(minDot, glm::dot(normals[i], axis));
+  // Wider than a hemisphere, some triangle always faces the camera
+  if (minDot <= 0.0f)
+    return cluster;
+  cluster.coneAxis = axis;
+  cluster.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+  return cluster;
+}
+}  // namespace Detail
+
+// Cluster the triangles _indices[0, _indexCount) of one mesh, whose values
+// index _vertexCount vertices read through _position(i). The index list is
+// reordered in place; clusters are appended to _clusters with their first
+// index offset by _indexBase.
+//
+// Clusters grow greedily: the next triangle is one adjacent to the last
+// added that needs the fewest new vertices, so clusters stay compact and
+// their normal cones narrow.
+template <typename PositionAt>
+void build(unsigned int* _indices,
+           size_t _indexCount,
+           size_t _vertexCount,
+           PositionAt _position,
+           unsigned int _indexBase,
+           unsigned int _entry,
+           std::vector<Cluster>& _clusters) {
+  size_t triangleNum = _indexCount / 3;
+  if (triangleNum == 0)
+    return;
+
+  // Triangles around each vertex
+  std::vector<unsigned int> adjacencyOffset(_vertexCount + 1, 0);
+  for (size_t i = 0; i < triangleNum * 3; i++)
+    adjacencyOffset[_indices[i] + 1]++;
+  for (size_t v = 0; v < _vertexCount; v++)
+    adjacencyOffset[v + 1] += adjacencyOffset[v];
+  std::vector<unsigned int> adjacency(triangleNum * 3);
+  {
+    std::vector<unsigned int> fill(adjacencyOffset.begin(),
+                                   adjacencyOffset.end() - 1);
+    for (size_t i = 0; i < triangleNum * 3; i++)
+      adjacency[fill[_indices[i]]++] = (unsigned int)(i / 3);
+  }
+
+  std::vector<char> emitted(triangleNum, 0);
+  std::vector<char> inCluster(_vertexCount, 0);
+  std::vector<unsigned int> vertices;
+  std::vector<unsigned int> reordered;
+  reordered.reserve(triangleNum * 3);
+  size_t clusterStart = 0;
+  size_t cursor = 0;
+  size_t last = triangleNum;
+
+  auto newVertices = [&](size_t _t) {
+    const unsigned int* c = _indices + _t * 3;
+    return int(!inCluster[c[0]]) + int(!inCluster[c[1]] && c[1] != c[0]) +
+           int(!inCluster[c[2]] && c[2] != c[0] && c[2] != c[1]);
+  };
+  auto flush = [&]() {
+    if (reordered.size() == clusterStart)
+      return;
+    Cluster cluster =
+        Detail::boundCluster(reordered.data() + clusterStart,
+                             reordered.size() - clusterStart, vertices,
+                             _position);
+    cluster.firstIndex = _indexBase + (unsigned int)clusterStart;
+    cluster.entry = _entry;
+    _clusters.push_back(cluster);
+    for (size_t i = 0; i < vertices.size(); i++)
+      inCluster[vertices[i]] = 0;
+    vertices.clear();
+    clusterStart = reordered.size();
+    last = triangleNum;
+  };
+
+  for (size_t emittedNum = 0; emittedNum < triangleNum; emittedNum++) {
+    size_t best = triangleNum;
+    int bestCost = 4;
+    if (last < triangleNum) {
+      for (int k = 0; k < 3 && bestCost > 0; k++) {
+        unsigned int v = _indices[last * 3 + k];
+        for (unsigned int a = adjacencyOffset[v];
+             a < adjacencyOffset[v + 1] && bestCost > 0; a++) {
+          unsigned int t = adjacency[a];
+          if (emitted[t])
+            continue;
+          int cost = newVertices(t);
+          if (cost < bestCost) {
+            best = t;
+            bestCost = cost;
+          }
+        }
+      }
+    }
+    if (best == triangleNum) {
+      while (emitted[cursor])
+        cursor++;
+      best = cursor;
+      bestCost = newVertices(best);
+    }
+    if ((reordered.size() - clusterStart) / 3 >= MESHLET_MAX_TRIANGLES ||
+        vertices.size() + bestCost > MESHLET_MAX_VERTICES)
+      flush();
+
+    emitted[best] = 1;
+    for (int k = 0; k < 3; k++) {
+      unsigned int v = _indices[best * 3 + k];
+      if (!inCluster[v]) {
+        inCluster[v] = 1;
+        vertices.push_back(v);
+      }
+      reordered.push_back(v);
+    }
+    last = best;
+  }
+  flush();
+  std::copy(reordered.begin(), reordered.end(), _indices);
+}
+}  // namespace Meshlet
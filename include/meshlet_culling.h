@@ -0,0 +1,333 @@
+// GPU Meshlet Culling
+//
+// A compute pre-pass over the scene's meshlets (see meshlet.h). Each work
+// group tests one cluster against the frustum and its normal cone, and the
+// clusters that survive have their indices appended to a compacted index
+// buffer, inside the range of the draw they belong to. The output command
+// list keeps the layout of the scene's, with every count replaced by the
+// number of indices kept, so Scene::render() draws it directly. Clusters
+// are built on the full detail meshes, so this pass always draws level 0
+// whatever Scene::selectLevels() picked.
+// Needs compute shaders and storage buffers (GL 4.3).
+
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include <gl_env.h>
+#include <gl_state.h>
+#include <skeletal_mesh.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+namespace Culling {
+class MeshletCuller {
+ public:
+  static bool isSupported() {
+    return GLEW_VERSION_4_3 ||
+           (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object &&
+            GLEW_ARB_multi_draw_indirect);
+  }
+
+ private:
+  // std430 layout of a cluster
+  struct PackedCluster {
+    glm::vec4 sphere;
+    glm::vec4 cone;
+    // First index, index count, command, nonzero to skip the tests
+    unsigned int range[4];
+  };
+
+  GLuint program;
+  GLuint clusterBuffer;
+  GLuint commandBuffer;
+  GLuint indexBuffer;
+  GLuint statsBuffer[2];
+  const SkeletalMesh::Scene* scene;
+  std::vector<SkeletalMesh::DrawElementsIndirectCommand> resetCommand;
+  // Clusters refer to draws by position, which a reordered list changes
+  unsigned int drawOrder;
+  unsigned int clusterNum;
+  unsigned int frame;
+  unsigned int visibleNum;
+
+  // Forbid copying, the GL names are owned
+  MeshletCuller(const MeshletCuller& _copy) = delete;
+  MeshletCuller& operator=(const MeshletCuller& _copy) = delete;
+
+  static const char* cullCS() {
+    return "#version 430\n"
+           "layout (local_size_x = 64) in;\n"
+           "struct Command {\n"
+           "    uint count;\n"
+           "    uint instanceCount;\n"
+           "    uint firstIndex;\n"
+           "    int baseVertex;\n"
+           "    uint baseInstance;\n"
+           "};\n"
+           "struct Cluster {\n"
+           "    vec4 sphere;\n"
+           "    vec4 cone;\n"
+           "    uvec4 range;\n"
+           "};\n"
+           "layout (std430, binding = 0) readonly buffer Input { Command inCommand[]; };\n"
+           "layout (std430, binding = 1) buffer Output { Command outCommand[]; };\n"
+           "layout (std430, binding = 2) readonly buffer Clusters { Cluster cluster[]; };\n"
+           "layout (std430, binding = 3) readonly buffer Indices { uint inIndex[]; };\n"
+           "layout (std430, binding = 4) writeonly buffer Compacted { uint outIndex[]; };\n"
+           "layout (std430, binding = 5) buffer Stats { uint visibleNum; };\n"
+           "uniform vec4 frustumPlane[6];\n"
+           "uniform vec3 eye;\n"
+           "uniform uint clusterNum;\n"
+           "shared bool keep;\n"
+           "shared uint offset;\n"
+           "bool isVisible(Cluster c) {\n"
+           "    if (c.range.w != 0u) return true;\n"
+           "    for (int i = 0; i < 6; i++)\n"
+           "        if (dot(frustumPlane[i].xyz, c.sphere.xyz) + frustumPlane[i].w < -c.sphere.w)\n"
+           "            return false;\n"
+           "    vec3 d = c.sphere.xyz - eye;\n"
+           "    return dot(d, c.cone.xyz) < c.cone.w * length(d) + c.sphere.w;\n"
+           "}\n"
+           "void main() {\n"
+           "    uint id = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;\n"
+           "    if (id >= clusterNum) return;\n"
+           "    Cluster c = cluster[id];\n"
+           "    if (gl_LocalInvocationIndex == 0u) {\n"
+           "        keep = inCommand[c.range.z].instanceCount != 0u && isVisible(c);\n"
+           "        if (keep) {\n"
+           "            offset = atomicAdd(outCommand[c.range.z].count, c.range.y);\n"
+           "            atomicAdd(visibleNum, 1u);\n"
+           "        }\n"
+           "    }\n"
+           "    barrier();\n"
+           "    if (!keep) return;\n"
+           "    uint dst = outCommand[c.range.z].firstIndex + offset;\n"
+           "    for (uint i = gl_LocalInvocationIndex; i < c.range.y; i += 64u)\n"
+           "        outIndex[dst + i] = inIndex[c.range.x + i];\n"
+           "}\n";
+  }
+
+  static GLuint createComputeProgram(const char* _source) {
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &_source, NULL);
+    glCompileShader(shader);
+    GLint status;
+    char infoLog[512];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+      glGetShaderInfoLog(shader, 512, NULL, infoLog);
+      std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n"
+                << infoLog << std::endl;
+      glDeleteShader(shader);
+      return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+      glGetProgramInfoLog(program, 512, NULL, infoLog);
+      std::cout << "ERROR::PROGRAM::COMPILATION_FAILED\n"
+                << infoLog << std::endl;
+      glDeleteProgram(program);
+      return 0;
+    }
+    return program;
+  }
+
+  // Upload the clusters of a scene seen for the first time
+  void upload(const SkeletalMesh::Scene& _scene) {
+    scene = &_scene;
+    drawOrder = _scene.getDrawOrder();
+    const std::vector<SkeletalMesh::DrawElementsIndirectCommand>& commands =
+        _scene.getDrawCommands();
+    const std::vector<Meshlet::Cluster>& clusters = _scene.getMeshlets();
+    clusterNum = (unsigned int)clusters.size();
+
+    const std::vector<SkeletalMesh::MeshEntry>& entries =
+        _scene.getMeshEntries();
+    std::vector<unsigned int> commandOfEntry;
+    resetCommand = commands;
+    for (size_t c = 0; c < commands.size(); c++) {
+      unsigned int entry = commands[c].baseInstance;
+      if (commandOfEntry.size() <= entry)
+        commandOfEntry.resize(entry + 1, 0);
+      commandOfEntry[entry] = (unsigned int)c;
+      resetCommand[c].count = 0;
+      resetCommand[c].firstIndex = entries[entry].indexOffset;
+      resetCommand[c].instanceCount = 1;
+    }
+
+    std::vector<PackedCluster> packed(clusters.size());
+    unsigned int indexNum = 0;
+    for (size_t i = 0; i < clusters.size(); i++) {
+      const Meshlet::Cluster& cluster = clusters[i];
+      packed[i].sphere =
+          glm::vec4(cluster.sphere.center, cluster.sphere.radius);
+      packed[i].cone = glm::vec4(cluster.coneAxis, cluster.coneCutoff);
+      packed[i].range[0] = cluster.firstIndex;
+      packed[i].range[1] = cluster.indexCount;
+      packed[i].range[2] = cluster.entry < commandOfEntry.size()
+                               ? commandOfEntry[cluster.entry]
+                               : 0;
+      packed[i].range[3] = _scene.isSkinned(cluster.entry) ? 1 : 0;
+      indexNum = std::max(indexNum, cluster.firstIndex + cluster.indexCount);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 sizeof(PackedCluster) * packed.size(), packed.data(),
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER,
+        sizeof(SkeletalMesh::DrawElementsIndirectCommand) * commands.size(),
+        NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * indexNum, NULL,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+ public:
+  MeshletCuller()
+      : program(0),
+        clusterBuffer(0),
+        commandBuffer(0),
+        indexBuffer(0),
+        statsBuffer{0, 0},
+        scene(NULL),
+        drawOrder(0),
+        clusterNum(0),
+        frame(0),
+        visibleNum(0) {}
+  // GL names are only held between init() and clear()
+  ~MeshletCuller() {
+    if (available())
+      clear();
+  }
+
+  void clear() {
+    GLState::Cache::current().forgetProgram(program);
+    glDeleteProgram(program);
+    program = 0;
+    glDeleteBuffers(1, &clusterBuffer);
+    glDeleteBuffers(1, &commandBuffer);
+    glDeleteBuffers(1, &indexBuffer);
+    glDeleteBuffers(2, statsBuffer);
+    clusterBuffer = commandBuffer = indexBuffer = 0;
+    statsBuffer[0] = statsBuffer[1] = 0;
+    scene = NULL;
+    resetCommand.clear();
+    clusterNum = 0;
+  }
+
+  bool available() const { return program != 0; }
+
+  bool init() {
+    clear();
+    if (!isSupported())
+      return false;
+    program = createComputeProgram(cullCS());
+    if (!available())
+      return false;
+    glGenBuffers(1, &clusterBuffer);
+    glGenBuffers(1, &commandBuffer);
+    glGenBuffers(1, &indexBuffer);
+    glGenBuffers(2, statsBuffer);
+    for (int i = 0; i < 2; i++) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer[i]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL,
+                   GL_DYNAMIC_READ);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return true;
+  }
+
+  // Call once per frame before cull(). A scene still loading is skipped,
+  // its clusters are being built on a loader thread, and cull() then does
+  // nothing for it.
+  void prepare(const SkeletalMesh::Scene& _scene) {
+    if (!available())
+      return;
+    if (_scene.isLoading()) {
+      scene = NULL;
+      return;
+    }
+    if (scene != &_scene ||
+        resetCommand.size() != _scene.getDrawCommands().size() ||
+        drawOrder != _scene.getDrawOrder() ||
+        clusterNum != _scene.getMeshlets().size())
+      upload(_scene);
+
+    // As in OcclusionCuller, read the counter of two frames ago
+    GLuint* stats = statsBuffer + (frame & 1);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, *stats);
+    if (frame >= 2)
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(visibleNum),
+                         &visibleNum);
+    GLuint zero = 0;
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    frame++;
+  }
+
+  // Keep the clusters of the draws in _inputCommands (the scene's own list
+  // when 0) whose instance count is nonzero and that pass the frustum and
+  // cone tests. _eye is the camera position in model space.
+  void cull(const SkeletalMesh::Scene& _scene,
+            GLuint _inputCommands,
+            const glm::mat4& _modelViewProj,
+            const glm::vec3& _eye) {
+    if (!available() || scene != &_scene || clusterNum == 0)
+      return;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER, 0,
+        sizeof(SkeletalMesh::DrawElementsIndirectCommand) *
+            resetCommand.size(),
+        resetCommand.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    Frustum frustum(_modelViewProj);
+    glm::vec4 planes[6];
+    for (int i = 0; i < 6; i++)
+      planes[i] = frustum.plane(i);
+    GLState::Cache::current().useProgram(program);
+    glUniform4fv(glGetUniformLocation(program, "frustumPlane"), 6,
+                 glm::value_ptr(planes[0]));
+    glUniform3fv(glGetUniformLocation(program, "eye"), 1,
+                 glm::value_ptr(_eye));
+    glUniform1ui(glGetUniformLocation(program, "clusterNum"), clusterNum);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0,
+                     _inputCommands != 0 ? _inputCommands
+                                         : _scene.getIndirectBuffer());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, clusterBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _scene.getIndexBuffer());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, indexBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, statsBuffer[(frame + 1) & 1]);
+    // One work group per cluster, folded into two dimensions past the
+    // minimum dispatch limit
+    GLuint groupX = std::min<GLuint>(clusterNum, 65535);
+    GLuint groupY = (clusterNum + groupX - 1) / groupX;
+    glDispatchCompute(groupX, groupY, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT |
+                    GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  // Pass both to Scene::render()
+  GLuint drawCommandBuffer() const { return commandBuffer; }
+  GLuint drawIndexBuffer() const { return indexBuffer; }
+
+  // Clusters kept during the frame before last, over all cull() calls
+  unsigned int visibleCount() const { return visibleNum; }
+  unsigned int totalCount() const { return clusterNum; }
+};
+}  // namespace Culling
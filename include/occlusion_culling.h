@@ -0,0 +1,398 @@
+// GPU Occlusion Culling against a Hierarchical-Z Pyramid
+//
+// Two-phase scheme driven from the geometry pass:
+//   1. cullPhase(0) tests every draw against the pyramid left by the previous
+//      frame and writes the survivors' instance counts into commandBuffer(0),
+//      which is drawn first.
+//   2. buildPyramid() max-reduces the depth written so far.
+//   3. cullPhase(1) re-tests only the draws rejected in phase 1 against the
+//      fresh pyramid, so objects hidden last frame but visible now still
+//      appear this frame. commandBuffer(1) is drawn on top.
+// The pyramid from step 2 is what the next frame's phase 1 tests against.
+// Needs compute shaders and storage buffers (GL 4.3).
+
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gl_env.h>
+#include <gl_state.h>
+#include <skeletal_mesh.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+namespace Culling {
+class OcclusionCuller {
+ public:
+  static bool isSupported() {
+    return GLEW_VERSION_4_3 ||
+           (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object &&
+            GLEW_ARB_multi_draw_indirect);
+  }
+
+ private:
+  GLuint pyramidProgram;
+  GLuint cullProgram;
+  GLuint pyramid;
+  int width;
+  int height;
+  int levelNum;
+  bool pyramidValid;
+
+  GLuint inputBuffer;
+  GLuint outputBuffer[2];
+  GLuint boundsBuffer;
+  GLuint visibilityBuffer;
+  GLuint statsBuffer[2];
+  unsigned int frame;
+  unsigned int commandNum;
+  unsigned int visibleNum[2];
+
+  // Forbid copying, the GL names are owned
+  OcclusionCuller(const OcclusionCuller& _copy) = delete;
+  OcclusionCuller& operator=(const OcclusionCuller& _copy) = delete;
+
+  static GLuint createComputeProgram(const char* _source) {
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &_source, NULL);
+    glCompileShader(shader);
+    GLint status;
+    char infoLog[512];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+      glGetShaderInfoLog(shader, 512, NULL, infoLog);
+      std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n"
+                << infoLog << std::endl;
+      glDeleteShader(shader);
+      return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+      glGetProgramInfoLog(program, 512, NULL, infoLog);
+      std::cout << "ERROR::PROGRAM::COMPILATION_FAILED\n"
+                << infoLog << std::endl;
+      glDeleteProgram(program);
+      return 0;
+    }
+    return program;
+  }
+
+  // Level 0 copies the depth buffer, every other level keeps the farthest
+  // depth of the texels it covers. Odd edges fold in the extra texel.
+  static const char* pyramidCS() {
+    return "#version 430\n"
+           "layout (local_size_x = 8, local_size_y = 8) in;\n"
+           "uniform sampler2D depthInput;\n"
+           "layout (r32f, binding = 0) uniform readonly image2D srcLevel;\n"
+           "layout (r32f, binding = 1) uniform writeonly image2D dstLevel;\n"
+           "uniform bool firstLevel;\n"
+           "void main() {\n"
+           "    ivec2 dst = ivec2(gl_GlobalInvocationID.xy);\n"
+           "    ivec2 dstSize = imageSize(dstLevel);\n"
+           "    if (any(greaterThanEqual(dst, dstSize))) return;\n"
+           "    if (firstLevel) {\n"
+           "        imageStore(dstLevel, dst, vec4(texelFetch(depthInput, dst, 0).r));\n"
+           "        return;\n"
+           "    }\n"
+           "    ivec2 srcSize = imageSize(srcLevel);\n"
+           "    ivec2 src = dst * 2;\n"
+           "    ivec2 last = srcSize - 1;\n"
+           "    ivec2 extent = ivec2(1);\n"
+           "    if (dst.x == dstSize.x - 1 && (srcSize.x & 1) == 1) extent.x = 2;\n"
+           "    if (dst.y == dstSize.y - 1 && (srcSize.y & 1) == 1) extent.y = 2;\n"
+           "    float depth = 0.0;\n"
+           "    for (int y = 0; y <= extent.y; y++)\n"
+           "        for (int x = 0; x <= extent.x; x++)\n"
+           "            depth = max(depth, imageLoad(srcLevel, min(src + ivec2(x, y), last)).r);\n"
+           "    imageStore(dstLevel, dst, vec4(depth));\n"
+           "}\n";
+  }
+
+  static const char* cullCS() {
+    return "#version 430\n"
+           "layout (local_size_x = 64) in;\n"
+           "struct Command {\n"
+           "    uint count;\n"
+           "    uint instanceCount;\n"
+           "    uint firstIndex;\n"
+           "    int baseVertex;\n"
+           "    uint baseInstance;\n"
+           "};\n"
+           "layout (std430, binding = 0) readonly buffer Input { Command inCommand[]; };\n"
+           "layout (std430, binding = 1) writeonly buffer Output { Command outCommand[]; };\n"
+           "layout (std430, binding = 2) readonly buffer Bounds { vec4 bounds[]; };\n"
+           "layout (std430, binding = 3) buffer Visibility { uint visible[]; };\n"
+           "layout (std430, binding = 4) buffer Stats { uint visibleNum; };\n"
+           "uniform mat4 modelViewProj;\n"
+           "uniform sampler2D hiZ;\n"
+           "uniform vec2 viewport;\n"
+           "uniform int levelNum;\n"
+           "uniform bool hiZValid;\n"
+           "uniform int phase;\n"
+           "uniform uint commandNum;\n"
+           "bool isVisible(vec3 bmin, vec3 bmax) {\n"
+           "    vec3 ndcMin = vec3(1e30), ndcMax = vec3(-1e30);\n"
+           "    for (int i = 0; i < 8; i++) {\n"
+           "        vec3 corner = vec3((i & 1) != 0 ? bmax.x : bmin.x,\n"
+           "                           (i & 2) != 0 ? bmax.y : bmin.y,\n"
+           "                           (i & 4) != 0 ? bmax.z : bmin.z);\n"
+           "        vec4 clip = modelViewProj * vec4(corner, 1.0);\n"
+           "        if (clip.w <= 0.0) return true;\n"
+           "        vec3 ndc = clip.xyz / clip.w;\n"
+           "        ndcMin = min(ndcMin, ndc);\n"
+           "        ndcMax = max(ndcMax, ndc);\n"
+           "    }\n"
+           "    if (any(lessThan(ndcMax, vec3(-1.0))) || any(greaterThan(ndcMin, vec3(1.0))))\n"
+           "        return false;\n"
+           "    if (!hiZValid) return true;\n"
+           "    vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);\n"
+           "    vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);\n"
+           "    vec2 size = (uvMax - uvMin) * viewport;\n"
+           "    float level = ceil(log2(max(max(size.x, size.y), 1.0)));\n"
+           "    level = clamp(level, 0.0, float(levelNum - 1));\n"
+           "    float depth = max(max(textureLod(hiZ, uvMin, level).r,\n"
+           "                          textureLod(hiZ, vec2(uvMax.x, uvMin.y), level).r),\n"
+           "                      max(textureLod(hiZ, vec2(uvMin.x, uvMax.y), level).r,\n"
+           "                          textureLod(hiZ, uvMax, level).r));\n"
+           "    return ndcMin.z * 0.5 + 0.5 <= depth;\n"
+           "}\n"
+           "void main() {\n"
+           "    uint id = gl_GlobalInvocationID.x;\n"
+           "    if (id >= commandNum) return;\n"
+           "    Command command = inCommand[id];\n"
+           "    uint entry = command.baseInstance;\n"
+           "    uint result = 0u;\n"
+           "    if (phase == 0 || visible[id] == 0u)\n"
+           "        result = isVisible(bounds[entry * 2u].xyz, bounds[entry * 2u + 1u].xyz) ? 1u : 0u;\n"
+           "    if (phase == 0)\n"
+           "        visible[id] = result;\n"
+           "    command.instanceCount = result;\n"
+           "    outCommand[id] = command;\n"
+           "    if (result != 0u) atomicAdd(visibleNum, 1u);\n"
+           "}\n";
+  }
+
+  void createPyramid(int _width, int _height) {
+    GLState::Cache::current().forgetTexture(pyramid);
+    glDeleteTextures(1, &pyramid);
+    width = _width;
+    height = _height;
+    levelNum = 1;
+    for (int w = width, h = height; w > 1 || h > 1; levelNum++) {
+      w = w > 1 ? w / 2 : 1;
+      h = h > 1 ? h / 2 : 1;
+    }
+    if (GLState::hasDirectStateAccess()) {
+      glCreateTextures(GL_TEXTURE_2D, 1, &pyramid);
+      glTextureStorage2D(pyramid, levelNum, GL_R32F, width, height);
+      glTextureParameteri(pyramid, GL_TEXTURE_MIN_FILTER,
+                          GL_NEAREST_MIPMAP_NEAREST);
+      glTextureParameteri(pyramid, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTextureParameteri(pyramid, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(pyramid, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    } else {
+      glGenTextures(1, &pyramid);
+      GLState::Cache::current().bindTexture(GL_TEXTURE_2D, pyramid);
+      glTexStorage2D(GL_TEXTURE_2D, levelNum, GL_R32F, width, height);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                      GL_NEAREST_MIPMAP_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    pyramidValid = false;
+  }
+
+ public:
+  OcclusionCuller()
+      : pyramidProgram(0),
+        cullProgram(0),
+        pyramid(0),
+        width(0),
+        height(0),
+        levelNum(0),
+        pyramidValid(false),
+        inputBuffer(0),
+        outputBuffer{0, 0},
+        boundsBuffer(0),
+        visibilityBuffer(0),
+        statsBuffer{0, 0},
+        frame(0),
+        commandNum(0),
+        visibleNum{0, 0} {}
+  // GL names are only held between init() and clear(), so an instance that
+  // outlives the context is safe to destroy
+  ~OcclusionCuller() {
+    if (available())
+      clear();
+  }
+
+  void clear() {
+    GLState::Cache& state = GLState::Cache::current();
+    state.forgetProgram(pyramidProgram);
+    state.forgetProgram(cullProgram);
+    glDeleteProgram(pyramidProgram);
+    glDeleteProgram(cullProgram);
+    pyramidProgram = cullProgram = 0;
+    state.forgetTexture(pyramid);
+    glDeleteTextures(1, &pyramid);
+    pyramid = 0;
+    glDeleteBuffers(1, &inputBuffer);
+    glDeleteBuffers(2, outputBuffer);
+    glDeleteBuffers(1, &boundsBuffer);
+    glDeleteBuffers(1, &visibilityBuffer);
+    glDeleteBuffers(2, statsBuffer);
+    inputBuffer = boundsBuffer = visibilityBuffer = 0;
+    outputBuffer[0] = outputBuffer[1] = 0;
+    statsBuffer[0] = statsBuffer[1] = 0;
+    commandNum = 0;
+    pyramidValid = false;
+  }
+
+  bool available() const { return cullProgram != 0 && pyramidProgram != 0; }
+
+  bool init(int _width, int _height) {
+    clear();
+    if (!isSupported())
+      return false;
+    pyramidProgram = createComputeProgram(pyramidCS());
+    cullProgram = createComputeProgram(cullCS());
+    if (!available()) {
+      clear();
+      return false;
+    }
+    glGenBuffers(1, &inputBuffer);
+    glGenBuffers(2, outputBuffer);
+    glGenBuffers(1, &boundsBuffer);
+    glGenBuffers(1, &visibilityBuffer);
+    glGenBuffers(2, statsBuffer);
+    for (int i = 0; i < 2; i++) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer[i]);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2, NULL,
+                   GL_DYNAMIC_READ);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    createPyramid(_width, _height);
+    return true;
+  }
+
+  void resize(int _width, int _height) {
+    if (available() && (_width != width || _height != height))
+      createPyramid(_width, _height);
+  }
+
+  // Upload the scene's draw list and current culling bounds, call once per
+  // frame before the phases and after Scene::selectLevels()
+  void prepare(const SkeletalMesh::Scene& _scene) {
+    const std::vector<SkeletalMesh::DrawElementsIndirectCommand>& commands =
+        _scene.getDrawCommands();
+    const std::vector<AABB>& bounds = _scene.getCullBounds();
+    GLsizeiptr commandSize =
+        sizeof(SkeletalMesh::DrawElementsIndirectCommand) * commands.size();
+    if (commands.size() != commandNum) {
+      commandNum = (unsigned int)commands.size();
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, inputBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, commandSize, NULL,
+                   GL_DYNAMIC_DRAW);
+      for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, outputBuffer[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, commandSize, NULL,
+                     GL_DYNAMIC_COPY);
+      }
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibilityBuffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * commandNum,
+                   NULL, GL_DYNAMIC_COPY);
+    }
+    // Ranges change with the selected detail levels
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, inputBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, commandSize, commands.data());
+    std::vector<glm::vec4> packed(bounds.size() * 2);
+    for (size_t i = 0; i < bounds.size(); i++) {
+      packed[i * 2] = glm::vec4(bounds[i].min, 0.0f);
+      packed[i * 2 + 1] = glm::vec4(bounds[i].max, 0.0f);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * packed.size(),
+                 packed.data(), GL_STREAM_DRAW);
+
+    // Counters of the previous use of this buffer are long finished, read
+    // them before resetting so the read does not stall the pipeline
+    GLuint* stats = statsBuffer + (frame & 1);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, *stats);
+    if (frame >= 2)
+      glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(visibleNum),
+                         visibleNum);
+    GLuint zero[2] = {0, 0};
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    frame++;
+  }
+
+  void cullPhase(int _phase, const glm::mat4& _modelViewProj) {
+    if (!available() || commandNum == 0)
+      return;
+    GLState::Cache& state = GLState::Cache::current();
+    state.useProgram(cullProgram);
+    glUniformMatrix4fv(glGetUniformLocation(cullProgram, "modelViewProj"), 1,
+                       GL_FALSE, glm::value_ptr(_modelViewProj));
+    glUniform2f(glGetUniformLocation(cullProgram, "viewport"), (float)width,
+                (float)height);
+    glUniform1i(glGetUniformLocation(cullProgram, "levelNum"), levelNum);
+    glUniform1i(glGetUniformLocation(cullProgram, "hiZValid"), pyramidValid);
+    glUniform1i(glGetUniformLocation(cullProgram, "phase"), _phase);
+    glUniform1ui(glGetUniformLocation(cullProgram, "commandNum"), commandNum);
+    glUniform1i(glGetUniformLocation(cullProgram, "hiZ"), 0);
+    state.bindTexture(0, GL_TEXTURE_2D, pyramid);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, inputBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, outputBuffer[_phase]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, boundsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visibilityBuffer);
+    // Each phase counts into its own word of the stats buffer
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 4,
+                      statsBuffer[(frame + 1) & 1], sizeof(GLuint) * _phase,
+                      sizeof(GLuint));
+    glDispatchCompute((commandNum + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  // Rebuild the pyramid from a depth texture of the size given to init()
+  void buildPyramid(GLuint _depthTexture) {
+    if (!available())
+      return;
+    GLState::Cache& state = GLState::Cache::current();
+    state.useProgram(pyramidProgram);
+    glUniform1i(glGetUniformLocation(pyramidProgram, "depthInput"), 0);
+    state.bindTexture(0, GL_TEXTURE_2D, _depthTexture);
+    int w = width, h = height;
+    for (int level = 0; level < levelNum; level++) {
+      glUniform1i(glGetUniformLocation(pyramidProgram, "firstLevel"),
+                  level == 0);
+      glBindImageTexture(0, pyramid, std::max(level - 1, 0), GL_FALSE, 0,
+                         GL_READ_ONLY, GL_R32F);
+      glBindImageTexture(1, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY,
+                         GL_R32F);
+      glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+      w = w > 1 ? w / 2 : 1;
+      h = h > 1 ? h / 2 : 1;
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    pyramidValid = true;
+  }
+
+  GLuint commandBuffer(int _phase) const { return outputBuffer[_phase]; }
+
+  // Draws that survived each phase, as of two frames ago
+  unsigned int visibleCount(int _phase) const { return visibleNum[_phase]; }
+  unsigned int totalCount() const { return commandNum; }
+};
+}  // namespace Culling
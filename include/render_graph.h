@@ -0,0 +1,610 @@
+// Render Graph with Transient Render Targets
+//
+// Passes are added every frame in execution order, each declaring the
+// textures it reads and writes. Before running them the graph works out
+//   - which passes matter: walking backwards from the outputs, a pass is
+//     kept only if something still needed reads what it writes, so passes
+//     whose results nobody consumes are culled without the caller having
+//     to track it;
+//   - how long each transient texture lives: from the first kept pass that
+//     touches it to the last one.
+// Transient textures are taken from a pool right before their first pass
+// and returned right after their last, so textures whose lifetimes do not
+// overlap share one GL texture when their descriptions match. GL 4.1 has
+// no way to place differently shaped textures in the same memory, hence
+// aliasing is by identical description. Pooled textures unused for a few
+// frames are freed.
+//
+// Every pass writing textures runs with a framebuffer holding them bound,
+// color attachments in the order written; passes writing the backbuffer
+// get the default framebuffer.
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gl_env.h>
+#include <gl_state.h>
+
+namespace RenderGraph {
+typedef int ResourceId;
+
+// What a render target holds, formatFor() picks its sized format
+enum TargetUsage {
+  USAGE_OCCLUSION,       // one value in [0, 1]
+  USAGE_NORMAL,          // octahedral encoded, two unsigned normalized
+  USAGE_ALBEDO,          // color in [0, 1] and one material byte
+  USAGE_DEPTH,           // hyperbolic depth positions are rebuilt from
+  USAGE_SHADOW_DISTANCE, // linear distance to a light over its range
+  USAGE_HDR_COLOR,       // unbounded positive color
+  USAGE_LDR_COLOR
+};
+
+// The format policy: the smallest sized format holding each usage at the
+// precision it needs. Unsized formats are left to the driver, which may
+// well store GL_RED as 32-bit float.
+inline GLenum formatFor(TargetUsage _usage) {
+  switch (_usage) {
+    case USAGE_OCCLUSION:
+      return GL_R8;
+    case USAGE_NORMAL:
+      return GL_RG16;
+    case USAGE_ALBEDO:
+      return GL_RGBA8;
+    case USAGE_DEPTH:
+      return GL_DEPTH_COMPONENT32F;
+    case USAGE_SHADOW_DISTANCE:
+      return GL_DEPTH_COMPONENT16;
+    case USAGE_HDR_COLOR:
+      return GL_R11F_G11F_B10F;
+    default:
+      return GL_RGBA8;
+  }
+}
+
+// Short name of a sized format, for reports
+inline const char* formatName(GLenum _format) {
+  switch (_format) {
+    case GL_R8:
+      return "R8";
+    case GL_R16F:
+      return "R16F";
+    case GL_R32F:
+      return "R32F";
+    case GL_RG16:
+      return "RG16";
+    case GL_RG16F:
+      return "RG16F";
+    case GL_RGBA8:
+      return "RGBA8";
+    case GL_RGB10_A2:
+      return "RGB10_A2";
+    case GL_R11F_G11F_B10F:
+      return "R11G11B10F";
+    case GL_RGBA16F:
+      return "RGBA16F";
+    case GL_RGBA32F:
+      return "RGBA32F";
+    case GL_DEPTH_COMPONENT16:
+      return "D16";
+    case GL_DEPTH_COMPONENT24:
+      return "D24";
+    case GL_DEPTH_COMPONENT32F:
+      return "D32F";
+    case GL_DEPTH24_STENCIL8:
+      return "D24S8";
+    default:
+      return "?";
+  }
+}
+
+struct TextureDesc {
+  GLsizei width;
+  GLsizei height;
+  GLenum internalFormat;
+
+  TextureDesc() : width(0), height(0), internalFormat(GL_RGBA8) {}
+  TextureDesc(GLsizei _width, GLsizei _height, GLenum _internalFormat)
+      : width(_width), height(_height), internalFormat(_internalFormat) {}
+  TextureDesc(GLsizei _width, GLsizei _height, TargetUsage _usage)
+      : width(_width), height(_height), internalFormat(formatFor(_usage)) {}
+
+  bool operator<(const TextureDesc& _other) const {
+    if (width != _other.width)
+      return width < _other.width;
+    if (height != _other.height)
+      return height < _other.height;
+    return internalFormat < _other.internalFormat;
+  }
+
+  bool isDepth() const {
+    return internalFormat == GL_DEPTH_COMPONENT16 ||
+           internalFormat == GL_DEPTH_COMPONENT24 ||
+           internalFormat == GL_DEPTH_COMPONENT32 ||
+           internalFormat == GL_DEPTH_COMPONENT32F ||
+           internalFormat == GL_DEPTH_COMPONENT ||
+           isDepthStencil();
+  }
+  bool isDepthStencil() const {
+    return internalFormat == GL_DEPTH24_STENCIL8 ||
+           internalFormat == GL_DEPTH32F_STENCIL8;
+  }
+
+  // Unsized formats are counted as the size drivers usually pick
+  unsigned int bytesPerPixel() const {
+    switch (internalFormat) {
+      case GL_RED:
+      case GL_R8:
+        return 1;
+      case GL_RG8:
+      case GL_R16:
+      case GL_R16F:
+      case GL_DEPTH_COMPONENT16:
+        return 2;
+      case GL_RGBA16:
+      case GL_RGBA16F:
+      case GL_RG32F:
+        return 8;
+      case GL_RGBA32F:
+        return 16;
+      case GL_RGB16F:
+        return 6;
+      case GL_RGB32F:
+        return 12;
+      case GL_DEPTH32F_STENCIL8:
+        return 8;
+      default:
+        return 4;
+    }
+  }
+  size_t bytes() const { return (size_t)width * height * bytesPerPixel(); }
+
+  // Immutable storage only takes sized formats, unsized ones get the size
+  // bytesPerPixel() counts them as
+  GLenum sizedFormat() const {
+    switch (internalFormat) {
+      case GL_RED:
+        return GL_R8;
+      case GL_RG:
+        return GL_RG8;
+      case GL_RGB:
+        return GL_RGB8;
+      case GL_RGBA:
+        return GL_RGBA8;
+      case GL_DEPTH_COMPONENT:
+        return GL_DEPTH_COMPONENT24;
+      case GL_DEPTH_STENCIL:
+        return GL_DEPTH24_STENCIL8;
+      default:
+        return internalFormat;
+    }
+  }
+};
+
+// Transient textures kept between frames for reuse
+class TexturePool {
+ private:
+  struct Entry {
+    GLuint texture;
+    TextureDesc desc;
+    bool inUse;
+    unsigned int lastUsedFrame;
+  };
+
+  std::vector<Entry> entries;
+  unsigned int frame;
+  size_t allocatedBytes;
+
+  // Forbid copying, the GL names are owned
+  TexturePool(const TexturePool& _copy) = delete;
+  TexturePool& operator=(const TexturePool& _copy) = delete;
+
+  static GLuint createTexture(const TextureDesc& _desc) {
+    GLuint texture;
+    if (GLState::hasDirectStateAccess()) {
+      glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+      glTextureStorage2D(texture, 1, _desc.sizedFormat(), _desc.width,
+                         _desc.height);
+      glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      return texture;
+    }
+    GLenum format = GL_RGBA;
+    GLenum type = GL_FLOAT;
+    if (_desc.isDepthStencil()) {
+      format = GL_DEPTH_STENCIL;
+      type = _desc.internalFormat == GL_DEPTH24_STENCIL8
+                 ? GL_UNSIGNED_INT_24_8
+                 : GL_FLOAT_32_UNSIGNED_INT_24_8_REV;
+    } else if (_desc.isDepth()) {
+      format = GL_DEPTH_COMPONENT;
+    } else if (_desc.internalFormat == GL_RED ||
+               _desc.internalFormat == GL_R8 ||
+               _desc.internalFormat == GL_R16 ||
+               _desc.internalFormat == GL_R16F ||
+               _desc.internalFormat == GL_R32F) {
+      format = GL_RED;
+    } else if (_desc.internalFormat == GL_RG8 ||
+               _desc.internalFormat == GL_RG16 ||
+               _desc.internalFormat == GL_RG16F ||
+               _desc.internalFormat == GL_RG32F) {
+      format = GL_RG;
+    } else if (_desc.internalFormat == GL_RGB8 ||
+               _desc.internalFormat == GL_RGB16F ||
+               _desc.internalFormat == GL_R11F_G11F_B10F) {
+      format = GL_RGB;
+    }
+    // Sized here too, so the size counted is the size allocated
+    glGenTextures(1, &texture);
+    GLState::Cache::current().bindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, _desc.sizedFormat(), _desc.width,
+                 _desc.height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+  }
+
+ public:
+  // Frames a texture may stay unused before trim() frees it
+  static const unsigned int KEEP_FRAMES = 3;
+
+  TexturePool() : frame(0), allocatedBytes(0) {}
+  ~TexturePool() { clear(); }
+
+  GLuint acquire(const TextureDesc& _desc) {
+    for (size_t i = 0; i < entries.size(); i++) {
+      Entry& entry = entries[i];
+      if (entry.inUse || _desc < entry.desc || entry.desc < _desc)
+        continue;
+      entry.inUse = true;
+      entry.lastUsedFrame = frame;
+      return entry.texture;
+    }
+    Entry entry = {createTexture(_desc), _desc, true, frame};
+    entries.push_back(entry);
+    allocatedBytes += _desc.bytes();
+    return entry.texture;
+  }
+
+  void release(GLuint _texture) {
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (entries[i].texture == _texture)
+        entries[i].inUse = false;
+    }
+  }
+
+  // Call once per frame, after every texture has been released. The names
+  // of the textures freed are appended to _freed.
+  void trim(std::vector<GLuint>& _freed) {
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+      const Entry& entry = entries[i];
+      if (!entry.inUse && frame - entry.lastUsedFrame > KEEP_FRAMES) {
+        _freed.push_back(entry.texture);
+        GLState::Cache::current().forgetTexture(entry.texture);
+        glDeleteTextures(1, &entry.texture);
+        allocatedBytes -= entry.desc.bytes();
+        continue;
+      }
+      entries[kept++] = entries[i];
+    }
+    entries.resize(kept);
+    frame++;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < entries.size(); i++) {
+      GLState::Cache::current().forgetTexture(entries[i].texture);
+      glDeleteTextures(1, &entries[i].texture);
+    }
+    entries.clear();
+    allocatedBytes = 0;
+  }
+
+  size_t getAllocatedBytes() const { return allocatedBytes; }
+  size_t getTextureNum() const { return entries.size(); }
+};
+
+// A transient texture of the last frame
+struct TargetInfo {
+  std::string name;
+  GLenum format;
+  size_t bytes;
+};
+
+struct GraphStats {
+  unsigned int passNum;
+  unsigned int culledNum;
+  unsigned int transientNum;
+  // Transient memory held by the pool, and what the transient textures
+  // of the last frame would take without sharing
+  size_t pooledBytes;
+  size_t unaliasedBytes;
+};
+
+class Graph {
+ public:
+  typedef std::function<void(const Graph& _graph)> Execute;
+
+ private:
+  struct Resource {
+    std::string name;
+    TextureDesc desc;
+    bool transient;
+    bool backbuffer;
+    bool output;
+    GLuint texture;
+    int firstPass;
+    int lastPass;
+  };
+
+  struct Pass {
+    std::string name;
+    std::vector<ResourceId> reads;
+    std::vector<ResourceId> writes;
+    Execute execute;
+    bool alive;
+  };
+
+  std::vector<Resource> resources;
+  std::vector<Pass> passes;
+  TexturePool pool;
+  // Framebuffers by attachment list, kept while the pool keeps handing
+  // out the same textures
+  std::map<std::vector<GLuint>, GLuint> framebuffers;
+  GraphStats stats;
+  std::vector<TargetInfo> targets;
+
+  // Forbid copying, the GL names are owned
+  Graph(const Graph& _copy) = delete;
+  Graph& operator=(const Graph& _copy) = delete;
+
+  ResourceId addResource(const std::string& _name,
+                         const TextureDesc& _desc,
+                         bool _transient,
+                         bool _backbuffer,
+                         GLuint _texture) {
+    Resource resource;
+    resource.name = _name;
+    resource.desc = _desc;
+    resource.transient = _transient;
+    resource.backbuffer = _backbuffer;
+    resource.output = _backbuffer;
+    resource.texture = _texture;
+    resource.firstPass = -1;
+    resource.lastPass = -1;
+    resources.push_back(resource);
+    return (ResourceId)resources.size() - 1;
+  }
+
+  // Walk back from the outputs, then give every transient texture the
+  // range of kept passes using it
+  void compile() {
+    std::vector<char> needed(resources.size(), 0);
+    for (size_t r = 0; r < resources.size(); r++)
+      needed[r] = resources[r].output;
+    for (int p = (int)passes.size() - 1; p >= 0; p--) {
+      Pass& pass = passes[p];
+      pass.alive = false;
+      for (size_t w = 0; w < pass.writes.size(); w++)
+        pass.alive |= needed[pass.writes[w]] != 0;
+      if (!pass.alive)
+        continue;
+      for (size_t r = 0; r < pass.reads.size(); r++)
+        needed[pass.reads[r]] = 1;
+    }
+    for (int p = 0; p < (int)passes.size(); p++) {
+      if (!passes[p].alive)
+        continue;
+      const Pass& pass = passes[p];
+      for (int k = 0; k < 2; k++) {
+        const std::vector<ResourceId>& used =
+            k == 0 ? pass.reads : pass.writes;
+        for (size_t u = 0; u < used.size(); u++) {
+          Resource& resource = resources[used[u]];
+          if (resource.firstPass < 0)
+            resource.firstPass = p;
+          resource.lastPass = p;
+        }
+      }
+    }
+  }
+
+  void bindFramebuffer(const Pass& _pass) {
+    std::vector<GLuint> attachments;
+    bool backbuffer = false;
+    for (size_t w = 0; w < _pass.writes.size(); w++) {
+      const Resource& resource = resources[_pass.writes[w]];
+      backbuffer |= resource.backbuffer;
+      if (!resource.backbuffer)
+        attachments.push_back(resource.texture);
+    }
+    if (backbuffer || attachments.empty()) {
+      GLState::Cache::current().bindFramebuffer(0);
+      return;
+    }
+    std::map<std::vector<GLuint>, GLuint>::iterator found =
+        framebuffers.find(attachments);
+    if (found != framebuffers.end()) {
+      GLState::Cache::current().bindFramebuffer(found->second);
+      return;
+    }
+    // With direct state access the framebuffer is only bound once complete
+    bool dsa = GLState::hasDirectStateAccess();
+    GLuint framebuffer;
+    if (dsa) {
+      glCreateFramebuffers(1, &framebuffer);
+    } else {
+      glGenFramebuffers(1, &framebuffer);
+      GLState::Cache::current().bindFramebuffer(framebuffer);
+    }
+    std::vector<GLenum> drawBuffers;
+    for (size_t w = 0; w < _pass.writes.size(); w++) {
+      const Resource& resource = resources[_pass.writes[w]];
+      GLenum attachment;
+      if (resource.desc.isDepthStencil()) {
+        attachment = GL_DEPTH_STENCIL_ATTACHMENT;
+      } else if (resource.desc.isDepth()) {
+        attachment = GL_DEPTH_ATTACHMENT;
+      } else {
+        attachment = GL_COLOR_ATTACHMENT0 + (GLenum)drawBuffers.size();
+        drawBuffers.push_back(attachment);
+      }
+      if (dsa)
+        glNamedFramebufferTexture(framebuffer, attachment, resource.texture,
+                                  0);
+      else
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D,
+                               resource.texture, 0);
+    }
+    GLenum status;
+    if (dsa) {
+      if (drawBuffers.empty())
+        glNamedFramebufferDrawBuffer(framebuffer, GL_NONE);
+      else
+        glNamedFramebufferDrawBuffers(framebuffer, (GLsizei)drawBuffers.size(),
+                                      drawBuffers.data());
+      status = glCheckNamedFramebufferStatus(framebuffer, GL_FRAMEBUFFER);
+      GLState::Cache::current().bindFramebuffer(framebuffer);
+    } else {
+      if (drawBuffers.empty())
+        glDrawBuffer(GL_NONE);
+      else
+        glDrawBuffers((GLsizei)drawBuffers.size(), drawBuffers.data());
+      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    }
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+      std::cout << _pass.name << " framebuffer not complete!" << std::endl;
+    framebuffers[attachments] = framebuffer;
+  }
+
+  // Framebuffers naming a texture the pool has freed go with it, before
+  // the name can be handed out again
+  void trimFramebuffers(const std::vector<GLuint>& _freed) {
+    std::map<std::vector<GLuint>, GLuint>::iterator it = framebuffers.begin();
+    while (it != framebuffers.end()) {
+      bool stale = false;
+      for (size_t i = 0; i < it->first.size(); i++)
+        stale |= std::find(_freed.begin(), _freed.end(), it->first[i]) !=
+                 _freed.end();
+      if (!stale) {
+        ++it;
+        continue;
+      }
+      GLState::Cache::current().forgetFramebuffer(it->second);
+      glDeleteFramebuffers(1, &it->second);
+      it = framebuffers.erase(it);
+    }
+  }
+
+ public:
+  Graph() { stats = GraphStats(); }
+  ~Graph() { clear(); }
+
+  // A texture living within this frame, backed by the pool
+  ResourceId createTexture(const std::string& _name,
+                           const TextureDesc& _desc) {
+    return addResource(_name, _desc, true, false, 0);
+  }
+
+  // A texture owned elsewhere, e.g. one read again next frame
+  ResourceId importTexture(const std::string& _name,
+                           GLuint _texture,
+                           const TextureDesc& _desc) {
+    return addResource(_name, _desc, false, false, _texture);
+  }
+
+  // The default framebuffer, always an output
+  ResourceId importBackbuffer() {
+    return addResource("backbuffer", TextureDesc(), false, true, 0);
+  }
+
+  // Keep the passes producing _resource even if no pass reads it
+  void markOutput(ResourceId _resource) { resources[_resource].output = true; }
+
+  void addPass(const std::string& _name,
+               const std::vector<ResourceId>& _reads,
+               const std::vector<ResourceId>& _writes,
+               Execute _execute) {
+    Pass pass;
+    pass.name = _name;
+    pass.reads = _reads;
+    pass.writes = _writes;
+    pass.execute = _execute;
+    pass.alive = false;
+    passes.push_back(pass);
+  }
+
+  // Texture behind _resource, valid while the passes using it run
+  GLuint getTexture(ResourceId _resource) const {
+    return resources[_resource].texture;
+  }
+
+  // Run the kept passes in order and forget them, the pool stays
+  void execute() {
+    compile();
+    stats = GraphStats();
+    stats.passNum = (unsigned int)passes.size();
+    targets.clear();
+    for (int p = 0; p < (int)passes.size(); p++) {
+      const Pass& pass = passes[p];
+      if (!pass.alive) {
+        stats.culledNum++;
+        continue;
+      }
+      for (size_t r = 0; r < resources.size(); r++) {
+        Resource& resource = resources[r];
+        if (resource.transient && resource.firstPass == p) {
+          resource.texture = pool.acquire(resource.desc);
+          stats.transientNum++;
+          stats.unaliasedBytes += resource.desc.bytes();
+          TargetInfo target = {resource.name, resource.desc.sizedFormat(),
+                               resource.desc.bytes()};
+          targets.push_back(target);
+        }
+      }
+      bindFramebuffer(pass);
+      pass.execute(*this);
+      for (size_t r = 0; r < resources.size(); r++) {
+        Resource& resource = resources[r];
+        if (resource.transient && resource.lastPass == p)
+          pool.release(resource.texture);
+      }
+    }
+    GLState::Cache::current().bindFramebuffer(0);
+    std::vector<GLuint> freed;
+    pool.trim(freed);
+    if (!freed.empty())
+      trimFramebuffers(freed);
+    stats.pooledBytes = pool.getAllocatedBytes();
+    passes.clear();
+    resources.clear();
+  }
+
+  const GraphStats& getStats() const { return stats; }
+  // Transient textures the last execute() used, in order of first use
+  const std::vector<TargetInfo>& getTargets() const { return targets; }
+
+  void clear() {
+    passes.clear();
+    resources.clear();
+    for (std::map<std::vector<GLuint>, GLuint>::iterator it =
+             framebuffers.begin();
+         it != framebuffers.end(); ++it) {
+      GLState::Cache::current().forgetFramebuffer(it->second);
+      glDeleteFramebuffers(1, &it->second);
+    }
+    framebuffers.clear();
+    pool.clear();
+  }
+};
+}  // namespace RenderGraph
@@ -0,0 +1,220 @@
+// Reference-Counted Resource Registry
+//
+// A Registry owns its resources and hands out Handles: a slot index plus a
+// generation that changes whenever the slot is reused, so a handle to a
+// resource that has since been destroyed is detected instead of dangling.
+// Every reference taken by insert() or acquire() is given back with
+// release(). Unreferenced resources are destroyed at once, or kept as a
+// cache, least recently released first out, while the registry's resident
+// bytes stay within its budget.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Resource {
+struct Handle {
+  uint32_t index;
+  uint32_t generation;  // 0 only for the null handle
+
+  Handle() : index(0), generation(0) {}
+  Handle(uint32_t _index, uint32_t _generation)
+      : index(_index), generation(_generation) {}
+
+  bool isNull() const { return generation == 0; }
+  bool operator==(const Handle& _other) const {
+    return index == _other.index && generation == _other.generation;
+  }
+  bool operator!=(const Handle& _other) const { return !(*this == _other); }
+};
+
+// T is destroyed with delete, a class with a private destructor has to
+// befriend its Registry
+template <typename T>
+class Registry {
+ private:
+  struct Slot {
+    T* object;
+    std::string name;
+    uint32_t generation;
+    uint32_t refCount;
+    size_t bytes;
+    uint64_t releasedAt;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<uint32_t> freeSlots;
+  std::map<std::string, uint32_t> slotOfName;
+  size_t budget;
+  size_t residentBytes;
+  uint64_t releaseClock;
+
+  // Forbid copying, the resources are owned
+  Registry(const Registry& _copy) = delete;
+  Registry& operator=(const Registry& _copy) = delete;
+
+  Slot* slotOf(Handle _handle) {
+    if (_handle.isNull() || _handle.index >= slots.size())
+      return NULL;
+    Slot& slot = slots[_handle.index];
+    if (slot.generation != _handle.generation || slot.object == NULL)
+      return NULL;
+    return &slot;
+  }
+  const Slot* slotOf(Handle _handle) const {
+    return const_cast<Registry*>(this)->slotOf(_handle);
+  }
+
+  void destroySlot(uint32_t _index) {
+    Slot& slot = slots[_index];
+    T* object = slot.object;
+    slot.object = NULL;
+    std::map<std::string, uint32_t>::iterator named =
+        slotOfName.find(slot.name);
+    if (named != slotOfName.end() && named->second == _index)
+      slotOfName.erase(named);
+    slot.name = std::string();
+    residentBytes -= slot.bytes;
+    slot.bytes = 0;
+    slot.refCount = 0;
+    if (++slot.generation == 0)
+      slot.generation = 1;
+    freeSlots.push_back(_index);
+    // Last, the destructor may look resources up in this registry again
+    delete object;
+  }
+
+ public:
+  Registry() : budget(0), residentBytes(0), releaseClock(0) {}
+  ~Registry() { clear(); }
+
+  // Take ownership of _object under _name and return a handle holding one
+  // reference. A resource already registered under _name is destroyed,
+  // its handles go stale.
+  Handle insert(const std::string& _name, T* _object) {
+    std::map<std::string, uint32_t>::iterator named = slotOfName.find(_name);
+    if (named != slotOfName.end())
+      destroySlot(named->second);
+    uint32_t index;
+    if (!freeSlots.empty()) {
+      index = freeSlots.back();
+      freeSlots.pop_back();
+    } else {
+      index = (uint32_t)slots.size();
+      Slot slot = {NULL, std::string(), 1, 0, 0, 0};
+      slots.push_back(slot);
+    }
+    Slot& slot = slots[index];
+    slot.object = _object;
+    slot.name = _name;
+    slot.refCount = 1;
+    slot.bytes = 0;
+    slotOfName[_name] = index;
+    return Handle(index, slot.generation);
+  }
+
+  // Look a resource up without taking a reference
+  Handle find(const std::string& _name) const {
+    std::map<std::string, uint32_t>::const_iterator named =
+        slotOfName.find(_name);
+    if (named == slotOfName.end())
+      return Handle();
+    return Handle(named->second, slots[named->second].generation);
+  }
+
+  T* get(Handle _handle) const {
+    const Slot* slot = slotOf(_handle);
+    return slot != NULL ? slot->object : NULL;
+  }
+
+  bool acquire(Handle _handle) {
+    Slot* slot = slotOf(_handle);
+    if (slot == NULL)
+      return false;
+    slot->refCount++;
+    return true;
+  }
+
+  // Give back a reference, returns false for stale handles
+  bool release(Handle _handle) {
+    Slot* slot = slotOf(_handle);
+    if (slot == NULL || slot->refCount == 0)
+      return false;
+    if (--slot->refCount == 0) {
+      slot->releasedAt = ++releaseClock;
+      collect();
+    }
+    return true;
+  }
+
+  // Destroy a resource whatever its references
+  bool destroy(Handle _handle) {
+    if (slotOf(_handle) == NULL)
+      return false;
+    destroySlot(_handle.index);
+    return true;
+  }
+
+  // Bytes a resource holds, counted against the budget
+  void setBytes(Handle _handle, size_t _bytes) {
+    Slot* slot = slotOf(_handle);
+    if (slot == NULL)
+      return;
+    residentBytes = residentBytes - slot->bytes + _bytes;
+    slot->bytes = _bytes;
+    collect();
+  }
+
+  // 0 keeps no unreferenced resource alive
+  void setBudget(size_t _bytes) {
+    budget = _bytes;
+    collect();
+  }
+  size_t getBudget() const { return budget; }
+  size_t getResidentBytes() const { return residentBytes; }
+  bool overBudget() const { return residentBytes > budget; }
+
+  // Destroy unreferenced resources, longest unused first, until the
+  // resident bytes fit the budget. Returns the bytes freed.
+  size_t collect() {
+    size_t freed = 0;
+    for (;;) {
+      uint32_t oldest = (uint32_t)slots.size();
+      for (uint32_t i = 0; i < slots.size(); i++) {
+        const Slot& slot = slots[i];
+        if (slot.object == NULL || slot.refCount != 0)
+          continue;
+        // Empty resources are never worth keeping
+        if (slot.bytes != 0 && residentBytes <= budget)
+          continue;
+        if (oldest == slots.size() ||
+            slot.releasedAt < slots[oldest].releasedAt)
+          oldest = i;
+      }
+      if (oldest == slots.size())
+        return freed;
+      freed += slots[oldest].bytes;
+      destroySlot(oldest);
+    }
+  }
+
+  // Call _func(handle, resource) for every live resource. _func must not
+  // insert or destroy.
+  template <typename F>
+  void forEach(F _func) {
+    for (uint32_t i = 0; i < slots.size(); i++)
+      if (slots[i].object != NULL)
+        _func(Handle(i, slots[i].generation), *slots[i].object);
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < slots.size(); i++)
+      if (slots[i].object != NULL)
+        destroySlot(i);
+  }
+};
+}  // namespace Resource
@@ -0,0 +1,211 @@
+// Per-Frame Ring Buffer
+//
+// Dynamic data written every frame, such as uniform blocks, is copied into
+// one of FRAME_NUM regions of a single buffer and bound by range. A fence
+// placed at the end of each frame guards its region, so the CPU only waits
+// when it laps a frame the GPU is still reading, and never for data of the
+// frame being built. With immutable storage the buffer stays persistently
+// and coherently mapped and a push is a plain copy; without it pushes fall
+// back to glBufferSubData() into the same regions.
+
+#pragma once
+
+#include <cstring>
+#include <iostream>
+
+#include <gl_env.h>
+#include <gl_state.h>
+
+namespace Streaming {
+struct RingStats {
+  size_t usedBytes;    // pushed in the last frame
+  size_t frameBytes;   // capacity of a frame
+  unsigned int waits;  // frames that had to wait for the GPU so far
+};
+
+class RingBuffer {
+ public:
+  static const int FRAME_NUM = 3;
+
+  static bool isPersistent() {
+    return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+  }
+
+ private:
+  GLenum target;
+  GLuint buffer;
+  unsigned char* mapped;
+  size_t frameBytes;
+  size_t alignment;
+  int frame;
+  size_t head;
+  size_t lastUsed;
+  unsigned int waits;
+  bool overflowReported;
+  GLsync fence[FRAME_NUM];
+
+  // Forbid copying, the GL names are owned
+  RingBuffer(const RingBuffer& _copy) = delete;
+  RingBuffer& operator=(const RingBuffer& _copy) = delete;
+
+ public:
+  RingBuffer()
+      : target(GL_UNIFORM_BUFFER),
+        buffer(0),
+        mapped(NULL),
+        frameBytes(0),
+        alignment(1),
+        frame(0),
+        head(0),
+        lastUsed(0),
+        waits(0),
+        overflowReported(false),
+        fence{NULL, NULL, NULL} {}
+  // GL names are only held between init() and clear()
+  ~RingBuffer() {
+    if (buffer != 0)
+      clear();
+  }
+
+  // _frameBytes has to hold the worst case of one frame, offsets of the
+  // pushes are aligned as _target requires for range binds
+  bool init(GLenum _target, size_t _frameBytes) {
+    clear();
+    target = _target;
+    GLint offsetAlignment = 1;
+    if (_target == GL_UNIFORM_BUFFER)
+      glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+    else if (_target == GL_SHADER_STORAGE_BUFFER)
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT,
+                    &offsetAlignment);
+    alignment = offsetAlignment > 0 ? (size_t)offsetAlignment : 1;
+    frameBytes = (_frameBytes + alignment - 1) / alignment * alignment;
+    size_t bytes = frameBytes * FRAME_NUM;
+
+    GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    if (GLState::hasDirectStateAccess()) {
+      glCreateBuffers(1, &buffer);
+      glNamedBufferStorage(buffer, bytes, NULL, flags);
+      mapped = (unsigned char*)glMapNamedBufferRange(buffer, 0, bytes, flags);
+    } else {
+      glGenBuffers(1, &buffer);
+      glBindBuffer(target, buffer);
+      if (isPersistent()) {
+        glBufferStorage(target, bytes, NULL, flags);
+        mapped = (unsigned char*)glMapBufferRange(target, 0, bytes, flags);
+      } else {
+        glBufferData(target, bytes, NULL, GL_STREAM_DRAW);
+      }
+      glBindBuffer(target, 0);
+    }
+    if (isPersistent() && mapped == NULL) {
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  void clear() {
+    for (int i = 0; i < FRAME_NUM; i++) {
+      if (fence[i] != NULL)
+        glDeleteSync(fence[i]);
+      fence[i] = NULL;
+    }
+    if (mapped != NULL && GLState::hasDirectStateAccess()) {
+      glUnmapNamedBuffer(buffer);
+    } else if (mapped != NULL) {
+      glBindBuffer(target, buffer);
+      glUnmapBuffer(target);
+      glBindBuffer(target, 0);
+    }
+    mapped = NULL;
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    head = lastUsed = 0;
+  }
+
+  bool available() const { return buffer != 0; }
+  GLuint getBuffer() const { return buffer; }
+
+  // Before the first push of a frame: wait until the GPU is done with the
+  // region this frame overwrites
+  void beginFrame() {
+    if (buffer == 0)
+      return;
+    frame = (frame + 1) % FRAME_NUM;
+    head = 0;
+    GLsync& guard = fence[frame];
+    if (guard == NULL)
+      return;
+    GLenum status = glClientWaitSync(guard, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      waits++;
+      do {
+        status = glClientWaitSync(guard, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  1000000000);
+      } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    glDeleteSync(guard);
+    guard = NULL;
+  }
+
+  // After the last command reading this frame's pushes
+  void endFrame() {
+    if (buffer == 0)
+      return;
+    if (fence[frame] != NULL)
+      glDeleteSync(fence[frame]);
+    fence[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    lastUsed = head;
+  }
+
+  // Copy _bytes into this frame's region and return their offset in the
+  // buffer, or -1 when the frame is out of space
+  GLintptr push(const void* _data, size_t _bytes) {
+    if (buffer == 0)
+      return -1;
+    if (head + _bytes > frameBytes) {
+      if (!overflowReported)
+        std::cout << "Ring buffer frame of " << frameBytes
+                  << " bytes exhausted" << std::endl;
+      overflowReported = true;
+      return -1;
+    }
+    GLintptr offset = (GLintptr)(frameBytes * frame + head);
+    if (mapped != NULL) {
+      memcpy(mapped + offset, _data, _bytes);
+    } else {
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, offset, _bytes, _data);
+      glBindBuffer(target, 0);
+    }
+    head += (_bytes + alignment - 1) / alignment * alignment;
+    return offset;
+  }
+
+  template <typename T>
+  GLintptr push(const T& _value) {
+    return push(&_value, sizeof(T));
+  }
+
+  // Bind a pushed range to an indexed binding point of the target
+  void bindRange(GLuint _index, GLintptr _offset, size_t _bytes) const {
+    if (_offset >= 0)
+      glBindBufferRange(target, _index, buffer, _offset, _bytes);
+  }
+
+  // Push and bind at once
+  template <typename T>
+  GLintptr pushAndBind(GLuint _index, const T& _value) {
+    GLintptr offset = push(_value);
+    bindRange(_index, offset, sizeof(T));
+    return offset;
+  }
+
+  RingStats getStats() const {
+    RingStats stats = {lastUsed, frameBytes, waits};
+    return stats;
+  }
+};
+}  // namespace Streaming
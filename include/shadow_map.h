@@ -0,0 +1,190 @@
+// Point Light Shadow Map
+//
+// A depth cube map around one point light, rendered in a single layered
+// pass: a geometry shader sends each triangle to the faces it touches,
+// using faceMatrix() of each, and the fragment shader stores the distance
+// to the light divided by the far distance. The texture compares against
+// a reference distance, so every lookup is already a bilinear PCF tap.
+//
+// Rendering is the caller's part. The map stays valid until the light
+// moves or invalidate() is called for moved geometry, so a static scene
+// renders it once.
+
+#pragma once
+
+#include <gl_env.h>
+#include <gl_state.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace Shadow {
+struct ShadowStats {
+  unsigned int renders;       // times the map was rendered
+  unsigned int cachedFrames;  // frames that reused it
+};
+
+class PointShadowMap {
+ public:
+  static const int FACE_NUM = 6;
+
+ private:
+  GLuint texture;
+  GLuint framebuffer;
+  GLsizei size;
+  GLenum format;
+  glm::vec3 lightPos;
+  float farPlane;
+  bool valid;
+  ShadowStats stats;
+
+  // Forbid copying, the GL names are owned
+  PointShadowMap(const PointShadowMap& _copy) = delete;
+  PointShadowMap& operator=(const PointShadowMap& _copy) = delete;
+
+ public:
+  PointShadowMap()
+      : texture(0),
+        framebuffer(0),
+        size(0),
+        format(GL_DEPTH_COMPONENT32F),
+        lightPos(0.0f),
+        farPlane(1.0f),
+        valid(false) {
+    stats.renders = stats.cachedFrames = 0;
+  }
+  // GL names are only held between init() and clear()
+  ~PointShadowMap() {
+    if (available())
+      clear();
+  }
+
+  bool available() const { return framebuffer != 0; }
+
+  // _format is a sized depth format, the stored distance is linear so
+  // 16 bits spread evenly over the light's range
+  bool init(GLsizei _size, GLenum _format = GL_DEPTH_COMPONENT32F) {
+    clear();
+    size = _size;
+    format = _format;
+    if (GLState::hasDirectStateAccess()) {
+      glCreateTextures(GL_TEXTURE_CUBE_MAP, 1, &texture);
+      glTextureStorage2D(texture, 1, _format, _size, _size);
+      glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(texture, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(texture, GL_TEXTURE_COMPARE_MODE,
+                          GL_COMPARE_REF_TO_TEXTURE);
+      glTextureParameteri(texture, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+      glCreateFramebuffers(1, &framebuffer);
+      glNamedFramebufferTexture(framebuffer, GL_DEPTH_ATTACHMENT, texture, 0);
+      glNamedFramebufferDrawBuffer(framebuffer, GL_NONE);
+      glNamedFramebufferReadBuffer(framebuffer, GL_NONE);
+      if (glCheckNamedFramebufferStatus(framebuffer, GL_FRAMEBUFFER) !=
+          GL_FRAMEBUFFER_COMPLETE) {
+        clear();
+        return false;
+      }
+      return true;
+    }
+    GLState::Cache& state = GLState::Cache::current();
+    glGenTextures(1, &texture);
+    state.bindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    for (int face = 0; face < FACE_NUM; face++)
+      glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, _format, _size,
+                   _size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE,
+                    GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glGenFramebuffers(1, &framebuffer);
+    state.bindFramebuffer(framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete =
+        glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    state.bindFramebuffer(0);
+    if (!complete)
+      clear();
+    return complete;
+  }
+
+  void clear() {
+    GLState::Cache& state = GLState::Cache::current();
+    state.forgetFramebuffer(framebuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    framebuffer = 0;
+    state.forgetTexture(texture);
+    glDeleteTextures(1, &texture);
+    texture = 0;
+    valid = false;
+  }
+
+  GLuint getTexture() const { return texture; }
+  // Whether the map holds a render, it is undefined before the first
+  bool isValid() const { return valid; }
+  float getFar() const { return farPlane; }
+  GLenum getFormat() const { return format; }
+  // Memory of all faces, 0 before init()
+  size_t getBytes() const {
+    if (!available())
+      return 0;
+    size_t texel = format == GL_DEPTH_COMPONENT16 ? 2 : 4;
+    return texel * size * size * FACE_NUM;
+  }
+
+  // Whether the map has to be rendered again for a light at _lightPos
+  // reaching _far. Counts a reuse when it does not.
+  bool needsUpdate(const glm::vec3& _lightPos, float _far) {
+    if (valid && _lightPos == lightPos && _far == farPlane) {
+      stats.cachedFrames++;
+      return false;
+    }
+    return available();
+  }
+
+  // The geometry casting shadows has changed
+  void invalidate() { valid = false; }
+
+  // Bind the map as the target and clear it for a light at _lightPos,
+  // the caller restores the framebuffer and viewport it draws to next
+  void begin(const glm::vec3& _lightPos, float _far) {
+    lightPos = _lightPos;
+    farPlane = _far;
+    GLState::Cache::current().bindFramebuffer(framebuffer);
+    glViewport(0, 0, size, size);
+    glClear(GL_DEPTH_BUFFER_BIT);
+  }
+
+  void end() {
+    valid = true;
+    stats.renders++;
+  }
+
+  // World to clip space of a cube face, in GL_TEXTURE_CUBE_MAP_POSITIVE_X
+  // + _face order
+  glm::mat4 faceMatrix(int _face) const {
+    static const glm::vec3 direction[FACE_NUM] = {
+        glm::vec3(1.0f, 0.0f, 0.0f),  glm::vec3(-1.0f, 0.0f, 0.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f),  glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f),  glm::vec3(0.0f, 0.0f, -1.0f)};
+    static const glm::vec3 up[FACE_NUM] = {
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f),  glm::vec3(0.0f, 0.0f, -1.0f),
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)};
+    glm::mat4 projection =
+        glm::perspective(glm::radians(90.0f), 1.0f, 0.05f, farPlane);
+    return projection *
+           glm::lookAt(lightPos, lightPos + direction[_face], up[_face]);
+  }
+
+  const ShadowStats& getStats() const { return stats; }
+};
+}  // namespace Shadow
@@ -4,14 +4,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <gl_env.h>
 
+#include <frustum_culling.h>
+#include <gl_state.h>
+#include <mesh_simplify.h>
+#include <meshlet.h>
+#include <resource_manager.h>
 #include <texture_image.h>
+#include <thread_pool.h>
 
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
@@ -20,20 +30,89 @@
 #pragma comment(lib, "assimp.lib")
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #define SCENE_RESOURCE_SHADER_POSI_LOCATION 0
 #define SCENE_RESOURCE_SHADER_TEXC_LOCATION 1
 #define SCENE_RESOURCE_SHADER_NORM_LOCATION 2
 #define SCENE_RESOURCE_SHADER_BONE_LOCATION 3
 #define SCENE_RESOURCE_SHADER_BNWT_LOCATION 4
+#define SCENE_RESOURCE_SHADER_LAYR_LOCATION 5
 
 #define SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL 0
+// Bone palette, a samplerBuffer of RGBA32F texels: per bone the 4 matrix
+// columns, or the real and dual part of a dual quaternion
+#define SCENE_RESOURCE_SHADER_BONE_CHANNEL 1
 
 #define SCENE_RESOURCE_BONE_PER_VERTEX 4
 
+// Detail levels per mesh entry including the full one, and the smallest
+// mesh that gets simplified ones
+#define SCENE_RESOURCE_LOD_NUM 4
+#define SCENE_RESOURCE_LOD_MIN_FACETS 256
+
 namespace SkeletalMesh {
 typedef std::map<std::string, glm::fmat4> SkeletonModifier;
 
+// Skinning shader variants, named by the most bone influences any vertex
+// of a mesh entry has. Rigid entries are not skinned at all.
+enum SkinClass {
+  SKIN_RIGID,
+  SKIN_ONE_BONE,
+  SKIN_TWO_BONES,
+  SKIN_FOUR_BONES,
+  SKIN_CLASS_NUM
+};
+
+inline SkinClass skinClassOf(int _influences) {
+  if (_influences <= 0)
+    return SKIN_RIGID;
+  if (_influences == 1)
+    return SKIN_ONE_BONE;
+  if (_influences == 2)
+    return SKIN_TWO_BONES;
+  return SKIN_FOUR_BONES;
+}
+
+// Influences the variant of _class reads, the leading ones of a vertex
+inline int skinInfluences(SkinClass _class) {
+  const int influences[SKIN_CLASS_NUM] = {0, 1, 2, 4};
+  return influences[_class];
+}
+
+// Assimp matrices are row-major, glm ones column-major
+inline glm::fmat4 convertMatrix(const aiMatrix4x4& _m) {
+  glm::fmat4 converted;
+  for (int row = 0; row < 4; row++)
+    for (int column = 0; column < 4; column++)
+      converted[column][row] = _m[row][column];
+  return converted;
+}
+
+enum SkinningMode { SKINNING_LINEAR, SKINNING_DUAL_QUATERNION };
+
+// Rotation and translation of a bone in 8 floats, x y z w each, as read by
+// the shaders. Blending these instead of matrices keeps the volume around
+// twisted joints.
+struct DualQuaternion {
+  glm::fvec4 real;
+  glm::fvec4 dual;
+
+  // Scale and shear in _m are dropped, dual quaternions cannot hold them
+  static DualQuaternion fromMatrix(const glm::fmat4& _m) {
+    glm::fmat3 rotation(glm::normalize(glm::fvec3(_m[0])),
+                        glm::normalize(glm::fvec3(_m[1])),
+                        glm::normalize(glm::fvec3(_m[2])));
+    glm::fquat r = glm::normalize(glm::quat_cast(rotation));
+    glm::fquat t(0.0f, _m[3].x, _m[3].y, _m[3].z);
+    glm::fquat d = (t * r) * 0.5f;
+    DualQuaternion dq;
+    dq.real = glm::fvec4(r.x, r.y, r.z, r.w);
+    dq.dual = glm::fvec4(d.x, d.y, d.z, d.w);
+    return dq;
+  }
+};
+
 struct ParametricVertex {
   float position[3];
   float texcoord[2];
@@ -65,6 +144,60 @@ struct ParametricVertex {
     }
     return false;
   }
+
+  // Scale the kept weights to sum to 1 and move them to the front, largest
+  // first, so that a variant reading fewer influences reads the right ones.
+  // Returns the number of influences.
+  int normalizeWeights() {
+    float sum = 0.0f;
+    for (int i = 0; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++)
+      sum += boneWeight[i];
+    if (sum <= 0.0f)
+      return 0;
+    int influences = 0;
+    for (int i = 0; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++) {
+      boneWeight[i] /= sum;
+      for (int j = i; j > 0 && boneWeight[j] > boneWeight[j - 1]; j--) {
+        std::swap(boneWeight[j], boneWeight[j - 1]);
+        std::swap(boneId[j], boneId[j - 1]);
+      }
+    }
+    for (int i = 0; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++) {
+      if (boneWeight[i] > 0.0f)
+        influences++;
+      else
+        boneId[i] = 0;
+    }
+    return influences;
+  }
+
+  float weightOf(unsigned int _id) const {
+    float weight = 0.0f;
+    for (int i = 0; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++)
+      if (boneId[i] == _id && boneWeight[i] > 0.0f)
+        weight += boneWeight[i];
+    return weight;
+  }
+
+  // Sum of absolute weight differences over all bones, 0 to 2
+  float boneWeightDistance(const ParametricVertex& _other) const {
+    float distance = 0.0f;
+    for (int i = 0; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++) {
+      if (boneWeight[i] > 0.0f)
+        distance += std::abs(boneWeight[i] - _other.weightOf(boneId[i]));
+      if (_other.boneWeight[i] > 0.0f && weightOf(_other.boneId[i]) == 0.0f)
+        distance += _other.boneWeight[i];
+    }
+    return distance;
+  }
+};
+
+// One detail level of a mesh entry, error is the largest distance by which
+// its surface strays from the full mesh, in model space
+struct MeshLod {
+  unsigned int indexOffset;
+  unsigned int facetCornerNum;
+  float error;
 };
 
 struct MeshEntry {
@@ -72,45 +205,162 @@ struct MeshEntry {
   unsigned int indexOffset;
   unsigned int vertexOffset;
   unsigned int materialIndex;
+  // Bind pose bounds in model space
+  Culling::AABB bounds;
+  Culling::BoundingSphere sphere;
+  // Clusters covering [indexOffset, indexOffset + facetCornerNum)
+  unsigned int firstMeshlet;
+  unsigned int meshletNum;
+  // lod[0] is the range above, coarser levels follow with growing error
+  MeshLod lod[SCENE_RESOURCE_LOD_NUM];
+  unsigned int lodNum;
+  SkinClass skinClass;
+};
+
+// Bind pose bounds of a mesh split by influencing bone, so that posed
+// bounds can be rebuilt from the bone matrices without touching vertices
+struct SkinBounds {
+  Culling::AABB rigid;
+  std::vector<std::pair<unsigned int, Culling::AABB>> bones;
 };
 
 struct Material {
-  const TextureImage::Texture* diffuse;
-  Material() : diffuse(&TextureImage::Texture::error) {}
-  bool setDiffuse(std::string _name, std::string _filename = std::string()) {
-    return (diffuse = &TextureImage::Texture::loadTexture(_name, _filename)) !=
-           &TextureImage::Texture::error;
-  }
+  // Slot of the diffuse map in the scene's texture arrays, -1 when none
+  int diffuseArray;
+  int diffuseLayer;
+  Material() : diffuseArray(-1), diffuseLayer(-1) {}
+};
+
+// Layout consumed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+  unsigned int count;
+  unsigned int instanceCount;
+  unsigned int firstIndex;
+  int baseVertex;
+  unsigned int baseInstance;
+};
+
+// Mesh entries sharing one skinning variant and one texture array, drawn
+// back to back, with the batches of one variant next to each other. Their
+// commands occupy [firstCommand, firstCommand + entries.size()) of the
+// indirect buffer, in the same order as entries.
+struct DrawBatch {
+  SkinClass skinClass;
+  int textureArray;
+  unsigned int firstCommand;
+  std::vector<unsigned int> entries;
 };
 
 struct Bone {
-  aiMatrix4x4 localTransf;
+  glm::fmat4 localTransf;
 
   // Bone() : localTransf() {}
-  Bone(const aiMatrix4x4& _m) : localTransf(_m) {}
+  Bone(const aiMatrix4x4& _m) : localTransf(convertMatrix(_m)) {}
+};
+
+// Node of the file's hierarchy on the way from the root to a bone. Nodes
+// are stored parents first, so a pose is evaluated in one forward pass.
+struct SkeletonNode {
+  std::string name;
+  glm::fmat4 localTransf;
+  int parent;  // -1 for the root
+  int bone;    // -1 for nodes that only carry a transform
+};
+
+// CPU side state of a model file being imported, filled by loader threads
+// and consumed by the GL thread in Scene::advanceLoad()
+struct SceneImport {
+  // Alive between the two import passes, the second reads the meshes in place
+  std::unique_ptr<Assimp::Importer> importer;
+  const aiScene* scene;
+  // The mapped vertex buffer, the vertices never exist in any other place
+  ParametricVertex* vertexTarget;
+  unsigned int vertexNum;
+  // Stays in host memory, the simplified level sizes are only known once
+  // every mesh is done
+  std::vector<unsigned int> indexAssembly;
+  // One entry per distinct diffuse file, shared by the materials naming it
+  std::vector<std::string> diffusePath;
+  std::vector<TextureImage::DecodedImage> diffuseImage;
+  // Per material, the index into diffusePath, -1 when it has none
+  std::vector<int> diffuseOfMaterial;
+
+  SceneImport() : scene(NULL), vertexTarget(NULL), vertexNum(0) {}
 };
 
 class Scene {
  public:
-  typedef std::map<std::string, Scene*> Name2Scene;
+  typedef Resource::Handle Handle;
+  typedef Resource::Registry<Scene> Registry;
   typedef std::vector<glm::fmat4> SkeletonTransf;
+  typedef std::vector<DualQuaternion> SkeletonDualQuat;
   typedef std::map<std::string, unsigned int> Name2Bone;
-  static Name2Scene allScene;
+  static Registry allScene;
   static Scene error;
+  // Assemble the meshes of later loads on the loader pool or on one thread,
+  // the latter only to compare against
+  static bool parallelImport;
+
+  // Wall time of each load pass, in milliseconds
+  struct LoadTiming {
+    double parse;
+    double assemble;
+    // Spent on the GL thread, allocating and filling the buffers
+    double upload;
+    unsigned int threads;
+  };
 
  private:
+  // Pass a background load is in, each one ends on the GL thread
+  enum LoadStage { LOAD_DONE, LOAD_PARSING, LOAD_ASSEMBLING };
+
   bool available;
   std::string name;
   std::string filename;
-  Assimp::Importer importer;
-  const aiScene* scene;
   GLuint vao;
   GLuint vbo;
   GLuint ebo;
+  // One diffuse layer per mesh entry, fetched through the base instance
+  GLuint drawBuffer;
+  GLint layerLocation;
+  std::vector<int> drawLayer;
+  GLuint indirectBuffer;
+  std::vector<DrawElementsIndirectCommand> drawCommand;
+  // Bumped whenever sortFrontToBack() reorders drawCommand
+  unsigned int drawOrder;
+  std::vector<float> sortDistance;
+  // Skinning matrices of the current pose, and the variant drawing each
+  // skin class, 0 to keep the bound program
+  GLuint paletteBuffer;
+  GLuint paletteTexture;
+  size_t paletteBytes;
+  GLuint skinProgram[SKIN_CLASS_NUM];
+  SkeletonModifier pose;
+  static SkinningMode skinningMode;
+  // Bounds used for culling, the bind pose ones or the skinned ones
+  std::vector<SkinBounds> skinBounds;
+  std::vector<Culling::AABB> cullBounds;
+  std::vector<Culling::BoundingSphere> cullSphere;
+  Culling::CullStats cullStats;
   std::vector<MeshEntry> meshEntry;
+  std::vector<Meshlet::Cluster> meshlet;
   std::vector<Material> material;
+  std::vector<std::unique_ptr<TextureImage::TextureArray>> textureArray;
+  std::vector<DrawBatch> drawBatch;
   std::vector<Bone> skeleton;
   Name2Bone nameBoneMap;
+  std::vector<SkeletonNode> hierarchy;
+  glm::fmat4 rootInverse;
+  // Memory the importer held for the parsed file, released at the end of
+  // assembleFile(), and what the GL buffers take
+  size_t importedBytes;
+  size_t bufferBytes;
+  std::unique_ptr<SceneImport> staging;
+  LoadStage loadStage;
+  std::future<bool> pending;
+  LoadTiming loadTiming;
+
+  friend class Resource::Registry<Scene>;
 
   // Forbid calling any constructor outside
   Scene(const Scene& _copy) : Scene() {}
@@ -119,26 +369,70 @@ class Scene {
     vao = 0;
     vbo = 0;
     ebo = 0;
+    drawBuffer = 0;
+    layerLocation = -1;
+    indirectBuffer = 0;
+    drawOrder = 0;
+    paletteBuffer = 0;
+    paletteTexture = 0;
+    paletteBytes = 0;
+    for (int c = 0; c < SKIN_CLASS_NUM; c++)
+      skinProgram[c] = 0;
+    rootInverse = glm::fmat4(1.0f);
+    importedBytes = 0;
+    bufferBytes = 0;
+    loadStage = LOAD_DONE;
+    loadTiming = LoadTiming();
   }
   virtual ~Scene() { clear(); }
 
  public:
   void clear() {
+    if (pending.valid())
+      pending.wait();
+    pending = std::future<bool>();
+    loadStage = LOAD_DONE;
+    // Deleting the vertex buffer below also unmaps it
+    staging.reset();
     available = false;
     name = std::string();
     filename = std::string();
-    // importer..
-    scene = NULL;
+    GLState::Cache::current().forgetVertexArray(vao);
     glDeleteVertexArrays(1, &vao);
     vao = 0;
     glDeleteBuffers(1, &vbo);
     vbo = 0;
     glDeleteBuffers(1, &ebo);
     ebo = 0;
+    glDeleteBuffers(1, &drawBuffer);
+    drawBuffer = 0;
+    layerLocation = -1;
+    glDeleteBuffers(1, &indirectBuffer);
+    indirectBuffer = 0;
+    GLState::Cache::current().forgetTexture(paletteTexture);
+    glDeleteTextures(1, &paletteTexture);
+    paletteTexture = 0;
+    glDeleteBuffers(1, &paletteBuffer);
+    paletteBuffer = 0;
+    paletteBytes = 0;
+    drawCommand.clear();
+    skinBounds.clear();
+    cullBounds.clear();
+    cullSphere.clear();
+    cullStats.reset();
     meshEntry.clear();
+    meshlet.clear();
     material.clear();
+    textureArray.clear();
+    drawLayer.clear();
+    drawBatch.clear();
     skeleton.clear();
     nameBoneMap.clear();
+    hierarchy.clear();
+    pose.clear();
+    importedBytes = 0;
+    bufferBytes = 0;
+    loadTiming = LoadTiming();
   }
 
   static std::string testAllSuffix(std::string no_suffix_name) {
@@ -157,106 +451,68 @@ class Scene {
     return std::string();
   }
 
-  static Scene& loadScene(std::string _name,
-                          std::string _filename = std::string()) {
-    if (_filename.empty() || _filename == "") {
-      _filename = testAllSuffix(_name);
-      if (_filename.empty())
-        return error;
-    }
-    FILE* fi = fopen(_filename.c_str(), "r");
-    if (fi == NULL)
-      return error;
-    fclose(fi);
-
-    std::pair<Name2Scene::iterator, bool> insertion =
-        allScene.insert(Name2Scene::value_type(_name, new Scene()));
-    Scene& target = *(insertion.first->second);
-    if (!insertion.second)
-      if (target.filename == _filename && target.available)
-        return target;
-      else
-        target.clear();
-
-    target.name = _name;
-    target.filename = _filename;
-
-    target.scene = target.importer.ReadFile(
-        _filename, aiProcess_Triangulate | aiProcess_GenSmoothNormals |
-                       aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);
-    if (!target.scene)
-      return error;
-
-    std::vector<ParametricVertex> vertexAssembly;
-    std::vector<unsigned int> indexAssembly;
+  // Loader thread, first pass: parse the file and size everything, so that
+  // the GL thread can allocate the vertex buffer before any vertex exists.
+  // No GL calls allowed here.
+  bool parseFile() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    SceneImport& import = *staging;
+    import.importer.reset(new Assimp::Importer());
+    import.scene = import.importer->ReadFile(
+        filename, aiProcess_Triangulate | aiProcess_GenSmoothNormals |
+                      aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);
+    if (!import.scene)
+      return false;
+    aiMemoryInfo memoryInfo;
+    import.importer->GetMemoryRequirements(memoryInfo);
+    importedBytes = memoryInfo.total;
 
-    int nTotalMeshes = target.scene->mNumMeshes;
-    target.meshEntry.resize(nTotalMeshes);
+    const aiScene* scene = import.scene;
+    int nTotalMeshes = scene->mNumMeshes;
+    meshEntry.resize(nTotalMeshes);
+    skinBounds.resize(nTotalMeshes);
 
-    int nTotalVertices = 0;
-    int nTotalIndices = 0;
+    unsigned int nTotalVertices = 0;
+    unsigned int nTotalIndices = 0;
     for (int i = 0; i < nTotalMeshes; i++) {
-      const aiMesh* curMesh = target.scene->mMeshes[i];
-      int nMeshVertices = curMesh->mNumVertices;
-      int nMeshBones = curMesh->mNumBones;
-      int nMeshFaces = curMesh->mNumFaces;
-
-      target.meshEntry[i].facetCornerNum = nMeshFaces * 3;
-      target.meshEntry[i].indexOffset = nTotalIndices;
-      target.meshEntry[i].vertexOffset = nTotalVertices;
-      target.meshEntry[i].materialIndex = curMesh->mMaterialIndex;
-
-      nTotalVertices += nMeshVertices;
-      nTotalIndices += nMeshFaces * 3;
-
-      for (int j = 0; j < nMeshVertices; j++) {
-        aiVector2D curTexcoord(.0f, .0f);
-        if (curMesh->HasTextureCoords(0))
-          curTexcoord = aiVector2D(curMesh->mTextureCoords[0][j].x,
-                                   curMesh->mTextureCoords[0][j].y);
-        vertexAssembly.push_back(ParametricVertex(
-            curMesh->mVertices[j], curTexcoord, curMesh->mNormals[j]));
-      }
-      for (int j = 0; j < nMeshBones; j++) {
+      const aiMesh* curMesh = scene->mMeshes[i];
+      meshEntry[i].facetCornerNum = curMesh->mNumFaces * 3;
+      meshEntry[i].indexOffset = nTotalIndices;
+      meshEntry[i].vertexOffset = nTotalVertices;
+      meshEntry[i].materialIndex = curMesh->mMaterialIndex;
+      nTotalVertices += curMesh->mNumVertices;
+      nTotalIndices += curMesh->mNumFaces * 3;
+
+      // Bones are numbered in order of first use, the second pass only
+      // looks them up
+      for (unsigned int j = 0; j < curMesh->mNumBones; j++) {
         std::string boneName = curMesh->mBones[j]->mName.data;
-        std::pair<std::map<std::string, unsigned int>::iterator, bool>
-            insertResult;
-        insertResult = target.nameBoneMap.insert(
-            std::make_pair(boneName, target.skeleton.size()));
-        if (insertResult.second) {
-          target.skeleton.push_back(Bone(curMesh->mBones[j]->mOffsetMatrix));
-          int nBoneVertexWeight = curMesh->mBones[j]->mNumWeights;
-          for (int k = 0; k < nBoneVertexWeight; k++) {
-            int vertexId = target.meshEntry[i].vertexOffset +
-                           curMesh->mBones[j]->mWeights[k].mVertexId;
-            float weight = curMesh->mBones[j]->mWeights[k].mWeight;
-            vertexAssembly[vertexId].addBone(insertResult.first->second,
-                                             weight);
-          }
-        }
-      }
-      for (int j = 0; j < nMeshFaces; j++) {
-        for (int k = 0; k < 3; k++)
-          indexAssembly.push_back(curMesh->mFaces[j].mIndices[k]);
+        if (nameBoneMap.insert(std::make_pair(boneName, skeleton.size()))
+                .second)
+          skeleton.push_back(Bone(curMesh->mBones[j]->mOffsetMatrix));
       }
     }
+    import.vertexNum = nTotalVertices;
+    import.indexAssembly.resize(nTotalIndices);
 
     std::string filepath_prefix;
     {
-      size_t slashpos = _filename.rfind('/');
-      size_t conslashpos = _filename.rfind('\\');
+      size_t slashpos = filename.rfind('/');
+      size_t conslashpos = filename.rfind('\\');
       if (conslashpos != std::string::npos) {
         if (slashpos == std::string::npos || slashpos < conslashpos)
           slashpos = conslashpos;
       }
       if (slashpos != std::string::npos) {
-        filepath_prefix = _filename.substr(0, slashpos + 1);
+        filepath_prefix = filename.substr(0, slashpos + 1);
       }
     }
-    int nTotalMaterials = target.scene->mNumMaterials;
-    target.material.resize(nTotalMaterials);
+    int nTotalMaterials = scene->mNumMaterials;
+    staging->diffuseOfMaterial.assign(nTotalMaterials, -1);
+    std::map<std::string, int> diffuseIndex;
     for (int i = 0; i < nTotalMaterials; i++) {
-      const aiMaterial* curMaterial = target.scene->mMaterials[i];
+      const aiMaterial* curMaterial = scene->mMaterials[i];
 
       if (curMaterial->GetTextureCount(aiTextureType_DIFFUSE) > 0) {
         aiString ai_filepath;
@@ -264,7 +520,7 @@ class Scene {
                                     NULL, NULL, NULL, NULL,
                                     NULL) == AI_SUCCESS) {
           std::string filepath(filepath_prefix + ai_filepath.data);
-          std::string dirpath, filename;
+          std::string dirpath, texname;
           size_t slashpos = filepath.rfind('/');
           size_t conslashpos = filepath.rfind('\\');
           if (conslashpos != std::string::npos) {
@@ -273,74 +529,813 @@ class Scene {
           }
           if (slashpos != std::string::npos) {
             dirpath = filepath.substr(0, slashpos + 1);
-            filename = filepath.substr(slashpos + 1, std::string::npos);
+            texname = filepath.substr(slashpos + 1, std::string::npos);
           } else {
             dirpath = std::string();
-            filename = filepath;
+            texname = filepath;
           }
-          if (!target.material[i].setDiffuse(filename, dirpath + filename))
-            std::cout << "Error loading diffuse " << filepath << std::endl;
+          std::string path = dirpath + texname;
+          int next = (int)staging->diffusePath.size();
+          std::pair<std::map<std::string, int>::iterator, bool> inserted =
+              diffuseIndex.insert(std::make_pair(path, next));
+          if (inserted.second)
+            staging->diffusePath.push_back(path);
+          staging->diffuseOfMaterial[i] = inserted.first->second;
         }
       }
     }
+    staging->diffuseImage.resize(staging->diffusePath.size());
+    loadTiming.parse = elapsedMs(start);
+    return true;
+  }
+
+  // Loader thread, second pass: meshes own disjoint vertex and index
+  // ranges, so they are converted in parallel, the vertices straight into
+  // the buffer mapped by beginAssembly(), while the diffuse textures decode
+  // alongside. Everything needed later is copied out, so the importer and
+  // its scene die here.
+  bool assembleFile() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    SceneImport& import = *staging;
+    const aiScene* scene = import.scene;
+    int nTotalMeshes = (int)meshEntry.size();
+
+    // Textures first, then meshes from the largest down, so that the
+    // longest jobs do not start last
+    std::vector<int> jobs;
+    for (int i = 0; i < (int)import.diffusePath.size(); i++)
+      jobs.push_back(-1 - i);
+    size_t meshJobsBegin = jobs.size();
+    for (int i = 0; i < nTotalMeshes; i++)
+      jobs.push_back(i);
+    std::stable_sort(jobs.begin() + meshJobsBegin, jobs.end(),
+                     [this](int _a, int _b) {
+                       return meshEntry[_a].facetCornerNum >
+                              meshEntry[_b].facetCornerNum;
+                     });
+
+    const int levelPerMesh = SCENE_RESOURCE_LOD_NUM - 1;
+    std::vector<std::vector<Meshlet::Cluster>> clusters(nTotalMeshes);
+    std::vector<std::vector<unsigned int>> levelIndices(nTotalMeshes *
+                                                        levelPerMesh);
+    auto runJob = [this, &jobs, &clusters, &levelIndices,
+                   levelPerMesh](size_t j) {
+      int i = jobs[j];
+      if (i < 0) {
+        TextureImage::Texture::decodeImage(staging->diffusePath[-1 - i],
+                                           staging->diffuseImage[-1 - i]);
+        return;
+      }
+      assembleMesh(i, clusters[i], &levelIndices[i * levelPerMesh]);
+    };
+    if (parallelImport) {
+      Threading::ThreadPool::shared().parallelFor(jobs.size(), runJob);
+      loadTiming.threads = Threading::ThreadPool::shared().size() + 1;
+    } else {
+      for (size_t j = 0; j < jobs.size(); j++)
+        runJob(j);
+      loadTiming.threads = 1;
+    }
+
+    std::vector<unsigned int>& indexAssembly = import.indexAssembly;
+    for (int i = 0; i < nTotalMeshes; i++) {
+      meshEntry[i].firstMeshlet = (unsigned int)meshlet.size();
+      meshEntry[i].meshletNum = (unsigned int)clusters[i].size();
+      meshlet.insert(meshlet.end(), clusters[i].begin(), clusters[i].end());
+    }
+    // Simplified levels go behind all full detail indices, so the level 0
+    // ranges and the meshlets keep their place
+    for (int i = 0; i < nTotalMeshes; i++) {
+      MeshEntry& entry = meshEntry[i];
+      for (unsigned int level = 1; level < entry.lodNum; level++) {
+        std::vector<unsigned int>& levelIndex =
+            levelIndices[i * levelPerMesh + level - 1];
+        entry.lod[level].indexOffset = (unsigned int)indexAssembly.size();
+        entry.lod[level].facetCornerNum = (unsigned int)levelIndex.size();
+        indexAssembly.insert(indexAssembly.end(), levelIndex.begin(),
+                             levelIndex.end());
+        std::vector<unsigned int>().swap(levelIndex);
+      }
+    }
+
+    extractHierarchy(scene->mRootNode, -1);
+    rootInverse = glm::inverse(convertMatrix(scene->mRootNode->mTransformation));
+    import.scene = NULL;
+    import.importer.reset();
+    loadTiming.assemble = elapsedMs(start);
+    return true;
+  }
+
+  static double elapsedMs(std::chrono::steady_clock::time_point _start) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - _start)
+        .count();
+  }
+
+  // Convert mesh _i and finish everything that reads its vertices in
+  // scratch memory, then copy them out in one go: the mapped buffer may be
+  // write combined and slow to read back
+  void assembleMesh(int _i,
+                    std::vector<Meshlet::Cluster>& _clusters,
+                    std::vector<unsigned int>* _levels) {
+    const aiMesh* curMesh = staging->scene->mMeshes[_i];
+    MeshEntry& entry = meshEntry[_i];
+    int nMeshVertices = curMesh->mNumVertices;
+    int nMeshBones = curMesh->mNumBones;
+    int nMeshFaces = curMesh->mNumFaces;
+
+    std::vector<ParametricVertex> vertices;
+    vertices.reserve(nMeshVertices);
+    for (int j = 0; j < nMeshVertices; j++) {
+      aiVector2D curTexcoord(.0f, .0f);
+      if (curMesh->HasTextureCoords(0))
+        curTexcoord = aiVector2D(curMesh->mTextureCoords[0][j].x,
+                                 curMesh->mTextureCoords[0][j].y);
+      vertices.push_back(ParametricVertex(curMesh->mVertices[j], curTexcoord,
+                                          curMesh->mNormals[j]));
+    }
+    // Every mesh weights its own vertices, also for bones first used by an
+    // earlier mesh
+    for (int j = 0; j < nMeshBones; j++) {
+      const aiBone* curBone = curMesh->mBones[j];
+      unsigned int boneId = nameBoneMap.find(curBone->mName.data)->second;
+      for (unsigned int k = 0; k < curBone->mNumWeights; k++)
+        vertices[curBone->mWeights[k].mVertexId].addBone(
+            boneId, curBone->mWeights[k].mWeight);
+    }
+    int influences = 0;
+    for (int j = 0; j < nMeshVertices; j++)
+      influences = std::max(influences, vertices[j].normalizeWeights());
+    entry.skinClass = skinClassOf(influences);
+    unsigned int* indices = &staging->indexAssembly[entry.indexOffset];
+    for (int j = 0; j < nMeshFaces; j++) {
+      for (int k = 0; k < 3; k++)
+        indices[j * 3 + k] = curMesh->mFaces[j].mIndices[k];
+    }
+    computeBounds(_i, vertices.data(), nMeshVertices);
+
+    const ParametricVertex* meshVertices = vertices.data();
+    Meshlet::build(
+        indices, entry.facetCornerNum, nMeshVertices,
+        [meshVertices](size_t v) {
+          return glm::vec3(meshVertices[v].position[0],
+                           meshVertices[v].position[1],
+                           meshVertices[v].position[2]);
+        },
+        entry.indexOffset, _i, _clusters);
+    entry.lod[0].indexOffset = entry.indexOffset;
+    entry.lod[0].facetCornerNum = entry.facetCornerNum;
+    entry.lod[0].error = 0.0f;
+    entry.lodNum = 1;
+    buildLevels(_i, vertices, _levels);
+
+    std::copy(vertices.begin(), vertices.end(),
+              staging->vertexTarget + entry.vertexOffset);
+  }
+
+  // Copy the nodes leading to a bone below _node, returns whether any did
+  bool extractHierarchy(const aiNode* _node, int _parent) {
+    int index = (int)hierarchy.size();
+    SkeletonNode node;
+    node.name = _node->mName.data;
+    node.localTransf = convertMatrix(_node->mTransformation);
+    node.parent = _parent;
+    Name2Bone::const_iterator boneFound = nameBoneMap.find(node.name);
+    node.bone = boneFound != nameBoneMap.end() ? (int)boneFound->second : -1;
+    hierarchy.push_back(node);
+    bool needed = node.bone >= 0;
+    for (unsigned int i = 0; i < _node->mNumChildren; i++)
+      needed |= extractHierarchy(_node->mChildren[i], index);
+    // Children that were not needed have already removed themselves
+    if (!needed)
+      hierarchy.resize(index);
+    return needed;
+  }
+
+  // Simplify entry _i into up to SCENE_RESOURCE_LOD_NUM - 1 index lists,
+  // each about half the previous one, stored to _levels[0..]. Records their
+  // errors and count in the entry, the ranges are assigned by the caller.
+  void buildLevels(int _i,
+                   const std::vector<ParametricVertex>& _vertices,
+                   std::vector<unsigned int>* _levels) {
+    MeshEntry& entry = meshEntry[_i];
+    if (entry.facetCornerNum < SCENE_RESOURCE_LOD_MIN_FACETS * 3)
+      return;
+    const ParametricVertex* vertices = _vertices.data();
+    std::vector<glm::vec3> position(_vertices.size());
+    for (size_t j = 0; j < position.size(); j++)
+      position[j] = glm::vec3(vertices[j].position[0],
+                              vertices[j].position[1],
+                              vertices[j].position[2]);
+    // Merging differently skinned vertices would make the level deform
+    // unlike the full mesh once posed
+    MeshSimplify::Simplifier simplifier(
+        &staging->indexAssembly[entry.indexOffset], entry.facetCornerNum,
+        position, [vertices](unsigned int _from, unsigned int _to) {
+          return vertices[_from].boneWeightDistance(vertices[_to]) <= 0.25f;
+        });
+    size_t previous = entry.facetCornerNum;
+    for (int level = 1; level < SCENE_RESOURCE_LOD_NUM; level++) {
+      const std::vector<unsigned int>& result =
+          simplifier.simplify(previous / 6 * 3);
+      // Locked seams and borders leave too little to remove
+      if (result.size() * 5 > previous * 4)
+        break;
+      _levels[level - 1] = result;
+      entry.lod[level].error = simplifier.getError();
+      entry.lodNum = level + 1;
+      previous = result.size();
+    }
+  }
+
+  // Bind pose box and sphere of entry _i, plus its per-bone split. Called
+  // for several entries at once, skinBounds is sized by parseFile().
+  void computeBounds(int _i, const ParametricVertex* _vertices, int _count) {
+    MeshEntry& entry = meshEntry[_i];
+    std::map<unsigned int, Culling::AABB> boneBox;
+    SkinBounds& skin = skinBounds[_i];
+    for (int j = 0; j < _count; j++) {
+      glm::vec3 p(_vertices[j].position[0], _vertices[j].position[1],
+                  _vertices[j].position[2]);
+      entry.bounds.expand(p);
+      bool weighted = false;
+      for (int k = 0; k < SCENE_RESOURCE_BONE_PER_VERTEX; k++) {
+        if (_vertices[j].boneWeight[k] <= 0.0f)
+          continue;
+        boneBox[_vertices[j].boneId[k]].expand(p);
+        weighted = true;
+      }
+      if (!weighted)
+        skin.rigid.expand(p);
+    }
+    entry.sphere = Culling::sphereAround(entry.bounds, _count, [&](size_t j) {
+      return glm::vec3(_vertices[j].position[0], _vertices[j].position[1],
+                       _vertices[j].position[2]);
+    });
+    skin.bones.assign(boneBox.begin(), boneBox.end());
+  }
+
+  // Rebuild the culling bounds from a pose returned by
+  // getSkeletonTransform(), each bone box is moved by its skinning matrix.
+  // poseSkeleton() and uploadSkeleton() call it, so the bounds follow the
+  // uploaded palette rather than the bind pose.
+  void updateSkinnedBounds(const SkeletonTransf& _transf) {
+    for (size_t i = 0; i < meshEntry.size() && i < skinBounds.size(); i++) {
+      const SkinBounds& skin = skinBounds[i];
+      if (skin.bones.empty())
+        continue;
+      Culling::AABB box = skin.rigid;
+      for (size_t j = 0; j < skin.bones.size(); j++) {
+        unsigned int bone = skin.bones[j].first;
+        if (bone < _transf.size())
+          box.expand(skin.bones[j].second.transformed(_transf[bone]));
+        else
+          box.expand(skin.bones[j].second);
+      }
+      cullBounds[i] = box;
+      cullSphere[i] =
+          Culling::BoundingSphere(box.center(), glm::length(box.extent()));
+    }
+  }
+
+  // Zero the instance count of every entry outside the frustum of
+  // _modelViewProj. render() then skips them; call once per frame before
+  // it, or resetCulling() to draw everything again.
+  const Culling::CullStats& cull(const glm::mat4& _modelViewProj) {
+    cullStats.reset();
+    if (!available)
+      return cullStats;
+    Culling::Frustum frustum(_modelViewProj);
+    bool changed = false;
+    for (size_t c = 0; c < drawCommand.size(); c++) {
+      unsigned int i = drawCommand[c].baseInstance;
+      unsigned int visible = frustum.test(cullSphere[i], cullBounds[i]) ? 1 : 0;
+      if (visible)
+        cullStats.drawn++;
+      else
+        cullStats.culled++;
+      if (drawCommand[c].instanceCount != visible) {
+        drawCommand[c].instanceCount = visible;
+        changed = true;
+      }
+    }
+    if (changed)
+      uploadDrawCommands();
+    return cullStats;
+  }
+
+  void resetCulling() {
+    bool changed = false;
+    for (size_t c = 0; c < drawCommand.size(); c++) {
+      changed |= drawCommand[c].instanceCount != 1;
+      drawCommand[c].instanceCount = 1;
+    }
+    cullStats.reset();
+    cullStats.drawn = (unsigned int)drawCommand.size();
+    if (changed)
+      uploadDrawCommands();
+  }
+
+  // Point every draw at the coarsest level whose error, projected from
+  // _eye in model space at the entry's distance, stays below _pixelError.
+  // _pixelScale is the size in pixels of one unit at unit distance, i.e.
+  // projection[1][1] * viewport height / 2 when the model scales
+  // uniformly. A _pixelError of 0 selects full detail everywhere.
+  void selectLevels(const glm::vec3& _eye,
+                    float _pixelScale,
+                    float _pixelError) {
+    bool changed = false;
+    for (size_t c = 0; c < drawCommand.size(); c++) {
+      unsigned int i = drawCommand[c].baseInstance;
+      const MeshEntry& entry = meshEntry[i];
+      unsigned int level = 0;
+      float distance =
+          glm::length(cullSphere[i].center - _eye) - cullSphere[i].radius;
+      if (_pixelError > 0.0f && distance > 0.0f) {
+        level = entry.lodNum - 1;
+        while (level > 0 &&
+               entry.lod[level].error * _pixelScale > _pixelError * distance)
+          level--;
+      }
+      const MeshLod& lod = entry.lod[level];
+      if (drawCommand[c].firstIndex != lod.indexOffset) {
+        drawCommand[c].firstIndex = lod.indexOffset;
+        drawCommand[c].count = lod.facetCornerNum;
+        changed = true;
+      }
+    }
+    if (changed)
+      uploadDrawCommands();
+  }
+
+  // Order the draws of each batch nearest first by the distance from _eye,
+  // in model space, to their bounding spheres, so that early depth tests
+  // reject more of what comes after. Batches keep their order since each
+  // switches programs and textures. Returns whether anything moved.
+  bool sortFrontToBack(const glm::vec3& _eye) {
+    sortDistance.resize(cullSphere.size());
+    for (size_t i = 0; i < cullSphere.size(); i++)
+      sortDistance[i] =
+          glm::length(cullSphere[i].center - _eye) - cullSphere[i].radius;
+    bool changed = false;
+    for (size_t b = 0; b < drawBatch.size(); b++) {
+      DrawBatch& batch = drawBatch[b];
+      std::vector<DrawElementsIndirectCommand>::iterator first =
+          drawCommand.begin() + batch.firstCommand;
+      std::vector<DrawElementsIndirectCommand>::iterator last =
+          first + batch.entries.size();
+      auto nearer = [&](const DrawElementsIndirectCommand& _a,
+                        const DrawElementsIndirectCommand& _b) {
+        return sortDistance[_a.baseInstance] < sortDistance[_b.baseInstance];
+      };
+      if (std::is_sorted(first, last, nearer))
+        continue;
+      std::stable_sort(first, last, nearer);
+      for (size_t j = 0; j < batch.entries.size(); j++)
+        batch.entries[j] = first[j].baseInstance;
+      changed = true;
+    }
+    if (changed) {
+      drawOrder++;
+      uploadDrawCommands();
+    }
+    return changed;
+  }
+  unsigned int getDrawOrder() const { return drawOrder; }
+
+  // Triangles in the draws of the current list that are not culled
+  unsigned int getDrawnTriangles() const {
+    unsigned int triangles = 0;
+    for (size_t c = 0; c < drawCommand.size(); c++)
+      if (drawCommand[c].instanceCount != 0)
+        triangles += drawCommand[c].count / 3;
+    return triangles;
+  }
+
+  const Culling::CullStats& getCullStats() const { return cullStats; }
+  const std::vector<Culling::AABB>& getCullBounds() const { return cullBounds; }
+  const std::vector<Meshlet::Cluster>& getMeshlets() const { return meshlet; }
+  const std::vector<MeshEntry>& getMeshEntries() const { return meshEntry; }
+
+  // Skinned entries move away from their bind pose, so their clusters
+  // cannot be culled individually
+  bool isSkinned(unsigned int _entry) const {
+    return _entry < skinBounds.size() && !skinBounds[_entry].bones.empty();
+  }
+
+  void uploadDrawCommands() {
+    if (indirectBuffer == 0)
+      return;
+    size_t bytes = sizeof(DrawElementsIndirectCommand) * drawCommand.size();
+    if (GLState::hasDirectStateAccess()) {
+      glNamedBufferSubData(indirectBuffer, 0, bytes, drawCommand.data());
+      return;
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, bytes, drawCommand.data());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
+
+  // GL thread, between the passes: allocate the vertex buffer at its final
+  // size and map it for the loader threads to write into
+  bool beginAssembly() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    size_t bytes = sizeof(ParametricVertex) * staging->vertexNum;
+    void* mapped = NULL;
+    // Immutable storage only needs to be writable while mapped once
+    if (bytes > 0 && GLState::hasDirectStateAccess()) {
+      glNamedBufferStorage(vbo, bytes, NULL, GL_MAP_WRITE_BIT);
+      mapped = glMapNamedBufferRange(
+          vbo, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    } else if (bytes > 0) {
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      if (hasBufferStorage())
+        glBufferStorage(GL_ARRAY_BUFFER, bytes, NULL, GL_MAP_WRITE_BIT);
+      else
+        glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STATIC_DRAW);
+      mapped = glMapBufferRange(
+          GL_ARRAY_BUFFER, 0, bytes,
+          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (bytes > 0 && mapped == NULL)
+      return false;
+    staging->vertexTarget = (ParametricVertex*)mapped;
+    bufferBytes += bytes;
+    loadTiming.upload = elapsedMs(start);
+
+    loadStage = LOAD_ASSEMBLING;
+    pending = Threading::ThreadPool::shared().submit(
+        [this] { return assembleFile(); });
+    return true;
+  }
+
+  // Runs on the GL thread once the current pass has finished: starts the
+  // next one or completes the load. Returns false when the load failed.
+  bool advanceLoad() {
+    bool passed = pending.get();
+    LoadStage stage = loadStage;
+    loadStage = LOAD_DONE;
+    if (stage == LOAD_ASSEMBLING && staging->vertexTarget != NULL) {
+      // The contents are undefined if the store was lost while mapped
+      GLboolean unmapped;
+      if (GLState::hasDirectStateAccess()) {
+        unmapped = glUnmapNamedBuffer(vbo);
+      } else {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        unmapped = glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+      }
+      passed = unmapped == GL_TRUE && passed;
+      staging->vertexTarget = NULL;
+    }
+    if (passed && stage == LOAD_PARSING)
+      passed = beginAssembly();
+    if (!passed) {
+      staging.reset();
+      return false;
+    }
+    if (stage == LOAD_ASSEMBLING)
+      completeLoad();
+    return true;
+  }
+
+  // Blocks until the background load is done
+  bool finishLoad() {
+    while (isLoading()) {
+      if (!advanceLoad())
+        return false;
+    }
+    return available;
+  }
+
+  void completeLoad() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    buildTextureArrays();
+    buildDrawBatches();
 
-    glGenVertexArrays(1, &target.vao);
-    glBindVertexArray(target.vao);
+    cullBounds.resize(meshEntry.size());
+    cullSphere.resize(meshEntry.size());
+    for (size_t i = 0; i < meshEntry.size(); i++) {
+      cullBounds[i] = meshEntry[i].bounds;
+      cullSphere[i] = meshEntry[i].sphere;
+    }
 
-    glGenBuffers(1, &target.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, target.vbo);
-    glBufferData(GL_ARRAY_BUFFER,
-                 sizeof(ParametricVertex) * vertexAssembly.size(),
-                 vertexAssembly.data(), GL_STATIC_DRAW);
+    size_t indexBytes = sizeof(unsigned int) * staging->indexAssembly.size();
+    if (GLState::hasDirectStateAccess() && indexBytes > 0) {
+      glNamedBufferStorage(ebo, indexBytes, staging->indexAssembly.data(), 0);
+    } else {
+      GLState::Cache::current().bindVertexArray(vao);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+      if (hasBufferStorage() && indexBytes > 0)
+        glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, indexBytes,
+                        staging->indexAssembly.data(), 0);
+      else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes,
+                     staging->indexAssembly.data(), GL_STATIC_DRAW);
+      GLState::Cache::current().bindVertexArray(0);
+    }
+    bufferBytes += indexBytes;
+
+    staging.reset();
+    available = true;
+
+    // Skinned draws need a palette before any pose is set
+    poseSkeleton(SkeletonModifier());
+    loadTiming.upload += elapsedMs(start);
+
+    MemoryUsage usage = getMemoryUsage();
+    std::cout << "Loaded " << filename << ": " << usage.host / 1024
+              << " KiB host, " << usage.gpu / 1024 << " KiB GPU, "
+              << usage.imported / 1024 << " KiB of importer data released"
+              << std::endl;
+    std::cout << "Import timing: parse " << loadTiming.parse << " ms, assemble "
+              << loadTiming.assemble << " ms on " << loadTiming.threads
+              << " thread(s), upload " << loadTiming.upload << " ms"
+              << std::endl;
+  }
 
-    glGenBuffers(1, &target.ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, target.ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 sizeof(unsigned int) * indexAssembly.size(),
-                 indexAssembly.data(), GL_STATIC_DRAW);
+  const LoadTiming& getLoadTiming() const { return loadTiming; }
+
+  bool isLoading() const { return pending.valid(); }
+
+  static bool hasBufferStorage() {
+    return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+  }
+
+  static bool hasBaseInstance() {
+    return GLEW_VERSION_4_2 || GLEW_ARB_base_instance;
+  }
+
+  static bool hasMultiDrawIndirect() {
+    return hasBaseInstance() &&
+           (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect);
+  }
+
+  // Pack the decoded diffuse maps into one array per size and format, a
+  // file named by several materials takes a single layer
+  void buildTextureArrays() {
+    int nTotalImages = (int)staging->diffusePath.size();
+    std::vector<int> arrayOfImage(nTotalImages, -1);
+    std::vector<int> layerOfImage(nTotalImages, -1);
+
+    std::map<uint64_t, std::vector<int>> groups;
+    for (int i = 0; i < nTotalImages; i++) {
+      const TextureImage::DecodedImage& image = staging->diffuseImage[i];
+      if (!image.valid()) {
+        std::cout << "Error loading diffuse " << staging->diffusePath[i]
+                  << std::endl;
+        continue;
+      }
+      groups[TextureImage::TextureArray::groupKey(image)].push_back(i);
+    }
+
+    for (std::map<uint64_t, std::vector<int>>::iterator it = groups.begin();
+         it != groups.end(); ++it) {
+      std::vector<const TextureImage::DecodedImage*> images;
+      for (size_t j = 0; j < it->second.size(); j++)
+        images.push_back(&staging->diffuseImage[it->second[j]]);
+      std::unique_ptr<TextureImage::TextureArray> array(
+          new TextureImage::TextureArray());
+      if (!array->create(images)) {
+        std::cout << "Error creating diffuse array for " << filename
+                  << std::endl;
+        continue;
+      }
+      for (size_t j = 0; j < it->second.size(); j++) {
+        arrayOfImage[it->second[j]] = (int)textureArray.size();
+        layerOfImage[it->second[j]] = (int)j;
+      }
+      textureArray.push_back(std::move(array));
+    }
+
+    int nTotalMaterials = (int)staging->diffuseOfMaterial.size();
+    material.resize(nTotalMaterials);
+    for (int i = 0; i < nTotalMaterials; i++) {
+      int image = staging->diffuseOfMaterial[i];
+      if (image < 0)
+        continue;
+      material[i].diffuseArray = arrayOfImage[image];
+      material[i].diffuseLayer = layerOfImage[image];
+    }
+  }
+
+  void buildDrawBatches() {
+    std::vector<int>& layer = drawLayer;
+    layer.assign(meshEntry.size(), -1);
+    // Ordered by variant first, so that render() switches programs at most
+    // once per variant
+    std::map<std::pair<int, int>, std::vector<unsigned int>> entriesOfBatch;
+    for (unsigned int i = 0; i < meshEntry.size(); i++) {
+      int array = -1;
+      if (meshEntry[i].materialIndex < material.size()) {
+        const Material& mat = material[meshEntry[i].materialIndex];
+        array = mat.diffuseArray;
+        layer[i] = mat.diffuseLayer;
+      }
+      entriesOfBatch[std::make_pair((int)meshEntry[i].skinClass, array)]
+          .push_back(i);
+    }
+    for (std::map<std::pair<int, int>, std::vector<unsigned int>>::iterator
+             it = entriesOfBatch.begin();
+         it != entriesOfBatch.end(); ++it) {
+      drawBatch.push_back(DrawBatch());
+      drawBatch.back().skinClass = (SkinClass)it->first.first;
+      drawBatch.back().textureArray = it->first.second;
+      drawBatch.back().entries.swap(it->second);
+    }
+
+    bool dsa = GLState::hasDirectStateAccess();
+    if (dsa && !layer.empty()) {
+      glNamedBufferStorage(drawBuffer, sizeof(int) * layer.size(),
+                           layer.data(), 0);
+    } else {
+      glBindBuffer(GL_ARRAY_BUFFER, drawBuffer);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(int) * layer.size(), layer.data(),
+                   GL_STATIC_DRAW);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    bufferBytes += sizeof(int) * layer.size();
+
+    // The draw list never changes after load, build it once
+    drawCommand.clear();
+    for (size_t b = 0; b < drawBatch.size(); b++) {
+      drawBatch[b].firstCommand = (unsigned int)drawCommand.size();
+      for (size_t j = 0; j < drawBatch[b].entries.size(); j++) {
+        unsigned int i = drawBatch[b].entries[j];
+        DrawElementsIndirectCommand command;
+        command.count = meshEntry[i].facetCornerNum;
+        command.instanceCount = 1;
+        command.firstIndex = meshEntry[i].indexOffset;
+        command.baseVertex = meshEntry[i].vertexOffset;
+        command.baseInstance = i;
+        drawCommand.push_back(command);
+      }
+    }
+    if (hasMultiDrawIndirect()) {
+      size_t commandBytes =
+          sizeof(DrawElementsIndirectCommand) * drawCommand.size();
+      if (dsa) {
+        glCreateBuffers(1, &indirectBuffer);
+        glNamedBufferData(indirectBuffer, commandBytes, drawCommand.data(),
+                          GL_DYNAMIC_DRAW);
+      } else {
+        glGenBuffers(1, &indirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commandBytes, drawCommand.data(),
+                     GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      }
+      bufferBytes += commandBytes;
+    }
+  }
+
+  // The command list as built at load time, possibly reordered by
+  // sortFrontToBack(), for passes that write their own indirect buffers
+  // (e.g. GPU culling)
+  const std::vector<DrawElementsIndirectCommand>& getDrawCommands() const {
+    return drawCommand;
+  }
+  const std::vector<DrawBatch>& getDrawBatches() const { return drawBatch; }
+  GLuint getIndirectBuffer() const { return indirectBuffer; }
+  GLuint getIndexBuffer() const { return ebo; }
+
+  // Start loading on a worker thread and return immediately. The scene
+  // renders nothing until updatePendingScenes() has uploaded it, but its
+  // shader inputs can already be set. The handle holds a reference to give
+  // back with releaseScene(), it is null when the file cannot be found.
+  static Handle loadSceneAsync(std::string _name,
+                               std::string _filename = std::string()) {
+    if (_filename.empty() || _filename == "") {
+      _filename = testAllSuffix(_name);
+      if (_filename.empty())
+        return Handle();
+    }
+    FILE* fi = fopen(_filename.c_str(), "r");
+    if (fi == NULL)
+      return Handle();
+    fclose(fi);
+
+    Handle existing = allScene.find(_name);
+    Scene* loaded = allScene.get(existing);
+    if (loaded != NULL && loaded->filename == _filename &&
+        (loaded->available || loaded->isLoading())) {
+      allScene.acquire(existing);
+      return existing;
+    }
+
+    // Replaces a scene of the same name from another file, handles to that
+    // one go stale
+    Scene* target = new Scene();
+    Handle handle = allScene.insert(_name, target);
+    target->name = _name;
+    target->filename = _filename;
+
+    // Buffer names are created up front so that the vertex layout can be
+    // recorded into the VAO before the data arrives
+    if (GLState::hasDirectStateAccess()) {
+      glCreateVertexArrays(1, &target->vao);
+      glCreateBuffers(1, &target->vbo);
+      glCreateBuffers(1, &target->ebo);
+      glCreateBuffers(1, &target->drawBuffer);
+      glVertexArrayElementBuffer(target->vao, target->ebo);
+    } else {
+      glGenVertexArrays(1, &target->vao);
+      GLState::Cache::current().bindVertexArray(target->vao);
+      glGenBuffers(1, &target->vbo);
+      glGenBuffers(1, &target->ebo);
+      glGenBuffers(1, &target->drawBuffer);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, target->ebo);
+      GLState::Cache::current().bindVertexArray(0);
+    }
+
+    target->staging.reset(new SceneImport());
+    target->loadStage = LOAD_PARSING;
+    target->pending = Threading::ThreadPool::shared().submit(
+        [target] { return target->parseFile(); });
+    return handle;
+  }
+
+  static Handle loadScene(std::string _name,
+                          std::string _filename = std::string()) {
+    Handle handle = loadSceneAsync(_name, _filename);
+    Scene* target = allScene.get(handle);
+    if (target == NULL)
+      return Handle();
+    if (!target->finishLoad()) {
+      allScene.destroy(handle);
+      return Handle();
+    }
+    allScene.setBytes(handle, target->residentBytes());
+    return handle;
+  }
 
-    glBindVertexArray(0);
+  // Advance every scene whose current import pass has completed, call once
+  // per frame from the GL thread. Scenes that failed to load are
+  // destroyed, so their handles go stale.
+  static void updatePendingScenes() {
+    std::vector<Handle> failed;
+    std::vector<std::pair<Handle, size_t>> finished;
+    allScene.forEach([&failed, &finished](Handle _handle, Scene& _target) {
+      if (!_target.isLoading())
+        return;
+      if (_target.pending.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready)
+        return;
+      if (!_target.advanceLoad()) {
+        std::cout << "Error occured in loadScene() for " << _target.filename
+                  << std::endl;
+        failed.push_back(_handle);
+      } else if (!_target.isLoading()) {
+        finished.push_back(std::make_pair(_handle, _target.residentBytes()));
+      }
+    });
+    for (size_t i = 0; i < finished.size(); i++)
+      allScene.setBytes(finished[i].first, finished[i].second);
+    for (size_t i = 0; i < failed.size(); i++)
+      allScene.destroy(failed[i]);
+  }
 
-    target.available = true;
-    return target;
+  static bool releaseScene(Handle _handle) {
+    return allScene.release(_handle);
   }
 
+  // Destroy a scene whatever its references, their handles go stale
   static bool unloadScene(std::string _name) {
-    return allScene.erase(_name) != 0;
+    return allScene.destroy(allScene.find(_name));
+  }
+
+  static Scene& getScene(Handle _handle) {
+    Scene* target = allScene.get(_handle);
+    return target != NULL ? *target : error;
   }
 
   static Scene& getScene(const std::string& _name) {
-    Name2Scene::iterator find_result = allScene.find(_name);
-    if (find_result == allScene.end())
-      return error;
-    return *(find_result->second);
-  }
-
-  void recursivelyGetTransf(SkeletonTransf& skTransf,
-                            SkeletonModifier& modifier,
-                            aiNode* node,
-                            aiMatrix4x4 parentTransf,
-                            const aiMatrix4x4& invTransf) const {
-    aiMatrix4x4 globalTransf = parentTransf * node->mTransformation;
-    Name2Bone::const_iterator boneFound =
-        nameBoneMap.find(std::string(node->mName.data));
-    if (boneFound != nameBoneMap.end()) {
+    return getScene(allScene.find(_name));
+  }
+
+  // Evaluate the pose given by _modifier and hand every bone's skinning
+  // matrix to _store(bone, matrix)
+  template <typename F>
+  void evaluateSkeleton(const SkeletonModifier& _modifier, F _store) const {
+    // A modifier moves its bone and everything below it
+    std::vector<glm::fmat4> globalTransf(hierarchy.size());
+    for (size_t i = 0; i < hierarchy.size(); i++) {
+      const SkeletonNode& node = hierarchy[i];
+      globalTransf[i] = node.parent < 0
+                            ? node.localTransf
+                            : globalTransf[node.parent] * node.localTransf;
+      if (node.bone < 0)
+        continue;
       SkeletonModifier::const_iterator boneModFound =
-          modifier.find(std::string(node->mName.data));
-      aiMatrix4x4 boneMod;
-      if (boneModFound != modifier.end()) {
-        auto trans = glm::transpose(boneModFound->second);
-        memcpy(&boneMod, &trans, 16 * sizeof(float));
-        globalTransf *= boneMod;
-      }
-      aiMatrix4x4 finalMtrx =
-          invTransf * globalTransf * skeleton[boneFound->second].localTransf;
-      memcpy(&skTransf[boneFound->second], &finalMtrx.Transpose(),
-             sizeof(skTransf[boneFound->second]));
-    }
-    for (int i = 0; i < node->mNumChildren; i++) {
-      recursivelyGetTransf(skTransf, modifier, node->mChildren[i], globalTransf,
-                           invTransf);
+          _modifier.find(node.name);
+      if (boneModFound != _modifier.end())
+        globalTransf[i] *= boneModFound->second;
+      _store(node.bone,
+             rootInverse * globalTransf[i] * skeleton[node.bone].localTransf);
     }
   }
 
@@ -349,99 +1344,391 @@ class Scene {
     if (!available)
       return false;
 
-    transf.resize(skeleton.size());
+    transf.assign(skeleton.size(), glm::fmat4(1.0f));
+    evaluateSkeleton(modifier, [&transf](int _bone, const glm::fmat4& _m) {
+      transf[_bone] = _m;
+    });
+    return !transf.empty();
+  }
+
+  // Half the size of the matrices, for SKINNING_DUAL_QUATERNION
+  bool getSkeletonDualQuat(SkeletonDualQuat& dualQuat,
+                           SkeletonModifier& modifier) const {
+    if (!available)
+      return false;
 
-    aiMatrix4x4 identityMtrx, invTransf = scene->mRootNode->mTransformation;
-    invTransf.Inverse();
-    recursivelyGetTransf(transf, modifier, scene->mRootNode, identityMtrx,
-                         invTransf);
+    dualQuat.assign(skeleton.size(),
+                    DualQuaternion::fromMatrix(glm::fmat4(1.0f)));
+    evaluateSkeleton(modifier, [&dualQuat](int _bone, const glm::fmat4& _m) {
+      dualQuat[_bone] = DualQuaternion::fromMatrix(_m);
+    });
+    return !dualQuat.empty();
+  }
+
+  // Set the pose the scene is drawn in: upload its palette in the current
+  // skinning mode and move the culling bounds along
+  bool poseSkeleton(const SkeletonModifier& _modifier) {
+    if (!available)
+      return false;
+    pose = _modifier;
+    SkeletonTransf transf(skeleton.size(), glm::fmat4(1.0f));
+    SkeletonDualQuat dualQuat;
+    if (skinningMode == SKINNING_DUAL_QUATERNION)
+      dualQuat.assign(skeleton.size(),
+                      DualQuaternion::fromMatrix(glm::fmat4(1.0f)));
+    evaluateSkeleton(pose, [&transf, &dualQuat](int _bone,
+                                                const glm::fmat4& _m) {
+      transf[_bone] = _m;
+      if (!dualQuat.empty())
+        dualQuat[_bone] = DualQuaternion::fromMatrix(_m);
+    });
+    if (skinningMode == SKINNING_DUAL_QUATERNION) {
+      uploadSkeleton(dualQuat);
+      updateSkinnedBounds(transf);
+    } else {
+      uploadSkeleton(transf);
+    }
     return !transf.empty();
   }
 
+  // Switch the palette layout of every loaded scene. The skinning shaders
+  // have to be rebuilt to match.
+  static void setSkinningMode(SkinningMode _mode) {
+    if (_mode == skinningMode)
+      return;
+    skinningMode = _mode;
+    allScene.forEach([](Handle, Scene& _target) {
+      _target.poseSkeleton(_target.pose);
+    });
+  }
+  static SkinningMode getSkinningMode() { return skinningMode; }
+
+  struct MemoryUsage {
+    size_t host;
+    size_t gpu;
+    // Held by the importer while the file was parsed, now released
+    size_t imported;
+  };
+
+  // Host and GPU bytes, as counted against the registry budget
+  size_t residentBytes() const {
+    MemoryUsage usage = getMemoryUsage();
+    return usage.host + usage.gpu;
+  }
+
+  // Zero while a load is in flight, the pool thread is still filling the
+  // containers counted here
+  MemoryUsage getMemoryUsage() const {
+    MemoryUsage usage = {0, 0, 0};
+    if (isLoading())
+      return usage;
+    usage.host = sizeof(MeshEntry) * meshEntry.capacity() +
+                 sizeof(Meshlet::Cluster) * meshlet.capacity() +
+                 sizeof(Material) * material.capacity() +
+                 sizeof(int) * drawLayer.capacity() +
+                 sizeof(DrawElementsIndirectCommand) * drawCommand.capacity() +
+                 sizeof(Culling::AABB) * cullBounds.capacity() +
+                 sizeof(Culling::BoundingSphere) * cullSphere.capacity() +
+                 sizeof(Bone) * skeleton.capacity() +
+                 sizeof(SkeletonNode) * hierarchy.capacity();
+    for (size_t i = 0; i < skinBounds.size(); i++)
+      usage.host += sizeof(SkinBounds) +
+                    sizeof(skinBounds[i].bones[0]) *
+                        skinBounds[i].bones.capacity();
+    for (size_t i = 0; i < hierarchy.size(); i++)
+      usage.host += hierarchy[i].name.capacity();
+    for (Name2Bone::const_iterator it = nameBoneMap.begin();
+         it != nameBoneMap.end(); ++it)
+      usage.host += sizeof(*it) + it->first.capacity();
+    for (size_t b = 0; b < drawBatch.size(); b++)
+      usage.host += sizeof(DrawBatch) +
+                    sizeof(unsigned int) * drawBatch[b].entries.capacity();
+    usage.gpu = bufferBytes;
+    for (size_t i = 0; i < textureArray.size(); i++)
+      usage.gpu += textureArray[i]->memorySize();
+    usage.imported = importedBytes;
+    return usage;
+  }
+
   bool setShaderInput(GLuint program,
                       std::string posiName,
                       std::string texcName,
                       std::string normName,
                       std::string bnidName,
-                      std::string bnwtName) {
-    if (!available)
+                      std::string bnwtName,
+                      std::string layrName = "aTexLayer") {
+    if (vao == 0)
       return false;
 
     ParametricVertex example;
+    const char* base = (const char*)&example;
+
+    // With direct state access the layout is recorded by name, the vertices
+    // from binding 0 and the per draw layer from binding 1
+    bool dsa = GLState::hasDirectStateAccess();
+    if (dsa) {
+      glVertexArrayVertexBuffer(vao, 0, vbo, 0, sizeof(ParametricVertex));
+    } else {
+      GLState::Cache::current().bindVertexArray(vao);
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    }
+    auto attribute = [&](GLint _location, GLint _size, GLenum _type,
+                         const void* _member) {
+      bool integer = _type == GL_INT;
+      GLuint offset = (GLuint)((const char*)_member - base);
+      if (dsa) {
+        glEnableVertexArrayAttrib(vao, _location);
+        if (integer)
+          glVertexArrayAttribIFormat(vao, _location, _size, _type, offset);
+        else
+          glVertexArrayAttribFormat(vao, _location, _size, _type, GL_FALSE,
+                                    offset);
+        glVertexArrayAttribBinding(vao, _location, 0);
+        return;
+      }
+      glEnableVertexAttribArray(_location);
+      if (integer)
+        glVertexAttribIPointer(_location, _size, _type,
+                               sizeof(ParametricVertex),
+                               (const void*)(size_t)offset);
+      else
+        glVertexAttribPointer(_location, _size, _type, GL_FALSE,
+                              sizeof(ParametricVertex),
+                              (const void*)(size_t)offset);
+    };
 
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    GLint posiLoc = glGetAttribLocation(program, posiName.c_str());
+    if (posiLoc >= 0)
+      attribute(posiLoc, 3, GL_FLOAT, example.position);
+    GLint texcLoc = glGetAttribLocation(program, texcName.c_str());
+    if (texcLoc >= 0)
+      attribute(texcLoc, 2, GL_FLOAT, example.texcoord);
+    GLint normLoc = glGetAttribLocation(program, normName.c_str());
+    if (normLoc >= 0)
+      attribute(normLoc, 3, GL_FLOAT, example.normal);
+    GLint bnidLoc = glGetAttribLocation(program, bnidName.c_str());
+    if (bnidLoc >= 0)
+      attribute(bnidLoc, SCENE_RESOURCE_BONE_PER_VERTEX, GL_INT,
+                example.boneId);
+    GLint bnwtLoc = glGetAttribLocation(program, bnwtName.c_str());
+    if (bnwtLoc >= 0)
+      attribute(bnwtLoc, SCENE_RESOURCE_BONE_PER_VERTEX, GL_FLOAT,
+                example.boneWeight);
 
-    {
-      GLint posiLoc = glGetAttribLocation(program, posiName.c_str());
-      if (posiLoc >= 0) {
-        glEnableVertexAttribArray(posiLoc);
-        glVertexAttribPointer(
-            posiLoc, 3, GL_FLOAT, GL_FALSE, sizeof(ParametricVertex),
-            (const void*)((char*)example.position - (char*)&example));
+    // Without base instance the layer is set per draw as a constant
+    // attribute value instead
+    layerLocation = glGetAttribLocation(program, layrName.c_str());
+    if (layerLocation >= 0 && hasBaseInstance()) {
+      if (dsa) {
+        glVertexArrayVertexBuffer(vao, 1, drawBuffer, 0, sizeof(int));
+        glVertexArrayBindingDivisor(vao, 1, 1);
+        glEnableVertexArrayAttrib(vao, layerLocation);
+        glVertexArrayAttribIFormat(vao, layerLocation, 1, GL_INT, 0);
+        glVertexArrayAttribBinding(vao, layerLocation, 1);
+      } else {
+        glBindBuffer(GL_ARRAY_BUFFER, drawBuffer);
+        glEnableVertexAttribArray(layerLocation);
+        glVertexAttribIPointer(layerLocation, 1, GL_INT, sizeof(int),
+                               (const void*)0);
+        glVertexAttribDivisor(layerLocation, 1);
       }
     }
-    {
-      GLint texcLoc = glGetAttribLocation(program, texcName.c_str());
-      if (texcLoc >= 0) {
-        glEnableVertexAttribArray(texcLoc);
-        glVertexAttribPointer(
-            texcLoc, 2, GL_FLOAT, GL_FALSE, sizeof(ParametricVertex),
-            (const void*)((char*)example.texcoord - (char*)&example));
-      }
+
+    if (!dsa)
+      GLState::Cache::current().bindVertexArray(0);
+
+    return true;
+  }
+
+  // Upload a pose from getSkeletonTransform() or getSkeletonDualQuat() for
+  // the skinning variants, the layout has to match the skinning mode.
+  // Matrices also move the culling bounds; dual quaternions do not, call
+  // updateSkinnedBounds() with the matrices of the pose as well.
+  void uploadSkeleton(const SkeletonTransf& _transf) {
+    uploadPalette(_transf.data(), sizeof(glm::fmat4) * _transf.size());
+    updateSkinnedBounds(_transf);
+  }
+  void uploadSkeleton(const SkeletonDualQuat& _dualQuat) {
+    uploadPalette(_dualQuat.data(),
+                  sizeof(DualQuaternion) * _dualQuat.size());
+  }
+
+  void uploadPalette(const void* _data, size_t _bytes) {
+    if (_bytes == 0)
+      return;
+    bool dsa = GLState::hasDirectStateAccess();
+    if (paletteBuffer == 0 && dsa) {
+      glCreateBuffers(1, &paletteBuffer);
+      glCreateTextures(GL_TEXTURE_BUFFER, 1, &paletteTexture);
+    } else if (paletteBuffer == 0) {
+      glGenBuffers(1, &paletteBuffer);
+      glGenTextures(1, &paletteTexture);
     }
-    {
-      GLint normLoc = glGetAttribLocation(program, normName.c_str());
-      if (normLoc >= 0) {
-        glEnableVertexAttribArray(normLoc);
-        glVertexAttribPointer(
-            normLoc, 3, GL_FLOAT, GL_FALSE, sizeof(ParametricVertex),
-            (const void*)((char*)example.normal - (char*)&example));
+    if (dsa) {
+      if (_bytes != paletteBytes) {
+        glNamedBufferData(paletteBuffer, _bytes, _data, GL_DYNAMIC_DRAW);
+        glTextureBuffer(paletteTexture, GL_RGBA32F, paletteBuffer);
+      } else {
+        glNamedBufferSubData(paletteBuffer, 0, _bytes, _data);
       }
-    }
-    {
-      GLint bnidLoc = glGetAttribLocation(program, bnidName.c_str());
-      if (bnidLoc >= 0) {
-        glEnableVertexAttribArray(bnidLoc);
-        glVertexAttribIPointer(
-            bnidLoc, SCENE_RESOURCE_BONE_PER_VERTEX, GL_INT,
-            sizeof(ParametricVertex),
-            (const void*)((char*)example.boneId - (char*)&example));
+    } else {
+      glBindBuffer(GL_TEXTURE_BUFFER, paletteBuffer);
+      if (_bytes != paletteBytes) {
+        glBufferData(GL_TEXTURE_BUFFER, _bytes, _data, GL_DYNAMIC_DRAW);
+        GLState::Cache::current().bindTexture(GL_TEXTURE_BUFFER,
+                                              paletteTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, paletteBuffer);
+      } else {
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, _bytes, _data);
       }
+      glBindBuffer(GL_TEXTURE_BUFFER, 0);
     }
-    {
-      GLint bnwtLoc = glGetAttribLocation(program, bnwtName.c_str());
-      if (bnwtLoc >= 0) {
-        glEnableVertexAttribArray(bnwtLoc);
-        glVertexAttribPointer(
-            bnwtLoc, SCENE_RESOURCE_BONE_PER_VERTEX, GL_FLOAT, GL_FALSE,
-            sizeof(ParametricVertex),
-            (const void*)((char*)example.boneWeight - (char*)&example));
-      }
+    if (_bytes != paletteBytes) {
+      bufferBytes = bufferBytes - paletteBytes + _bytes;
+      paletteBytes = _bytes;
     }
+  }
 
-    glBindVertexArray(0);
+  // Programs render() draws each skin class with. They must share the
+  // attribute locations set by setShaderInput(), and each reads the
+  // influences given by skinInfluences() of its class.
+  void setSkinPrograms(const GLuint* _programs) {
+    for (int c = 0; c < SKIN_CLASS_NUM; c++)
+      skinProgram[c] = _programs[c];
+  }
 
-    return true;
+  void useSkinProgram(const DrawBatch& _batch, SkinClass& _bound) const {
+    if (_batch.skinClass == _bound)
+      return;
+    _bound = _batch.skinClass;
+    if (skinProgram[_bound] != 0)
+      GLState::Cache::current().useProgram(skinProgram[_bound]);
   }
 
-  void render() const {
+  // Bind the diffuse array of a batch, or nothing when it has none
+  void bindBatchTexture(const DrawBatch& batch) const {
+    if (batch.textureArray < 0 ||
+        !textureArray[batch.textureArray]->bind(
+            SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL)) {
+      GLState::Cache::current().bindTexture(
+          SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL, GL_TEXTURE_2D_ARRAY, 0);
+    }
+  }
+
+  // With multi-draw indirect every batch is a single call. commandBuffer
+  // may replace the load-time draw list with one of the same layout, and
+  // countBuffer, when ARB_indirect_parameters is present, holds one
+  // GLuint draw count per batch. indexBuffer may likewise replace the
+  // index buffer, e.g. by one holding only the visible meshlets. Without
+  // multi-draw indirect the overrides are read back and drawn one by one,
+  // which waits for the GPU to write them. With skin programs set, the one
+  // of the last batch drawn stays bound, as does the vertex array.
+  void render(GLuint commandBuffer = 0,
+              GLuint countBuffer = 0,
+              GLuint indexBuffer = 0) const {
     if (!available)
       return;
-    glBindVertexArray(vao);
-    for (int i = 0; i < meshEntry.size(); i++) {
-      if (!material[meshEntry[i].materialIndex].diffuse->bind(
-              SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL))
-        glBindTexture(GL_TEXTURE_2D, 0);
+    GLState::Cache& state = GLState::Cache::current();
+    state.bindTexture(SCENE_RESOURCE_SHADER_BONE_CHANNEL, GL_TEXTURE_BUFFER,
+                      paletteTexture);
+    SkinClass bound = SKIN_CLASS_NUM;
+    state.bindVertexArray(vao);
+    if (hasMultiDrawIndirect()) {
+      if (indexBuffer != 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+      bool useCount = countBuffer != 0 && GLEW_ARB_indirect_parameters;
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER,
+                   commandBuffer != 0 ? commandBuffer : indirectBuffer);
+      if (useCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+      for (size_t b = 0; b < drawBatch.size(); b++) {
+        const DrawBatch& batch = drawBatch[b];
+        useSkinProgram(batch, bound);
+        bindBatchTexture(batch);
+        const void* offset = (const void*)(sizeof(DrawElementsIndirectCommand) *
+                                           batch.firstCommand);
+        if (useCount)
+          glMultiDrawElementsIndirectCountARB(
+              GL_TRIANGLES, GL_UNSIGNED_INT, offset,
+              (GLintptr)(sizeof(GLuint) * b), (GLsizei)batch.entries.size(),
+              0);
+        else
+          glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, offset,
+                                      (GLsizei)batch.entries.size(), 0);
+      }
+      if (useCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+      if (indexBuffer != 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      return;
+    }
 
-      glDrawElementsBaseVertex(
-          GL_TRIANGLES, meshEntry[i].facetCornerNum, GL_UNSIGNED_INT,
-          (void*)(sizeof(unsigned int) * meshEntry[i].indexOffset),
-          meshEntry[i].vertexOffset);
+    const DrawElementsIndirectCommand* commands = drawCommand.data();
+    std::vector<DrawElementsIndirectCommand> readCommands;
+    if (commandBuffer != 0) {
+      readCommands.resize(drawCommand.size());
+      readBuffer(commandBuffer, readCommands.data(),
+                 sizeof(DrawElementsIndirectCommand) * readCommands.size());
+      commands = readCommands.data();
+    }
+    std::vector<GLuint> counts;
+    if (countBuffer != 0) {
+      counts.resize(drawBatch.size());
+      readBuffer(countBuffer, counts.data(), sizeof(GLuint) * counts.size());
+    }
+    if (indexBuffer != 0)
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+
+    bool baseInstance = hasBaseInstance();
+    for (size_t b = 0; b < drawBatch.size(); b++) {
+      const DrawBatch& batch = drawBatch[b];
+      useSkinProgram(batch, bound);
+      bindBatchTexture(batch);
+      size_t drawNum = batch.entries.size();
+      if (countBuffer != 0)
+        drawNum = std::min(drawNum, (size_t)counts[b]);
+      for (size_t j = 0; j < drawNum; j++) {
+        const DrawElementsIndirectCommand& command =
+            commands[batch.firstCommand + j];
+        if (command.instanceCount == 0)
+          continue;
+        if (baseInstance) {
+          glDrawElementsInstancedBaseVertexBaseInstance(
+              GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+              (void*)(sizeof(unsigned int) * command.firstIndex),
+              command.instanceCount, command.baseVertex,
+              command.baseInstance);
+        } else {
+          if (layerLocation >= 0)
+            glVertexAttribI1i(layerLocation, drawLayer[command.baseInstance]);
+          glDrawElementsBaseVertex(
+              GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+              (void*)(sizeof(unsigned int) * command.firstIndex),
+              command.baseVertex);
+        }
+      }
+    }
+    if (indexBuffer != 0)
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  }
+
+  // Copy the start of a GPU-written buffer into _data, blocking until the
+  // writes are done
+  static void readBuffer(GLuint _buffer, void* _data, size_t _bytes) {
+    if (_bytes == 0)
+      return;
+    if (GLState::hasDirectStateAccess()) {
+      glGetNamedBufferSubData(_buffer, 0, _bytes, _data);
+      return;
     }
-    glBindVertexArray(0);
+    glBindBuffer(GL_COPY_READ_BUFFER, _buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, _bytes, _data);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
   }
 };
-Scene::Name2Scene Scene::allScene;
+Scene::Registry Scene::allScene;
 Scene Scene::error;
+bool Scene::parallelImport = true;
+SkinningMode Scene::skinningMode = SKINNING_LINEAR;
 }  // namespace SkeletalMesh
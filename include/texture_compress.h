@@ -0,0 +1,392 @@
+// Block Compression (BC1/BC3) Encoder & DDS Container
+//
+// Shared by the offline TextureCompressor tool, which writes the files, and
+// by TextureImage::Texture, which reads them. Files are stored top row first
+// as DDS requires, so they open the right way up in other tools; the reader
+// flips the blocks with flipLevel() into GL's bottom-up order.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace TextureCompress {
+enum Format { FORMAT_BC1 = 1, FORMAT_BC3 = 3 };
+
+// One mip level of RGBA8 pixels or of compressed blocks
+struct Level {
+  int width;
+  int height;
+  std::vector<unsigned char> data;
+  Level() : width(0), height(0) {}
+};
+
+inline int blockBytes(Format _format) {
+  return _format == FORMAT_BC1 ? 8 : 16;
+}
+
+inline size_t compressedSize(Format _format, int _width, int _height) {
+  size_t bx = std::max(1, (_width + 3) / 4);
+  size_t by = std::max(1, (_height + 3) / 4);
+  return bx * by * blockBytes(_format);
+}
+
+// 2x2 box filter of an RGBA8 level, odd edges are clamped
+inline Level downsample(const Level& _src) {
+  Level dst;
+  dst.width = _src.width > 1 ? _src.width / 2 : 1;
+  dst.height = _src.height > 1 ? _src.height / 2 : 1;
+  dst.data.resize(size_t(dst.width) * dst.height * 4);
+  const unsigned char* src = _src.data.data();
+  int w = _src.width, h = _src.height;
+  for (int y = 0; y < dst.height; y++) {
+    int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+    for (int x = 0; x < dst.width; x++) {
+      int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+      for (int c = 0; c < 4; c++) {
+        unsigned sum = src[(size_t(y0) * w + x0) * 4 + c] +
+                       src[(size_t(y0) * w + x1) * 4 + c] +
+                       src[(size_t(y1) * w + x0) * 4 + c] +
+                       src[(size_t(y1) * w + x1) * 4 + c];
+        dst.data[(size_t(y) * dst.width + x) * 4 + c] =
+            (unsigned char)((sum + 2) / 4);
+      }
+    }
+  }
+  return dst;
+}
+
+// Full chain from _base down to 1x1, _base included
+inline std::vector<Level> buildMipChain(const Level& _base) {
+  std::vector<Level> chain(1, _base);
+  while (chain.back().width > 1 || chain.back().height > 1)
+    chain.push_back(downsample(chain.back()));
+  return chain;
+}
+
+inline bool hasAlpha(const Level& _level) {
+  for (size_t i = 3; i < _level.data.size(); i += 4)
+    if (_level.data[i] != 255)
+      return true;
+  return false;
+}
+
+inline uint16_t packRGB565(const float _c[3]) {
+  int r = (int)std::lround(std::clamp(_c[0], 0.0f, 255.0f) * 31.0f / 255.0f);
+  int g = (int)std::lround(std::clamp(_c[1], 0.0f, 255.0f) * 63.0f / 255.0f);
+  int b = (int)std::lround(std::clamp(_c[2], 0.0f, 255.0f) * 31.0f / 255.0f);
+  return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+inline void unpackRGB565(uint16_t _c, float _out[3]) {
+  int r = (_c >> 11) & 31, g = (_c >> 5) & 63, b = _c & 31;
+  _out[0] = float((r << 3) | (r >> 2));
+  _out[1] = float((g << 2) | (g >> 4));
+  _out[2] = float((b << 3) | (b >> 2));
+}
+
+// Endpoints along the principal axis of the block colors, always in the
+// four-color mode so the same block works for BC1 and for BC3's color part
+inline void encodeColorBlock(const unsigned char _rgba[64],
+                             unsigned char _out[8]) {
+  float mean[3] = {0, 0, 0};
+  for (int i = 0; i < 16; i++)
+    for (int c = 0; c < 3; c++)
+      mean[c] += _rgba[i * 4 + c] / 16.0f;
+
+  float cov[6] = {0, 0, 0, 0, 0, 0};
+  for (int i = 0; i < 16; i++) {
+    float d[3] = {_rgba[i * 4] - mean[0], _rgba[i * 4 + 1] - mean[1],
+                  _rgba[i * 4 + 2] - mean[2]};
+    cov[0] += d[0] * d[0];
+    cov[1] += d[0] * d[1];
+    cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1];
+    cov[4] += d[1] * d[2];
+    cov[5] += d[2] * d[2];
+  }
+  float axis[3] = {1, 1, 1};
+  for (int iter = 0; iter < 8; iter++) {
+    float next[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                     cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                     cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+    float len = std::sqrt(next[0] * next[0] + next[1] * next[1] +
+                          next[2] * next[2]);
+    if (len < 1e-6f)
+      break;
+    for (int c = 0; c < 3; c++)
+      axis[c] = next[c] / len;
+  }
+
+  float minProj = 1e30f, maxProj = -1e30f;
+  for (int i = 0; i < 16; i++) {
+    float proj = 0;
+    for (int c = 0; c < 3; c++)
+      proj += (_rgba[i * 4 + c] - mean[c]) * axis[c];
+    minProj = std::min(minProj, proj);
+    maxProj = std::max(maxProj, proj);
+  }
+  float hi[3], lo[3];
+  for (int c = 0; c < 3; c++) {
+    hi[c] = mean[c] + axis[c] * maxProj;
+    lo[c] = mean[c] + axis[c] * minProj;
+  }
+
+  uint16_t c0 = packRGB565(hi), c1 = packRGB565(lo);
+  if (c0 < c1)
+    std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    float palette[4][3];
+    unpackRGB565(c0, palette[0]);
+    unpackRGB565(c1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3.0f;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3.0f;
+    }
+    for (int i = 0; i < 16; i++) {
+      int best = 0;
+      float bestDist = 1e30f;
+      for (int p = 0; p < 4; p++) {
+        float dist = 0;
+        for (int c = 0; c < 3; c++) {
+          float d = _rgba[i * 4 + c] - palette[p][c];
+          dist += d * d;
+        }
+        if (dist < bestDist) {
+          bestDist = dist;
+          best = p;
+        }
+      }
+      indices |= uint32_t(best) << (2 * i);
+    }
+  }
+  memcpy(_out, &c0, 2);
+  memcpy(_out + 2, &c1, 2);
+  memcpy(_out + 4, &indices, 4);
+}
+
+// BC3 alpha block in the eight-value interpolation mode
+inline void encodeAlphaBlock(const unsigned char _rgba[64],
+                             unsigned char _out[8]) {
+  int a0 = 0, a1 = 255;
+  for (int i = 0; i < 16; i++) {
+    a0 = std::max<int>(a0, _rgba[i * 4 + 3]);
+    a1 = std::min<int>(a1, _rgba[i * 4 + 3]);
+  }
+  _out[0] = (unsigned char)a0;
+  _out[1] = (unsigned char)a1;
+  uint64_t indices = 0;
+  if (a0 != a1) {
+    int palette[8] = {a0, a1};
+    for (int p = 1; p < 7; p++)
+      palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+    for (int i = 0; i < 16; i++) {
+      int a = _rgba[i * 4 + 3], best = 0;
+      for (int p = 1; p < 8; p++)
+        if (std::abs(palette[p] - a) < std::abs(palette[best] - a))
+          best = p;
+      indices |= uint64_t(best) << (3 * i);
+    }
+  }
+  for (int i = 0; i < 6; i++)
+    _out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+inline Level compressLevel(const Level& _src, Format _format) {
+  Level dst;
+  dst.width = _src.width;
+  dst.height = _src.height;
+  dst.data.resize(compressedSize(_format, _src.width, _src.height));
+  int bx = std::max(1, (_src.width + 3) / 4);
+  int by = std::max(1, (_src.height + 3) / 4);
+  unsigned char* out = dst.data.data();
+  for (int y = 0; y < by; y++) {
+    for (int x = 0; x < bx; x++) {
+      unsigned char block[64];
+      for (int j = 0; j < 4; j++) {
+        int sy = std::min(y * 4 + j, _src.height - 1);
+        for (int i = 0; i < 4; i++) {
+          int sx = std::min(x * 4 + i, _src.width - 1);
+          memcpy(block + (j * 4 + i) * 4,
+                 &_src.data[(size_t(sy) * _src.width + sx) * 4], 4);
+        }
+      }
+      if (_format == FORMAT_BC3) {
+        encodeAlphaBlock(block, out);
+        out += 8;
+      }
+      encodeColorBlock(block, out);
+      out += 8;
+    }
+  }
+  return dst;
+}
+
+// Reverse the first _rows pixel rows of one block in place, 4 for a full
+// block. The color indices take a byte per row, BC3 alpha 12 bits.
+inline void flipBlock(unsigned char* _block, Format _format, int _rows) {
+  if (_format == FORMAT_BC3) {
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; i++)
+      indices |= uint64_t(_block[2 + i]) << (8 * i);
+    uint64_t flipped = indices;
+    for (int r = 0; r < _rows; r++) {
+      uint64_t row = (indices >> (12 * r)) & 0xFFF;
+      flipped &= ~(uint64_t(0xFFF) << (12 * (_rows - 1 - r)));
+      flipped |= row << (12 * (_rows - 1 - r));
+    }
+    for (int i = 0; i < 6; i++)
+      _block[2 + i] = (unsigned char)(flipped >> (8 * i));
+    _block += 8;
+  }
+  std::reverse(_block + 4, _block + 4 + _rows);
+}
+
+// Whether flipLevel() is exact for a level of height _height: the padding
+// rows of a partial last block row would otherwise end up at the top
+inline bool flippable(int _height) {
+  return _height < 4 || _height % 4 == 0;
+}
+
+// Flip a compressed level upside down by reversing the block rows and the
+// rows inside each block, for heights that are flippable()
+inline void flipLevel(Level& _level, Format _format) {
+  int bx = std::max(1, (_level.width + 3) / 4);
+  int by = std::max(1, (_level.height + 3) / 4);
+  size_t rowBytes = size_t(bx) * blockBytes(_format);
+  if (_level.data.size() < rowBytes * by)
+    return;
+  unsigned char* data = _level.data.data();
+  for (int y = 0; y < by / 2; y++)
+    std::swap_ranges(data + rowBytes * y, data + rowBytes * (y + 1),
+                     data + rowBytes * (by - 1 - y));
+  int rows = std::min(_level.height, 4);
+  for (size_t offset = 0; offset < rowBytes * by;
+       offset += blockBytes(_format))
+    flipBlock(data + offset, _format, rows);
+}
+
+#pragma pack(push, 1)
+struct DDSPixelFormat {
+  uint32_t size;
+  uint32_t flags;
+  uint32_t fourCC;
+  uint32_t rgbBitCount;
+  uint32_t rBitMask, gBitMask, bBitMask, aBitMask;
+};
+
+struct DDSHeader {
+  uint32_t size;
+  uint32_t flags;
+  uint32_t height;
+  uint32_t width;
+  uint32_t pitchOrLinearSize;
+  uint32_t depth;
+  uint32_t mipMapCount;
+  uint32_t reserved1[11];
+  DDSPixelFormat ddspf;
+  uint32_t caps, caps2, caps3, caps4;
+  uint32_t reserved2;
+};
+#pragma pack(pop)
+
+const uint32_t DDS_MAGIC = 0x20534444;  // "DDS "
+const uint32_t DDS_FOURCC_DXT1 = 0x31545844;
+const uint32_t DDS_FOURCC_DXT5 = 0x35545844;
+
+inline bool writeDDS(const std::string& _filename,
+                     Format _format,
+                     const std::vector<Level>& _levels) {
+  if (_levels.empty())
+    return false;
+  DDSHeader header;
+  memset(&header, 0, sizeof(header));
+  header.size = sizeof(DDSHeader);
+  // CAPS | HEIGHT | WIDTH | PIXELFORMAT | MIPMAPCOUNT | LINEARSIZE
+  header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+  header.height = _levels[0].height;
+  header.width = _levels[0].width;
+  header.pitchOrLinearSize = (uint32_t)_levels[0].data.size();
+  header.mipMapCount = (uint32_t)_levels.size();
+  header.ddspf.size = sizeof(DDSPixelFormat);
+  header.ddspf.flags = 0x4;  // FOURCC
+  header.ddspf.fourCC =
+      _format == FORMAT_BC1 ? DDS_FOURCC_DXT1 : DDS_FOURCC_DXT5;
+  header.caps = 0x1000 | 0x400000 | 0x8;  // TEXTURE | MIPMAP | COMPLEX
+
+  std::ofstream out(_filename, std::ios::binary | std::ios::trunc);
+  if (!out)
+    return false;
+  out.write((const char*)&DDS_MAGIC, sizeof(DDS_MAGIC));
+  out.write((const char*)&header, sizeof(header));
+  for (size_t i = 0; i < _levels.size(); i++)
+    out.write((const char*)_levels[i].data.data(), _levels[i].data.size());
+  return (bool)out;
+}
+
+inline bool readDDS(const std::string& _filename,
+                    Format& _format,
+                    std::vector<Level>& _levels) {
+  _levels.clear();
+  std::ifstream in(_filename, std::ios::binary);
+  if (!in)
+    return false;
+  uint32_t magic = 0;
+  DDSHeader header;
+  if (!in.read((char*)&magic, sizeof(magic)) || magic != DDS_MAGIC)
+    return false;
+  if (!in.read((char*)&header, sizeof(header)) ||
+      header.size != sizeof(DDSHeader))
+    return false;
+  if (header.ddspf.fourCC == DDS_FOURCC_DXT1)
+    _format = FORMAT_BC1;
+  else if (header.ddspf.fourCC == DDS_FOURCC_DXT5)
+    _format = FORMAT_BC3;
+  else
+    return false;
+
+  // Check the header against the file length before allocating anything,
+  // a corrupt size must not turn into a huge allocation
+  if (header.width == 0 || header.height == 0 || header.width > 65536 ||
+      header.height > 65536 || header.mipMapCount > 32)
+    return false;
+  std::streamoff dataStart = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streamoff dataBytes = in.tellg() - dataStart;
+  in.seekg(dataStart);
+  int w = header.width, h = header.height;
+  uint32_t levelNum = std::max<uint32_t>(1, header.mipMapCount);
+  size_t expected = 0;
+  for (uint32_t i = 0; i < levelNum; i++) {
+    expected += compressedSize(_format, w, h);
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+  if (dataBytes < 0 || (size_t)dataBytes < expected)
+    return false;
+
+  w = header.width;
+  h = header.height;
+  for (uint32_t i = 0; i < levelNum; i++) {
+    Level level;
+    level.width = w;
+    level.height = h;
+    level.data.resize(compressedSize(_format, w, h));
+    if (!in.read((char*)level.data.data(), level.data.size())) {
+      _levels.clear();
+      return false;
+    }
+    _levels.push_back(std::move(level));
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+  return true;
+}
+}  // namespace TextureCompress
@@ -4,25 +4,86 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 
 #include <vector>
 #include <string>
 #include <map>
+#include <utility>
 
 #include "gl_env.h"
+#include "gl_state.h"
+#include "resource_manager.h"
+#include "texture_compress.h"
+#include "thread_pool.h"
+
+// Like the static members below, the implementation lives in this header,
+// which is included by a single translation unit
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
 
 #include <FreeImage.h>
 #pragma comment(lib, "FreeImage.lib")
 
 namespace TextureImage
 {
+	// Levels of a complete chain down to 1x1
+	inline int fullMipCount(int _width, int _height)
+	{
+		int levels = 1;
+		while (_width > 1 || _height > 1)
+		{
+			_width = _width > 1 ? _width / 2 : 1;
+			_height = _height > 1 ? _height / 2 : 1;
+			levels++;
+		}
+		return levels;
+	}
+
+	// Pixels decoded on the CPU, waiting to be uploaded by the GL thread.
+	// mipmaps holds levels 1..n when they were built on the CPU, otherwise
+	// the chain is generated by GL after upload.
+	struct DecodedImage
+	{
+		int width;
+		int height;
+		GLenum format;
+		GLenum type;
+		std::vector<unsigned char> pixels;
+		std::vector<std::vector<unsigned char>> mipmaps;
+		// format is then a compressed internal format and pixels holds blocks
+		bool compressed;
+
+		DecodedImage()
+			: width(0)
+			, height(0)
+			, format(GL_RGBA)
+			, type(GL_UNSIGNED_BYTE)
+			, pixels()
+			, mipmaps()
+			, compressed(false)
+		{}
+		bool valid() const { return width > 0 && height > 0 && !pixels.empty(); }
+		bool isRGBA8() const { return !compressed && format == GL_RGBA && type == GL_UNSIGNED_BYTE; }
+	};
+
 	class Texture
 	{
 	public:
-		typedef std::map<std::string, Texture *> Name2Texture;
-		static Name2Texture allTexture;
+		typedef Resource::Handle Handle;
+		typedef Resource::Registry<Texture> Registry;
+		static Registry allTexture;
 		static Texture error;
+		// Directory of decoded, mipmapped RGBA8 images, empty to disable
+		static std::string cacheDirectory;
+		// Use a .dds produced by TextureCompressor in place of the source
+		// image when one exists, needs EXT_texture_compression_s3tc
+		static bool preferCompressed;
 
 	private:
 		bool available;
@@ -31,6 +92,9 @@ namespace TextureImage
 		int width;
 		int height;
 		GLuint tex;
+		size_t bytes;
+
+		friend class Resource::Registry<Texture>;
 
 		// Forbid calling any constructor outside
 		Texture(const Texture & _copy)
@@ -43,6 +107,7 @@ namespace TextureImage
 			, width(0)
 			, height(0)
 			, tex(0)
+			, bytes(0)
 		{}
 		virtual ~Texture() { clear(); }
 
@@ -52,18 +117,21 @@ namespace TextureImage
 			available = false;
 			name = std::string();
 			filename = std::string();
+			GLState::Cache::current().forgetTexture(tex);
 			glDeleteTextures(1, &tex);
 			tex = 0;
+			bytes = 0;
 		}
 
 		static std::string testAllSuffix(std::string no_suffix_name)
 		{
-			const int support_suffix_num = 4;
+			const int support_suffix_num = 5;
 			const std::string support_suffix[support_suffix_num] = {
 				".bmp",
 				".jpg",
 				".png",
-				".tga"
+				".tga",
+				".dds"
 			};
 
 			for (int i = 0; i < support_suffix_num; i++)
@@ -79,36 +147,104 @@ namespace TextureImage
 			return std::string();
 		}
 
-		static Texture & loadTexture(std::string _name, std::string _filename = std::string())
+		static void setCacheDirectory(std::string _directory)
 		{
-			GLenum gl_error_code = GL_NO_ERROR;
-			if ((gl_error_code = glGetError()) != GL_NO_ERROR)
+			if (!_directory.empty())
 			{
-				const GLubyte * errString = gluErrorString(gl_error_code);
-				std::cout << "ERROR before loadTexture():" << std::endl;
-				std::cout << errString << std::endl;
+				std::error_code ec;
+				std::filesystem::create_directories(_directory, ec);
+				if (_directory.back() != '/' && _directory.back() != '\\')
+					_directory += '/';
 			}
-			std::cout << _name <<"<>"<<_filename << std::endl;
-			if (_filename.empty() || _filename == "")
+			cacheDirectory = _directory;
+		}
+
+		// Decode a file into CPU memory without touching GL, safe to call from
+		// loader threads. stb_image handles the common formats, FreeImage the
+		// rest, and .dds files are read as precompressed blocks.
+		static bool decodeImage(const std::string & _filename, DecodedImage & _image)
+		{
+			std::string ddsname = compressedFilename(_filename);
+			if (ddsname == _filename)
+				return decodeDDS(_filename, _image);
+			if (preferCompressed && !olderThan(ddsname, _filename)
+				&& decodeDDS(ddsname, _image))
+				return true;
+
+			bool useCache = !cacheDirectory.empty();
+			if (useCache && readCache(_filename, _image))
+				return true;
+			if (!decodeStb(_filename, _image) && !decodeFreeImage(_filename, _image))
+				return false;
+			if (useCache && _image.isRGBA8())
 			{
-				_filename = testAllSuffix(_name);
-				if (_filename.empty()) return error;
-			}
-			FILE * fi = fopen(_filename.c_str(), "r");
-			if (fi == NULL) return error;
-			fclose(fi);
-
-			std::pair<Name2Texture::iterator, bool> insertion =
-				allTexture.insert(Name2Texture::value_type(_name, new Texture()));
-			Texture & target = *(insertion.first->second);
-			if (!insertion.second)
-				if (target.filename == _filename && target.available)
-					return target;
-				else
-					target.clear();
+				buildMipmaps(_image);
+				writeCache(_filename, _image);
+			}
+			return true;
+		}
+
+		// Decode several files concurrently, _images[i] stays invalid when
+		// _filenames[i] is empty or cannot be read
+		static void decodeImages(const std::vector<std::string> & _filenames,
+			std::vector<DecodedImage> & _images)
+		{
+			_images.clear();
+			_images.resize(_filenames.size());
+			Threading::ThreadPool::shared().parallelFor(_filenames.size(),
+				[&](size_t i)
+				{
+					if (!_filenames[i].empty())
+						decodeImage(_filenames[i], _images[i]);
+				});
+		}
 
-			target.name = _name;
-			target.filename = _filename;
+		// Load a batch of textures, decoding them in parallel before the
+		// uploads. Entries are (name, filename) pairs as for loadTexture(),
+		// each handle holds a reference, null ones mark failures.
+		static std::vector<Handle> loadTextures(
+			const std::vector<std::pair<std::string, std::string>> & _textures)
+		{
+			std::vector<std::string> filenames(_textures.size());
+			for (size_t i = 0; i < _textures.size(); i++)
+			{
+				filenames[i] = _textures[i].second.empty()
+					? testAllSuffix(_textures[i].first)
+					: _textures[i].second;
+			}
+			std::vector<DecodedImage> images;
+			decodeImages(filenames, images);
+
+			std::vector<Handle> result(_textures.size());
+			for (size_t i = 0; i < _textures.size(); i++)
+				result[i] = loadTexture(_textures[i].first, filenames[i], &images[i]);
+			return result;
+		}
+
+	private:
+		static bool decodeStb(const std::string & _filename, DecodedImage & _image)
+		{
+			_image = DecodedImage();
+
+			// GL expects the first row at the bottom, flip while decoding
+			stbi_set_flip_vertically_on_load_thread(1);
+			int width = 0, height = 0, channels = 0;
+			stbi_uc * bits = stbi_load(_filename.c_str(), &width, &height, &channels, 4);
+			if (bits == NULL)
+				return false;
+
+			_image.width = width;
+			_image.height = height;
+			_image.format = GL_RGBA;
+			_image.type = GL_UNSIGNED_BYTE;
+			_image.pixels.assign(bits, bits + size_t(width) * height * 4);
+			stbi_image_free(bits);
+			return true;
+		}
+
+		static bool decodeFreeImage(const std::string & _filename, DecodedImage & _image)
+		{
+			_image = DecodedImage();
 
 			FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
 			FIBITMAP *dib(0);
@@ -118,26 +254,25 @@ namespace TextureImage
 			if (fif == FIF_UNKNOWN)
 				fif = FreeImage_GetFIFFromFilename(_filename.c_str());
 			if (fif == FIF_UNKNOWN)
-				return error;
+				return false;
 
 			if (FreeImage_FIFSupportsReading(fif))
 				dib = FreeImage_Load(fif, _filename.c_str());
 			if (!dib)
-				return error;
+				return false;
 
 			FreeImage_FlipVertical(dib);
 
 			bits = FreeImage_GetBits(dib);
-			target.width = FreeImage_GetWidth(dib);
-			target.height = FreeImage_GetHeight(dib);
-			if ((bits == 0) || (target.width == 0) || (target.height == 0))
+			int width = FreeImage_GetWidth(dib);
+			int height = FreeImage_GetHeight(dib);
+			if ((bits == 0) || (width == 0) || (height == 0))
 			{
 				FreeImage_Unload(dib);
-				return error;
+				return false;
 			}
 
 			GLenum image_color_format = GL_BGR;
-			GLenum image_channel_type = GL_UNSIGNED_BYTE;
 			FREE_IMAGE_TYPE image_type = FreeImage_GetImageType(dib);
 			FREE_IMAGE_COLOR_TYPE color_type = FreeImage_GetColorType(dib);
 			unsigned int pixel_bpp = FreeImage_GetBPP(dib);
@@ -145,7 +280,7 @@ namespace TextureImage
 			if (image_type != FIT_BITMAP)
 			{
 				FreeImage_Unload(dib);
-				return error;
+				return false;
 			}
 			switch (color_type)
 			{
@@ -153,7 +288,7 @@ namespace TextureImage
 				if (pixel_bpp != 24)
 				{
 					FreeImage_Unload(dib);
-					return error;
+					return false;
 				}
 				break;
 			case FIC_RGBALPHA:
@@ -161,58 +296,621 @@ namespace TextureImage
 				if (pixel_bpp != 32)
 				{
 					FreeImage_Unload(dib);
-					return error;
+					return false;
 				}
 				break;
 			default:
-				return error;
+				FreeImage_Unload(dib);
+				return false;
 			}
 
-			glGenTextures(1, &target.tex);
-			glBindTexture(GL_TEXTURE_2D, target.tex);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, target.width, target.height,
-				0, image_color_format, image_channel_type, bits);
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
+			// FreeImage rows are DWORD aligned, which matches the default
+			// GL_UNPACK_ALIGNMENT of 4
+			size_t byte_size = size_t(FreeImage_GetPitch(dib)) * height;
+			_image.width = width;
+			_image.height = height;
+			_image.format = image_color_format;
+			_image.type = GL_UNSIGNED_BYTE;
+			_image.pixels.assign(bits, bits + byte_size);
 
 			FreeImage_Unload(dib);
+			return true;
+		}
+
+		// 2x2 box filter down to 1x1, RGBA8 only
+		static void buildMipmaps(DecodedImage & _image)
+		{
+			TextureCompress::Level base;
+			base.width = _image.width;
+			base.height = _image.height;
+			base.data.swap(_image.pixels);
+			std::vector<TextureCompress::Level> chain = TextureCompress::buildMipChain(base);
+			_image.pixels.swap(chain[0].data);
+			_image.mipmaps.clear();
+			for (size_t i = 1; i < chain.size(); i++)
+				_image.mipmaps.push_back(std::move(chain[i].data));
+		}
 
+		// Offline-compressed sibling written by the TextureCompressor tool
+		static std::string compressedFilename(const std::string & _filename)
+		{
+			size_t dotpos = _filename.rfind('.');
+			size_t slashpos = _filename.find_last_of("/\\");
+			if (dotpos == std::string::npos || (slashpos != std::string::npos && dotpos < slashpos))
+				return _filename + ".dds";
+			return _filename.substr(0, dotpos) + ".dds";
+		}
+
+		// Whether _filename was written before _source changed, a .dds
+		// compressed from an earlier version of the image is not used
+		static bool olderThan(const std::string & _filename, const std::string & _source)
+		{
+			std::error_code ec;
+			std::filesystem::file_time_type time =
+				std::filesystem::last_write_time(_filename, ec);
+			if (ec) return true;
+			std::filesystem::file_time_type sourceTime =
+				std::filesystem::last_write_time(_source, ec);
+			if (ec) return false;
+			return time < sourceTime;
+		}
+
+		static bool decodeDDS(const std::string & _filename, DecodedImage & _image)
+		{
+			_image = DecodedImage();
+			TextureCompress::Format format;
+			std::vector<TextureCompress::Level> levels;
+			if (!TextureCompress::readDDS(_filename, format, levels))
+				return false;
+			// Blocks can only be flipped exactly in whole rows of 4, decode the
+			// source instead of a sibling that has a level of another height
+			for (size_t i = 0; i < levels.size(); i++)
+				if (!TextureCompress::flippable(levels[i].height))
+					return false;
+
+			_image.width = levels[0].width;
+			_image.height = levels[0].height;
+			_image.format = format == TextureCompress::FORMAT_BC1
+				? GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+				: GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			_image.type = GL_NONE;
+			_image.compressed = true;
+			// DDS stores the top row first, GL expects the bottom one
+			for (size_t i = 0; i < levels.size(); i++)
+				TextureCompress::flipLevel(levels[i], format);
+			_image.pixels.swap(levels[0].data);
+			for (size_t i = 1; i < levels.size(); i++)
+				_image.mipmaps.push_back(std::move(levels[i].data));
+			return true;
+		}
+
+		struct CacheHeader
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint64_t sourceSize;
+			int64_t sourceTime;
+			int32_t width;
+			int32_t height;
+			uint32_t levelNum;
+		};
+		static const uint32_t CACHE_MAGIC = 0x41424752; // "RGBA", RGBA8 levels
+		static const uint32_t CACHE_VERSION = 1;
+
+		static std::string cacheFilename(const std::string & _filename)
+		{
+			std::string key = _filename;
+			for (size_t i = 0; i < key.size(); i++)
+				if (key[i] == '/' || key[i] == '\\' || key[i] == ':')
+					key[i] = '_';
+			return cacheDirectory + key + ".rgba8";
+		}
+
+		static bool sourceStamp(const std::string & _filename, CacheHeader & _header)
+		{
+			std::error_code ec;
+			uintmax_t size = std::filesystem::file_size(_filename, ec);
+			if (ec) return false;
+			std::filesystem::file_time_type time =
+				std::filesystem::last_write_time(_filename, ec);
+			if (ec) return false;
+			_header.sourceSize = size;
+			_header.sourceTime = (int64_t)time.time_since_epoch().count();
+			return true;
+		}
+
+		static bool readCache(const std::string & _filename, DecodedImage & _image)
+		{
+			CacheHeader expected = {}, header = {};
+			if (!sourceStamp(_filename, expected)) return false;
+			std::ifstream in(cacheFilename(_filename), std::ios::binary);
+			if (!in) return false;
+			if (!in.read((char *)&header, sizeof(header))) return false;
+			if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION
+				|| header.sourceSize != expected.sourceSize
+				|| header.sourceTime != expected.sourceTime
+				|| header.width <= 0 || header.height <= 0)
+				return false;
+
+			_image = DecodedImage();
+			_image.width = header.width;
+			_image.height = header.height;
+			int w = header.width, h = header.height;
+			for (uint32_t i = 0; i < header.levelNum; i++)
+			{
+				std::vector<unsigned char> level(size_t(w) * h * 4);
+				if (!in.read((char *)level.data(), level.size()))
+				{
+					_image = DecodedImage();
+					return false;
+				}
+				if (i == 0)
+					_image.pixels = std::move(level);
+				else
+					_image.mipmaps.push_back(std::move(level));
+				w = w > 1 ? w / 2 : 1;
+				h = h > 1 ? h / 2 : 1;
+			}
+			return _image.valid();
+		}
+
+		static void writeCache(const std::string & _filename, const DecodedImage & _image)
+		{
+			// Zeroed so the padding written to disk is too
+			CacheHeader header = {};
+			if (!sourceStamp(_filename, header)) return;
+			header.magic = CACHE_MAGIC;
+			header.version = CACHE_VERSION;
+			header.width = _image.width;
+			header.height = _image.height;
+			header.levelNum = (uint32_t)_image.mipmaps.size() + 1;
+
+			// Write under a temporary name so concurrent readers never see
+			// half a file
+			std::string cachename = cacheFilename(_filename);
+			std::string tmpname = cachename + ".tmp";
+			{
+				std::ofstream out(tmpname, std::ios::binary | std::ios::trunc);
+				if (!out) return;
+				out.write((const char *)&header, sizeof(header));
+				out.write((const char *)_image.pixels.data(), _image.pixels.size());
+				for (size_t i = 0; i < _image.mipmaps.size(); i++)
+					out.write((const char *)_image.mipmaps[i].data(), _image.mipmaps[i].size());
+				if (!out) return;
+			}
+			std::error_code ec;
+			std::filesystem::rename(tmpname, cachename, ec);
+		}
+
+	public:
+
+		// Upload decoded pixels through a pixel unpack buffer so the copy into
+		// the texture can be scheduled by the driver instead of blocking here
+		bool upload(const DecodedImage & _image)
+		{
+			if (!_image.valid()) return false;
+			if (_image.compressed && !GLEW_EXT_texture_compression_s3tc) return false;
+
+			width = _image.width;
+			height = _image.height;
+
+			// All levels go into one staging buffer, back to back
+			std::vector<const std::vector<unsigned char> *> levels;
+			levels.push_back(&_image.pixels);
+			for (size_t i = 0; i < _image.mipmaps.size(); i++)
+				levels.push_back(&_image.mipmaps[i]);
+			std::vector<size_t> offsets(levels.size());
+			size_t total_size = 0;
+			for (size_t i = 0; i < levels.size(); i++)
+			{
+				offsets[i] = total_size;
+				total_size += levels[i]->size();
+			}
+
+			GLuint pbo = 0;
+			glGenBuffers(1, &pbo);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, total_size, NULL, GL_STREAM_DRAW);
+			unsigned char * staging = (unsigned char *)glMapBufferRange(
+				GL_PIXEL_UNPACK_BUFFER, 0, total_size,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			bool use_pbo = staging != NULL;
+			if (use_pbo)
+			{
+				for (size_t i = 0; i < levels.size(); i++)
+					memcpy(staging + offsets[i], levels[i]->data(), levels[i]->size());
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			else
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+
+			// Immutable storage holds the whole chain up front, including the
+			// levels glGenerateTextureMipmap() fills in
+			bool dsa = GLState::hasDirectStateAccess();
+			bool generateMipmap = levels.size() == 1 && !_image.compressed;
+			GLint minFilter = generateMipmap || levels.size() > 1
+				? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+			if (dsa)
+			{
+				glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+				glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, minFilter);
+				glTextureStorage2D(tex,
+					generateMipmap ? fullMipCount(width, height) : (GLsizei)levels.size(),
+					_image.compressed ? _image.format : GL_RGBA8, width, height);
+			}
+			else
+			{
+				glGenTextures(1, &tex);
+				GLState::Cache::current().bindTexture(GL_TEXTURE_2D, tex);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+			}
+			int level_width = width, level_height = height;
+			for (size_t i = 0; i < levels.size(); i++)
+			{
+				const void * source = use_pbo
+					? (const void *)offsets[i]
+					: (const void *)levels[i]->data();
+				GLsizei level_size = (GLsizei)levels[i]->size();
+				if (dsa && _image.compressed)
+					glCompressedTextureSubImage2D(tex, (GLint)i, 0, 0,
+						level_width, level_height, _image.format, level_size, source);
+				else if (dsa)
+					glTextureSubImage2D(tex, (GLint)i, 0, 0, level_width, level_height,
+						_image.format, _image.type, source);
+				else if (_image.compressed)
+					glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)i, _image.format,
+						level_width, level_height, 0, level_size, source);
+				else
+					glTexImage2D(GL_TEXTURE_2D, (GLint)i, GL_RGBA, level_width, level_height,
+						0, _image.format, _image.type, source);
+				level_width = level_width > 1 ? level_width / 2 : 1;
+				level_height = level_height > 1 ? level_height / 2 : 1;
+			}
+			bytes = total_size;
+			if (!generateMipmap)
+			{
+				if (!dsa)
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+			}
+			else
+			{
+				if (dsa)
+					glGenerateTextureMipmap(tex);
+				else
+					glGenerateMipmap(GL_TEXTURE_2D);
+				bytes += total_size / 3;
+			}
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &pbo);
+			return true;
+		}
+
+		// _decoded may carry pixels already decoded by a loader thread, in
+		// which case the file is not read again. The returned handle holds a
+		// reference to give back with releaseTexture(), it is null on failure
+		// and nothing stays registered then.
+		static Handle loadTexture(std::string _name, std::string _filename = std::string(),
+			const DecodedImage * _decoded = NULL)
+		{
+			GLenum gl_error_code = GL_NO_ERROR;
 			if ((gl_error_code = glGetError()) != GL_NO_ERROR)
+			{
+				const GLubyte * errString = gluErrorString(gl_error_code);
+				std::cout << "ERROR before loadTexture():" << std::endl;
+				std::cout << errString << std::endl;
+			}
+			std::cout << _name <<"<>"<<_filename << std::endl;
+			if (_filename.empty() || _filename == "")
+			{
+				_filename = testAllSuffix(_name);
+				if (_filename.empty()) return Handle();
+			}
+
+			Handle existing = allTexture.find(_name);
+			Texture * loaded = allTexture.get(existing);
+			if (loaded != NULL && loaded->filename == _filename && loaded->available)
+			{
+				allTexture.acquire(existing);
+				return existing;
+			}
+
+			if (_decoded == NULL || !_decoded->valid())
+			{
+				FILE * fi = fopen(_filename.c_str(), "r");
+				if (fi == NULL) return Handle();
+				fclose(fi);
+			}
+
+			DecodedImage image;
+			if (_decoded == NULL || !_decoded->valid())
+			{
+				if (!decodeImage(_filename, image))
+					return Handle();
+				_decoded = &image;
+			}
+
+			Texture * target = new Texture();
+			target->name = _name;
+			target->filename = _filename;
+			bool uploaded = target->upload(*_decoded);
+			if (uploaded && (gl_error_code = glGetError()) != GL_NO_ERROR)
 			{
 				const GLubyte * errString = gluErrorString(gl_error_code);
 				std::cout << "ERROR in loadTexture():" << std::endl;
 				std::cout << errString << std::endl;
-				return error;
+				uploaded = false;
+			}
+			if (!uploaded)
+			{
+				delete target;
+				return Handle();
 			}
 
-			target.available = true;
-			return target;
+			// Replaces a texture of the same name from another file
+			target->available = true;
+			Handle handle = allTexture.insert(_name, target);
+			allTexture.setBytes(handle, target->bytes);
+			return handle;
 		}
 
+		static bool releaseTexture(Handle _handle)
+		{
+			return allTexture.release(_handle);
+		}
+
+		// Destroy a texture whatever its references, their handles go stale
 		static bool unloadTexture(std::string _name)
 		{
-			return allTexture.erase(_name) != 0;
+			return allTexture.destroy(allTexture.find(_name));
+		}
+
+		static Texture & getTexture(Handle _handle)
+		{
+			Texture * target = allTexture.get(_handle);
+			return target != NULL ? *target : error;
 		}
 
 		static Texture & getTexture(const std::string & _name)
 		{
-			Name2Texture::iterator find_result = allTexture.find(_name);
-			if (find_result == allTexture.end()) return error;
-			return *(find_result->second);
+			return getTexture(allTexture.find(_name));
 		}
 
+		size_t memorySize() const { return bytes; }
+
 		bool bind(GLenum textureChannel) const
 		{
 			if (!available) return false;
-			glActiveTexture(GL_TEXTURE0 + textureChannel);
-			glBindTexture(GL_TEXTURE_2D, tex);
+			GLState::Cache::current().bindTexture(textureChannel, GL_TEXTURE_2D, tex);
 			return true;
 		}
 	};
-	Texture::Name2Texture Texture::allTexture;
+
+	// Layers of equal size and format sharing one GL_TEXTURE_2D_ARRAY, so
+	// that meshes with different diffuse maps can be drawn without rebinding
+	class TextureArray
+	{
+	private:
+		int width;
+		int height;
+		int layers;
+		GLenum internalFormat;
+		GLuint tex;
+		size_t bytes;
+
+		// Forbid copying, the GL name is owned
+		TextureArray(const TextureArray & _copy) = delete;
+		TextureArray & operator=(const TextureArray & _copy) = delete;
+
+	public:
+		TextureArray()
+			: width(0)
+			, height(0)
+			, layers(0)
+			, internalFormat(GL_NONE)
+			, tex(0)
+			, bytes(0)
+		{}
+		~TextureArray() { clear(); }
+
+		void clear()
+		{
+			GLState::Cache::current().forgetTexture(tex);
+			glDeleteTextures(1, &tex);
+			tex = 0;
+			width = height = layers = 0;
+			internalFormat = GL_NONE;
+			bytes = 0;
+		}
+
+		// Images with the same key can share an array
+		static uint64_t groupKey(const DecodedImage & _image)
+		{
+			GLenum format = _image.compressed ? _image.format : GL_RGBA8;
+			return (uint64_t(format) << 32) | (uint64_t(_image.width & 0xffff) << 16)
+				| uint64_t(_image.height & 0xffff);
+		}
+
+		// All images must share the same groupKey(), layer i is _images[i]
+		bool create(const std::vector<const DecodedImage *> & _images)
+		{
+			clear();
+			if (_images.empty() || !_images[0]->valid()) return false;
+			const DecodedImage & first = *_images[0];
+			bool compressed = first.compressed;
+			if (compressed && !GLEW_EXT_texture_compression_s3tc) return false;
+
+			width = first.width;
+			height = first.height;
+			layers = (int)_images.size();
+			internalFormat = compressed ? first.format : GL_RGBA8;
+
+			// Compressed levels cannot be generated by GL, keep only the levels
+			// every layer provides
+			int levelNum = fullMipCount(width, height);
+			bool generateMipmap = false;
+			for (size_t i = 0; i < _images.size(); i++)
+			{
+				int provided = (int)_images[i]->mipmaps.size() + 1;
+				if (compressed)
+					levelNum = std::min(levelNum, provided);
+				else if (provided < levelNum)
+					generateMipmap = true;
+			}
+
+			// Success is read from glGetError() below, drop errors left by
+			// earlier calls so only this upload is judged
+			while (glGetError() != GL_NO_ERROR) {}
+
+			// Sample the mip chain whenever there is one
+			GLint minFilter = levelNum > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+
+			// With direct state access every level is allocated at once
+			bool dsa = GLState::hasDirectStateAccess();
+			if (dsa)
+			{
+				glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &tex);
+				glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, minFilter);
+				glTextureStorage3D(tex, levelNum, internalFormat, width, height, layers);
+			}
+			else
+			{
+				glGenTextures(1, &tex);
+				GLState::Cache::current().bindTexture(GL_TEXTURE_2D_ARRAY, tex);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minFilter);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelNum - 1);
+			}
+
+			// Allocation first: with a pixel unpack buffer bound, the NULL data
+			// of glTexImage3D() would be read as an offset into it
+			int level_width = width, level_height = height;
+			for (int level = 0; level < levelNum; level++)
+			{
+				if (compressed)
+				{
+					GLsizei level_size = (GLsizei)_images[0]->pixels.size();
+					if (level > 0) level_size = (GLsizei)_images[0]->mipmaps[level - 1].size();
+					if (!dsa)
+						glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat,
+							level_width, level_height, layers, 0, level_size * layers, NULL);
+					bytes += size_t(level_size) * layers;
+				}
+				else
+				{
+					if (!dsa)
+						glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat,
+							level_width, level_height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+					bytes += size_t(level_width) * level_height * 4 * layers;
+				}
+				level_width = level_width > 1 ? level_width / 2 : 1;
+				level_height = level_height > 1 ? level_height / 2 : 1;
+			}
+
+			// As in Texture::upload(), every level of every layer goes into one
+			// staging buffer so the copies are scheduled by the driver instead
+			// of blocking here
+			std::vector<const std::vector<unsigned char> *> sources(size_t(levelNum) * layers, NULL);
+			std::vector<size_t> offsets(sources.size(), 0);
+			size_t total_size = 0;
+			for (int level = 0; level < levelNum; level++)
+			{
+				for (int layer = 0; layer < layers; layer++)
+				{
+					const DecodedImage & image = *_images[layer];
+					if (level > (int)image.mipmaps.size()) continue;
+					size_t i = size_t(level) * layers + layer;
+					sources[i] = level == 0 ? &image.pixels : &image.mipmaps[level - 1];
+					offsets[i] = total_size;
+					total_size += sources[i]->size();
+				}
+			}
+			GLuint pbo = 0;
+			glGenBuffers(1, &pbo);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, total_size, NULL, GL_STREAM_DRAW);
+			unsigned char * staging = (unsigned char *)glMapBufferRange(
+				GL_PIXEL_UNPACK_BUFFER, 0, total_size,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			bool use_pbo = staging != NULL;
+			if (use_pbo)
+			{
+				for (size_t i = 0; i < sources.size(); i++)
+					if (sources[i] != NULL)
+						memcpy(staging + offsets[i], sources[i]->data(), sources[i]->size());
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			else
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+
+			level_width = width;
+			level_height = height;
+			for (int level = 0; level < levelNum; level++)
+			{
+				for (int layer = 0; layer < layers; layer++)
+				{
+					size_t i = size_t(level) * layers + layer;
+					if (sources[i] == NULL) continue;
+					const DecodedImage & image = *_images[layer];
+					const void * source = use_pbo
+						? (const void *)offsets[i]
+						: (const void *)sources[i]->data();
+					GLsizei level_size = (GLsizei)sources[i]->size();
+					if (dsa && compressed)
+						glCompressedTextureSubImage3D(tex, level, 0, 0, layer,
+							level_width, level_height, 1, internalFormat, level_size, source);
+					else if (dsa)
+						glTextureSubImage3D(tex, level, 0, 0, layer,
+							level_width, level_height, 1, image.format, image.type, source);
+					else if (compressed)
+						glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+							level_width, level_height, 1, internalFormat, level_size, source);
+					else
+						glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+							level_width, level_height, 1, image.format, image.type, source);
+				}
+				level_width = level_width > 1 ? level_width / 2 : 1;
+				level_height = level_height > 1 ? level_height / 2 : 1;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &pbo);
+			if (generateMipmap && dsa)
+				glGenerateTextureMipmap(tex);
+			else if (generateMipmap)
+				glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+			return glGetError() == GL_NO_ERROR;
+		}
+
+		int layerNum() const { return layers; }
+
+		// Storage of all levels and layers
+		size_t memorySize() const { return bytes; }
+
+		bool bind(GLenum textureChannel) const
+		{
+			if (tex == 0) return false;
+			GLState::Cache::current().bindTexture(textureChannel, GL_TEXTURE_2D_ARRAY, tex);
+			return true;
+		}
+	};
+
+	Texture::Registry Texture::allTexture;
 	Texture Texture::error;
+	std::string Texture::cacheDirectory;
+	bool Texture::preferCompressed = false;
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+// Fixed-size worker pool shared by the resource loaders
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace Threading {
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+
+ private:
+  std::vector<std::thread> workers;
+  std::queue<Task> tasks;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  bool stopping;
+
+  // Forbid copying, the workers hold a pointer to this pool
+  ThreadPool(const ThreadPool& _copy) = delete;
+  ThreadPool& operator=(const ThreadPool& _copy) = delete;
+
+  void workerLoop() {
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (stopping && tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+ public:
+  explicit ThreadPool(unsigned int _threadNum = 0) : stopping(false) {
+    if (_threadNum == 0) {
+      _threadNum = std::thread::hardware_concurrency();
+      if (_threadNum > 1)
+        _threadNum--;  // leave one core to the render thread
+      if (_threadNum == 0)
+        _threadNum = 1;
+    }
+    for (unsigned int i = 0; i < _threadNum; i++)
+      workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers)
+      worker.join();
+  }
+
+  unsigned int size() const { return (unsigned int)workers.size(); }
+
+  template <typename F>
+  std::future<typename std::invoke_result<F>::type> submit(F&& _func) {
+    typedef typename std::invoke_result<F>::type Result;
+    std::shared_ptr<std::packaged_task<Result()>> job =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<F>(_func));
+    std::future<Result> result = job->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push([job] { (*job)(); });
+    }
+    wakeup.notify_one();
+    return result;
+  }
+
+  // Run _func(i) for i in [0, _count) and return once all calls are done.
+  // The calling thread takes part in the work, so this may be used from
+  // inside a task without starving the pool.
+  template <typename F>
+  void parallelFor(size_t _count, F&& _func) {
+    if (_count == 0)
+      return;
+    struct Progress {
+      std::atomic<size_t> next;
+      std::atomic<size_t> done;
+      std::mutex mutex;
+      std::condition_variable finished;
+      Progress() : next(0), done(0) {}
+    };
+    std::shared_ptr<Progress> progress = std::make_shared<Progress>();
+    typename std::remove_reference<F>::type* func = &_func;
+    // Helpers may start after we returned, they only touch _func while
+    // an index is still unfinished
+    auto work = [progress, func, _count] {
+      for (;;) {
+        size_t index = progress->next.fetch_add(1);
+        if (index >= _count)
+          return;
+        (*func)(index);
+        if (progress->done.fetch_add(1) + 1 == _count) {
+          std::lock_guard<std::mutex> lock(progress->mutex);
+          progress->finished.notify_all();
+        }
+      }
+    };
+    size_t helperNum = std::min<size_t>(workers.size(), _count - 1);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < helperNum; i++)
+        tasks.push(work);
+    }
+    for (size_t i = 0; i < helperNum; i++)
+      wakeup.notify_one();
+    work();
+    std::unique_lock<std::mutex> lock(progress->mutex);
+    progress->finished.wait(
+        lock, [&progress, _count] { return progress->done == _count; });
+  }
+
+  static ThreadPool& shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+};
+}  // namespace Threading
@@ -1,11 +1,17 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-
 #include <skeletal_mesh.h>
-
+#include <meshlet_culling.h>
+#include <occlusion_culling.h>
+#include <render_graph.h>
+#include <gl_state.h>
+#include <ring_buffer.h>
+#include <clustered_lighting.h>
+#include <shadow_map.h>
+#include <gpu_timer.h>
+
+#include <filesystem>
 #include <string>
 #include <iostream>
 #include <random>
@@ -21,26 +27,192 @@
 constexpr int SCREEN_WIDTH = 800;
 constexpr int SCREEN_HEIGHT = 600;
 
+// 每帧变化的 uniform 放在 uniform block 里，数据写入环形缓冲区后按范围绑定。
+// 结构体与着色器中的 std140 布局一致，大小补齐到 16 字节
+constexpr GLuint FRAME_BLOCK_BINDING = 0;
+constexpr GLuint OBJECT_BLOCK_BINDING = 1;
+constexpr GLuint PASS_BLOCK_BINDING = 2;
+
+struct FrameUniforms {
+  glm::mat4 view;
+  glm::mat4 projection;
+};
+
+struct ObjectUniforms {
+  glm::mat4 model;
+  GLint invertedNormals;
+  GLint diffuseEnabled;
+  GLint padding[2];
+};
+
+struct SsaoUniforms {
+  glm::vec4 kernel[64];
+  float radius;
+  float bias;
+  float padding[2];
+};
+
+struct ShadowUniforms {
+  glm::mat4 faceMatrix[Shadow::PointShadowMap::FACE_NUM];
+  glm::vec4 lightPosFar;
+};
+
+struct LightingUniforms {
+  glm::uvec4 clusterGrid;   // 簇的数量 xyz，w 为光源数
+  glm::vec4 clusterDepth;   // 近平面、深度分层系数、tile 的像素宽高
+  glm::mat4 viewToWorld;
+  glm::vec4 shadowLight;    // 投射阴影的光源的世界坐标和远平面
+  float shininess;
+  float lightLinear;
+  float lightQuadratic;
+  float ambientStrength;
+  float diffuseStrength;
+  float specularStrength;
+  GLint lightingEnabled;
+  GLint ssaoEnabled;
+  GLint clusteredEnabled;
+  GLint shadowEnabled;
+  GLint ssaoBlurInline;
+  GLint padding[3];
+};
+
+// 版本号和 BONE_INFLUENCES 由各蒙皮变体在编译时补在前面
 const char* geometryVS =
-    "#version 410\n"
     "layout (location = 0) in vec3 aPos;\n"
     "layout (location = 1) in vec2 aTexCoords;\n"
     "layout (location = 2) in vec3 aNormal;\n"
     "layout (location = 3) in ivec4 aBoneIndex;\n"
     "layout (location = 4) in vec4 aBoneWeight;\n"
+    "layout (location = 5) in int aTexLayer;\n"
     "out vec3 FragPos;\n"
     "out vec2 TexCoords;\n"
     "out vec3 Normal;\n"
-    "uniform bool invertedNormals;\n"
-    "uniform mat4 model;\n"
-    "uniform mat4 view;\n"
-    "uniform mat4 projection;\n"
+    "flat out int TexLayer;\n"
+    "invariant gl_Position;\n"
+    "layout (std140) uniform FrameBlock {\n"
+    "    mat4 view;\n"
+    "    mat4 projection;\n"
+    "};\n"
+    "layout (std140) uniform ObjectBlock {\n"
+    "    mat4 model;\n"
+    "    bool invertedNormals;\n"
+    "    bool diffuseEnabled;\n"
+    "};\n"
+    "uniform samplerBuffer bonePalette;\n"
+    "#ifdef DUAL_QUATERNION_SKINNING\n"
+    "void blendBone(vec4 pivot, int bone, float weight, inout vec4 real, inout vec4 dual) {\n"
+    "    vec4 r = texelFetch(bonePalette, bone * 2);\n"
+    "    if (dot(r, pivot) < 0.0)\n"
+    "        weight = -weight;\n"
+    "    real += weight * r;\n"
+    "    dual += weight * texelFetch(bonePalette, bone * 2 + 1);\n"
+    "}\n"
+    "vec3 rotate(vec4 q, vec3 v) {\n"
+    "    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);\n"
+    "}\n"
+    "#else\n"
+    "mat4 boneMatrix(int bone) {\n"
+    "    return mat4(texelFetch(bonePalette, bone * 4), texelFetch(bonePalette, bone * 4 + 1),\n"
+    "                texelFetch(bonePalette, bone * 4 + 2), texelFetch(bonePalette, bone * 4 + 3));\n"
+    "}\n"
+    "#endif\n"
     "void main() {\n"
-    "    vec4 viewPos = view * model * vec4(aPos, 1.0);\n"
+    "    vec4 localPos = vec4(aPos, 1.0);\n"
+    "    vec3 localNormal = aNormal;\n"
+    "#if BONE_INFLUENCES > 0 && defined(DUAL_QUATERNION_SKINNING)\n"
+    "    vec4 pivot = texelFetch(bonePalette, aBoneIndex.x * 2);\n"
+    "    vec4 real = aBoneWeight.x * pivot;\n"
+    "    vec4 dual = aBoneWeight.x * texelFetch(bonePalette, aBoneIndex.x * 2 + 1);\n"
+    "    float rest = 1.0 - aBoneWeight.x;\n"
+    "#if BONE_INFLUENCES > 1\n"
+    "    blendBone(pivot, aBoneIndex.y, aBoneWeight.y, real, dual);\n"
+    "    rest -= aBoneWeight.y;\n"
+    "#endif\n"
+    "#if BONE_INFLUENCES > 2\n"
+    "    blendBone(pivot, aBoneIndex.z, aBoneWeight.z, real, dual);\n"
+    "    blendBone(pivot, aBoneIndex.w, aBoneWeight.w, real, dual);\n"
+    "    rest -= aBoneWeight.z + aBoneWeight.w;\n"
+    "#endif\n"
+    "    real.w += pivot.w < 0.0 ? -rest : rest;\n"
+    "    float len = length(real);\n"
+    "    real /= len;\n"
+    "    dual /= len;\n"
+    "    localPos.xyz = rotate(real, aPos) +\n"
+    "        2.0 * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));\n"
+    "    localNormal = rotate(real, aNormal);\n"
+    "#elif BONE_INFLUENCES > 0\n"
+    "    mat4 skin = aBoneWeight.x * boneMatrix(aBoneIndex.x);\n"
+    "    float rest = 1.0 - aBoneWeight.x;\n"
+    "#if BONE_INFLUENCES > 1\n"
+    "    skin += aBoneWeight.y * boneMatrix(aBoneIndex.y);\n"
+    "    rest -= aBoneWeight.y;\n"
+    "#endif\n"
+    "#if BONE_INFLUENCES > 2\n"
+    "    skin += aBoneWeight.z * boneMatrix(aBoneIndex.z) + aBoneWeight.w * boneMatrix(aBoneIndex.w);\n"
+    "    rest -= aBoneWeight.z + aBoneWeight.w;\n"
+    "#endif\n"
+    "    skin += rest * mat4(1.0);\n"
+    "    localPos = skin * localPos;\n"
+    "    localNormal = mat3(skin) * localNormal;\n"
+    "#endif\n"
+    "#ifdef SHADOW_PASS\n"
+    "    gl_Position = model * localPos;\n"
+    "#else\n"
+    "    vec4 viewPos = view * model * localPos;\n"
     "    FragPos = viewPos.xyz;\n"
     "    TexCoords = aTexCoords;\n"
-    "    Normal = transpose(inverse(mat3(view * model))) * (invertedNormals ? -aNormal : aNormal);\n"
+    "    TexLayer = aTexLayer;\n"
+    "    Normal = transpose(inverse(mat3(view * model))) * (invertedNormals ? -localNormal : localNormal);\n"
     "    gl_Position = projection * viewPos;\n"
+    "#endif\n"
+    "}\n";
+
+// 深度预渲染只写深度，蒙皮变体的 gl_Position 声明为 invariant，
+// 保证与 G-buffer pass 算出的深度完全相同，后者才能用 GL_EQUAL 测试
+const char* depthFS =
+    "#version 410\n"
+    "void main() {\n"
+    "}\n";
+
+// 点光源阴影：蒙皮变体定义 SHADOW_PASS 后只输出世界坐标，
+// 几何着色器每个调用负责立方体贴图的一个面，三角形不在该面视锥内时跳过
+const char* shadowGS =
+    "#version 410\n"
+    "layout (triangles, invocations = 6) in;\n"
+    "layout (triangle_strip, max_vertices = 3) out;\n"
+    "layout (std140) uniform PassBlock {\n"
+    "    mat4 faceMatrix[6];\n"
+    "    vec4 lightPosFar;\n"
+    "};\n"
+    "out vec3 WorldPos;\n"
+    "void main() {\n"
+    "    vec4 clip[3];\n"
+    "    for (int i = 0; i < 3; i++)\n"
+    "        clip[i] = faceMatrix[gl_InvocationID] * gl_in[i].gl_Position;\n"
+    "    for (int axis = 0; axis < 3; axis++) {\n"
+    "        if (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w)\n"
+    "            return;\n"
+    "        if (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w && clip[2][axis] < -clip[2].w)\n"
+    "            return;\n"
+    "    }\n"
+    "    for (int i = 0; i < 3; i++) {\n"
+    "        gl_Layer = gl_InvocationID;\n"
+    "        WorldPos = gl_in[i].gl_Position.xyz;\n"
+    "        gl_Position = clip[i];\n"
+    "        EmitVertex();\n"
+    "    }\n"
+    "    EndPrimitive();\n"
+    "}\n";
+
+const char* shadowFS =
+    "#version 410\n"
+    "layout (std140) uniform PassBlock {\n"
+    "    mat4 faceMatrix[6];\n"
+    "    vec4 lightPosFar;\n"
+    "};\n"
+    "in vec3 WorldPos;\n"
+    "void main() {\n"
+    "    gl_FragDepth = length(WorldPos - lightPosFar.xyz) / lightPosFar.w;\n"
     "}\n";
 
 const char* geometryFS =
@@ -48,13 +220,26 @@ const char* geometryFS =
     "in vec3 FragPos;\n"
     "in vec2 TexCoords;\n"
     "in vec3 Normal;\n"
-    "out vec3 gPosition;\n"
-    "out vec3 gNormal;\n"
-    "out vec3 gAlbedo;\n"
+    "flat in int TexLayer;\n"
+    "uniform sampler2DArray diffuseMap;\n"
+    "layout (std140) uniform ObjectBlock {\n"
+    "    mat4 model;\n"
+    "    bool invertedNormals;\n"
+    "    bool diffuseEnabled;\n"
+    "};\n"
+    "layout (location = 0) out vec2 gNormal;\n"
+    "layout (location = 1) out vec4 gAlbedo;\n"
+    "vec2 encodeNormal(vec3 n) {\n"
+    "    n /= abs(n.x) + abs(n.y) + abs(n.z);\n"
+    "    if (n.z < 0.0)\n"
+    "        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+    "    return n.xy * 0.5 + 0.5;\n"
+    "}\n"
     "void main() {\n"
-    "    gPosition = FragPos;\n"
-    "    gNormal = normalize(Normal);\n"
-    "    gAlbedo.rgb = vec3(TexCoords, 1.0);\n"
+    "    gNormal = encodeNormal(normalize(Normal));\n"
+    "    gAlbedo = vec4(TexCoords, 1.0, 1.0);\n"
+    "    if (diffuseEnabled && TexLayer >= 0)\n"
+    "        gAlbedo.rgb = texture(diffuseMap, vec3(TexCoords, float(TexLayer))).rgb;\n"
     "}\n";
 
 const char* ssaoVS =
@@ -67,43 +252,68 @@ const char* ssaoVS =
     "    gl_Position = vec4(aPos, 1.0);\n"
     "}\n";
 
-const char* ssaoFS =
+// 压缩的 G-buffer：观察空间位置由深度重建，法线为 RG16 八面体编码，
+// 漫反射颜色为 RGBA8，alpha 存材质的环境光遮蔽。
+// 读取 G-buffer 的着色器在编译时把这段补在前面
+const char* gBufferDecode =
     "#version 410\n"
-    "uniform sampler2D gPosition;\n"
+    "uniform sampler2D gDepth;\n"
     "uniform sampler2D gNormal;\n"
+    "layout (std140) uniform FrameBlock {\n"
+    "    mat4 view;\n"
+    "    mat4 projection;\n"
+    "};\n"
+    "vec3 decodeNormal(vec2 f) {\n"
+    "    f = f * 2.0 - 1.0;\n"
+    "    vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));\n"
+    "    float t = max(-n.z, 0.0);\n"
+    "    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);\n"
+    "    return normalize(n);\n"
+    "}\n"
+    // 对称透视投影下由深度求观察空间的 z，不需要逆矩阵
+    "float viewDepth(vec2 uv) {\n"
+    "    float ndcDepth = texture(gDepth, uv).r * 2.0 - 1.0;\n"
+    "    return -projection[3][2] / (ndcDepth + projection[2][2]);\n"
+    "}\n"
+    "vec3 viewPosition(vec2 uv) {\n"
+    "    float z = viewDepth(uv);\n"
+    "    vec2 ndc = uv * 2.0 - 1.0;\n"
+    "    return vec3(-z * ndc.x / projection[0][0], -z * ndc.y / projection[1][1], z);\n"
+    "}\n";
+
+const char* ssaoFS =
     "uniform sampler2D texNoise;\n"
-    "uniform vec3 kernel[64];\n"
-    "uniform mat4 projection;\n"
-    "uniform float radius;\n"
-    "uniform float bias;\n"
+    "layout (std140) uniform PassBlock {\n"
+    "    vec4 kernel[64];\n"
+    "    float radius;\n"
+    "    float bias;\n"
+    "};\n"
     "const vec2 noiseScale = vec2(800.0/4.0, 600.0/4.0);\n" 
     "in vec2 TexCoords;\n"
     "out float ssaoResult;\n"
-    "uniform bool ssaoEnabled;\n"
     "void main() {\n"
-    "    vec3 fragPos = texture(gPosition, TexCoords).xyz;\n"
-    "    vec3 normal = normalize(texture(gNormal, TexCoords).rgb);\n"
+    "    vec3 fragPos = viewPosition(TexCoords);\n"
+    "    vec3 normal = decodeNormal(texture(gNormal, TexCoords).rg);\n"
     "    vec3 randomVec = normalize(texture(texNoise, TexCoords * noiseScale).xyz);\n"
     "    vec3 tangent = normalize(randomVec - normal * dot(randomVec, normal));\n"
     "    vec3 bitangent = cross(normal, tangent);\n"
     "    mat3 TBN = mat3(tangent, bitangent, normal);\n"
     "    float occlusion = 0.0;\n"
     "    for (int i = 0; i < 64; i++) {\n"
-    "        vec3 samplePos = fragPos + TBN * kernel[i] * radius;\n"
+    "        vec3 samplePos = fragPos + TBN * kernel[i].xyz * radius;\n"
     "        vec4 screenPos = projection * vec4(samplePos, 1.0);\n"
     "        screenPos.xyz /= screenPos.w;\n"
     "        screenPos.xyz = screenPos.xyz * 0.5 + 0.5;\n"
-    "        float sampleDepth = texture(gPosition, screenPos.xy).z;\n"
+    "        float sampleDepth = viewDepth(screenPos.xy);\n"
     "        float rangeCheck = smoothstep(0.0, 1.0, radius / abs(fragPos.z - sampleDepth));\n"
     "        occlusion += (sampleDepth >= samplePos.z + bias ? 1.0 : 0.0) * rangeCheck;\n"
     "    }\n"
-    "    ssaoResult = ssaoEnabled ? 1.0 - occlusion / 64.0 : 1.0;\n"
+    "    ssaoResult = 1.0 - occlusion / 64.0;\n"
     "}\n";
 
 const char* ssaoBlurFS =
     "#version 410\n"
     "uniform sampler2D ssaoInput;\n"
-    "uniform bool ssaoBlurEnabled;\n"
     "in vec2 TexCoords;\n"
     "out float ssaoBlurResult;\n"
     "void main() {\n"
@@ -115,42 +325,115 @@ const char* ssaoBlurFS =
     "            result += texture(ssaoInput, TexCoords + offset).r;\n"
     "        }\n"
     "    }\n"
-    "    ssaoBlurResult = ssaoBlurEnabled ? result / (4.0 * 4.0) : texture(ssaoInput, TexCoords).r;\n"
+    "    ssaoBlurResult = result / (4.0 * 4.0);\n"
     "}\n";
 
+// 光源按簇分组：每个片元只遍历所在簇里的光源，
+// 关闭分簇时遍历全部光源用于对比
 const char* lightingFS =
-    "#version 410\n"
-    "uniform sampler2D gPosition;\n"
-    "uniform sampler2D gNormal;\n"
     "uniform sampler2D gAlbedo;\n"
     "uniform sampler2D ssao;\n"
-    "uniform vec3 lightPos;\n"
-    "uniform vec3 lightColor;\n"
-    "uniform float lightLinear;\n"
-    "uniform float lightQuadratic;\n"
-    "uniform float shininess;\n"
-    "uniform float ambientStrength;\n"
-    "uniform float diffuseStrength;\n"
-    "uniform float specularStrength;\n"
-    "uniform bool lightingEnabled;\n"
+    "uniform samplerBuffer lightData;\n"
+    "uniform usamplerBuffer clusterData;\n"
+    "uniform usamplerBuffer lightIndex;\n"
+    "uniform samplerCubeShadow shadowMap;\n"
+    "layout (std140) uniform PassBlock {\n"
+    "    uvec4 clusterGrid;\n"
+    "    vec4 clusterDepth;\n"
+    "    mat4 viewToWorld;\n"
+    "    vec4 shadowLight;\n"
+    "    float shininess;\n"
+    "    float lightLinear;\n"
+    "    float lightQuadratic;\n"
+    "    float ambientStrength;\n"
+    "    float diffuseStrength;\n"
+    "    float specularStrength;\n"
+    "    bool lightingEnabled;\n"
+    "    bool ssaoEnabled;\n"
+    "    bool clusteredEnabled;\n"
+    "    bool shadowEnabled;\n"
+    "    bool ssaoBlurInline;\n"
+    "};\n"
     "in vec2 TexCoords;\n"
     "out vec4 FragColor;\n"
-    "void main() {\n"
-    "    vec3 FragPos = texture(gPosition, TexCoords).rgb;\n"
-    "    vec3 Normal = texture(gNormal, TexCoords).rgb;\n"
-    "    vec3 Diffuse = texture(gAlbedo, TexCoords).rgb;\n"
-    "    float ssaoResult = texture(ssao, TexCoords).r;\n"
-    "    vec3 lightDir = normalize(lightPos - FragPos);\n"
+    "const vec3 pcfOffset[20] = vec3[](\n"
+    "    vec3(1, 1, 1), vec3(1, -1, 1), vec3(-1, -1, 1), vec3(-1, 1, 1),\n"
+    "    vec3(1, 1, -1), vec3(1, -1, -1), vec3(-1, -1, -1), vec3(-1, 1, -1),\n"
+    "    vec3(1, 1, 0), vec3(1, -1, 0), vec3(-1, -1, 0), vec3(-1, 1, 0),\n"
+    "    vec3(1, 0, 1), vec3(-1, 0, 1), vec3(1, 0, -1), vec3(-1, 0, -1),\n"
+    "    vec3(0, 1, 1), vec3(0, -1, 1), vec3(0, -1, -1), vec3(0, 1, -1));\n"
+    // 每次比较采样已经是 2x2 的双线性 PCF，再在周围取 20 个方向平均
+    "float pointShadow(vec3 FragPos) {\n"
+    "    vec3 toFrag = (viewToWorld * vec4(FragPos, 1.0)).xyz - shadowLight.xyz;\n"
+    "    float reference = (length(toFrag) - 0.05) / shadowLight.w;\n"
+    "    float diskRadius = 0.02 * (1.0 + length(FragPos) / shadowLight.w * 4.0);\n"
+    "    float lit = 0.0;\n"
+    "    for (int i = 0; i < 20; i++)\n"
+    "        lit += texture(shadowMap, vec4(toFrag + pcfOffset[i] * diskRadius, reference));\n"
+    "    return lit / 20.0;\n"
+    "}\n"
+    // 合并模糊时直接读未模糊的 SSAO 结果，4 次 textureGather 取 4x4 个像素平均，
+    // 与单独的模糊 pass 结果相同，省去一张贴图的写入和读取
+    "float ambientOcclusion() {\n"
+    "    if (!ssaoEnabled)\n"
+    "        return 1.0;\n"
+    "    if (!ssaoBlurInline)\n"
+    "        return texture(ssao, TexCoords).r;\n"
+    "    vec2 texelSize = 1.0 / vec2(textureSize(ssao, 0));\n"
+    "    float result = 0.0;\n"
+    "    for (int x = 0; x < 2; x++) {\n"
+    "        for (int y = 0; y < 2; y++) {\n"
+    "            vec2 offset = vec2(x * 2.0 - 1.5, y * 2.0 - 1.5) * texelSize;\n"
+    "            result += dot(textureGather(ssao, TexCoords + offset), vec4(1.0));\n"
+    "        }\n"
+    "    }\n"
+    "    return result / (4.0 * 4.0);\n"
+    "}\n"
+    "vec3 shadeLight(int light, vec3 FragPos, vec3 Normal, vec3 Diffuse) {\n"
+    "    vec4 posRadius = texelFetch(lightData, light * 2);\n"
+    "    vec4 colorShadow = texelFetch(lightData, light * 2 + 1);\n"
+    "    vec3 lightColor = colorShadow.rgb;\n"
+    "    float distance = length(posRadius.xyz - FragPos);\n"
+    "    if (distance >= posRadius.w)\n"
+    "        return vec3(0.0);\n"
+    "    vec3 lightDir = (posRadius.xyz - FragPos) / distance;\n"
     "    float diff = max(dot(Normal, lightDir), 0.0);\n"
     "    vec3 reflectDir = reflect(-lightDir, Normal);\n"
     "    vec3 viewDir = normalize(-FragPos);\n"
     "    float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);\n"
-    "    vec3 ambient = ssaoResult * Diffuse;\n"
+    "    float window = clamp(1.0 - pow(distance / posRadius.w, 4.0), 0.0, 1.0);\n"
+    "    float attenuation = window * window / (1.0 + lightLinear * distance + lightQuadratic * distance * distance);\n"
+    "    if (shadowEnabled && colorShadow.a >= 0.0)\n"
+    "        attenuation *= pointShadow(FragPos);\n"
     "    vec3 diffuse = diff * Diffuse * lightColor;\n"
-    "    float distance = length(lightPos- FragPos);\n"
-    "    float attenuation = 1.0 / (1.0 + lightLinear * distance + lightQuadratic * distance * distance);\n"
     "    vec3 specular = spec * lightColor;\n"
-    "    FragColor = vec4(ambient * ambientStrength + diffuse * diffuseStrength + specular * specularStrength, 1.0);\n"
+    "    return (diffuse * diffuseStrength + specular * specularStrength) * attenuation;\n"
+    "}\n"
+    "void main() {\n"
+    "    if (texture(gDepth, TexCoords).r == 1.0) {\n"
+    "        FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+    "        return;\n"
+    "    }\n"
+    "    vec3 FragPos = viewPosition(TexCoords);\n"
+    "    vec3 Normal = decodeNormal(texture(gNormal, TexCoords).rg);\n"
+    "    vec4 albedo = texture(gAlbedo, TexCoords);\n"
+    "    vec3 Diffuse = albedo.rgb;\n"
+    "    float ssaoResult = albedo.a * ambientOcclusion();\n"
+    "    vec3 ambient = ssaoResult * Diffuse;\n"
+    "    vec3 direct = vec3(0.0);\n"
+    "    if (clusteredEnabled) {\n"
+    "        ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy / clusterDepth.zw),\n"
+    "                              int(log(-FragPos.z / clusterDepth.x) * clusterDepth.y));\n"
+    "        cluster = clamp(cluster, ivec3(0), ivec3(clusterGrid.xyz) - 1);\n"
+    "        int index = (cluster.z * int(clusterGrid.y) + cluster.y) * int(clusterGrid.x) + cluster.x;\n"
+    "        uvec2 range = texelFetch(clusterData, index).rg;\n"
+    "        for (uint i = 0u; i < range.y; i++)\n"
+    "            direct += shadeLight(int(texelFetch(lightIndex, int(range.x + i)).r), FragPos, Normal, Diffuse);\n"
+    "    } else {\n"
+    "        for (int i = 0; i < int(clusterGrid.w); i++)\n"
+    "            direct += shadeLight(i, FragPos, Normal, Diffuse);\n"
+    "    }\n"
+    "    FragColor = vec4(ambient * ambientStrength + direct, 1.0);\n"
     "    if (!lightingEnabled) {\n"
     "        FragColor = vec4(ambient, 1.0);\n"
     "    }\n"
@@ -166,13 +449,17 @@ void mouseCallback(GLFWwindow* window, double xpos, double ypos);
 
 void doMovement(float timePeriod);
 
-unsigned createProgram(const char* VSSource, const char* FSSource);
+unsigned createProgram(const char* VSSource,
+                       const char* FSSource,
+                       const char* GSSource = NULL);
 void renderQuad();
 void renderCube();
 
 glm::vec3 lightPos = glm::vec3(0.0f, 0.0f, 3.0f);
 glm::vec3 lightDir = glm::vec3(0.0f, 0.0f, -1.0f);
 glm::vec3 lightColor = glm::vec3(1.0f, 1.0f, 1.0f);
+const float lightLinear = 0.09f;
+const float lightQuadratic = 0.032f;
 float shininess = 3.0f;
 
 float lastX = SCREEN_WIDTH * 0.5f;
@@ -188,8 +475,44 @@ float diffuseStrength = 1.0f;
 float specularStrength = 1.0f;
 
 int ssaoEnabled = true;
+int diffuseEnabled = false;
+int frustumCullingEnabled = true;
+int occlusionCullingEnabled = false;
+Culling::CullStats cullStats;
+Culling::OcclusionCuller occlusionCuller;
+int meshletCullingEnabled = false;
+int lodEnabled = true;
+float lodPixelError = 1.0f;
+unsigned int drawnTriangles = 0;
+SkeletalMesh::Scene::MemoryUsage sceneMemory = {0, 0, 0};
+Culling::MeshletCuller meshletCuller;
+int parallelImport = true;
+// 贴图解码缓存默认关闭，打开后从下一次导入起生效
+int textureCacheEnabled = false;
+int dualQuatSkinning = false;
+bool reloadRequested = false;
+SkeletalMesh::Scene::LoadTiming loadTiming = {0.0, 0.0, 0.0, 0};
 int ssaoBlurEnabled = true;
 int lightingEnabled = true;
+RenderGraph::GraphStats graphStats = {0, 0, 0, 0, 0};
+std::vector<RenderGraph::TargetInfo> graphTargets;
+int stateCacheEnabled = true;
+GLState::Stats stateStats = {0, 0};
+Streaming::RingBuffer uniformRing;
+Streaming::RingStats ringStats = {0, 0, 0};
+Lighting::ClusterGrid clusterGrid;
+Lighting::ClusterStats clusterStats = {0, 0, 0};
+int clusteredLightingEnabled = true;
+constexpr int EXTRA_LIGHT_MAX = 4096;
+int extraLightNum = 0;
+constexpr GLsizei SHADOW_SIZE = 1024;
+Shadow::PointShadowMap pointShadow;
+int shadowEnabled = true;
+int depthPrepassEnabled = false;
+int frontToBackEnabled = true;
+Profiling::GpuTimer geometryTimer;
+int ssaoBlurFused = false;
+Profiling::GpuTimer lightingTimer;
 
 glm::vec3 cameraPos = glm::vec3(0.0f, 0.0f, -1.0f);
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, 1.0f);
@@ -201,7 +524,85 @@ void draw_ui() {
   ImGui::SliderFloat("shininess", &shininess, 0.0f, 10.0f);
   ImGui::SliderInt("ssaoEnabled", &ssaoEnabled, 0, 1);
   ImGui::SliderInt("ssaoBlurEnabled", &ssaoBlurEnabled, 0, 1);
+  ImGui::SliderInt("ssaoBlurFused", &ssaoBlurFused, 0, 1);
   ImGui::SliderInt("lightingEnabled", &lightingEnabled, 0, 1);
+  ImGui::SliderInt("diffuseEnabled", &diffuseEnabled, 0, 1);
+  ImGui::SliderInt("frustumCullingEnabled", &frustumCullingEnabled, 0, 1);
+  ImGui::Text("meshes drawn %u, culled %u", cullStats.drawn, cullStats.culled);
+  if (occlusionCuller.available()) {
+    ImGui::SliderInt("occlusionCullingEnabled", &occlusionCullingEnabled, 0,
+                     1);
+    ImGui::Text("GPU culling: %u + %u of %u draws",
+                occlusionCuller.visibleCount(0),
+                occlusionCuller.visibleCount(1), occlusionCuller.totalCount());
+  }
+  ImGui::SliderInt("lodEnabled", &lodEnabled, 0, 1);
+  ImGui::SliderFloat("lodPixelError", &lodPixelError, 0.25f, 8.0f);
+  ImGui::Text("triangles in draw list %u", drawnTriangles);
+  ImGui::Text("scene memory: host %zu KiB, GPU %zu KiB (%zu KiB freed)",
+              sceneMemory.host / 1024, sceneMemory.gpu / 1024,
+              sceneMemory.imported / 1024);
+  if (meshletCuller.available()) {
+    ImGui::SliderInt("meshletCullingEnabled", &meshletCullingEnabled, 0, 1);
+    ImGui::Text("meshlets drawn %u of %u", meshletCuller.visibleCount(),
+                meshletCuller.totalCount());
+  }
+  ImGui::SliderInt("dualQuatSkinning", &dualQuatSkinning, 0, 1);
+  ImGui::SliderInt("parallelImport", &parallelImport, 0, 1);
+  ImGui::SliderInt("textureCacheEnabled", &textureCacheEnabled, 0, 1);
+  ImGui::Text("import: parse %.1f ms, assemble %.1f ms (%u threads), "
+              "upload %.1f ms",
+              loadTiming.parse, loadTiming.assemble, loadTiming.threads,
+              loadTiming.upload);
+  if (ImGui::Button("reload model"))
+    reloadRequested = true;
+  ImGui::Text("render graph: %u passes (%u culled), %u transient targets",
+              graphStats.passNum, graphStats.culledNum,
+              graphStats.transientNum);
+  ImGui::Text("transient memory %zu KiB (%zu KiB unshared)",
+              graphStats.pooledBytes / 1024, graphStats.unaliasedBytes / 1024);
+  for (size_t i = 0; i < graphTargets.size(); i++)
+    ImGui::Text("  %s %s %zu KiB", graphTargets[i].name.c_str(),
+                RenderGraph::formatName(graphTargets[i].format),
+                graphTargets[i].bytes / 1024);
+  if (pointShadow.available())
+    ImGui::Text("  shadowMap %s cube %zu KiB",
+                RenderGraph::formatName(pointShadow.getFormat()),
+                pointShadow.getBytes() / 1024);
+  ImGui::Text("direct state access: %s",
+              GLState::hasDirectStateAccess() ? "yes" : "no");
+  ImGui::SliderInt("stateCacheEnabled", &stateCacheEnabled, 0, 1);
+  ImGui::Text("GL binds issued %u, redundant %u", stateStats.issued,
+              stateStats.filtered);
+  ImGui::Text("uniform ring %zu of %zu KiB, waits %u (%s)",
+              ringStats.usedBytes / 1024, ringStats.frameBytes / 1024,
+              ringStats.waits,
+              Streaming::RingBuffer::isPersistent() ? "persistent"
+                                                    : "glBufferSubData");
+  ImGui::SliderInt("extraLightNum", &extraLightNum, 0, EXTRA_LIGHT_MAX);
+  ImGui::SliderInt("clusteredLightingEnabled", &clusteredLightingEnabled, 0, 1);
+  ImGui::Text("lights in view %u, cluster entries %u, max per cluster %u",
+              clusterStats.lightNum, clusterStats.entryNum,
+              clusterStats.maxPerCluster);
+  ImGui::SliderInt("depthPrepassEnabled", &depthPrepassEnabled, 0, 1);
+  ImGui::SliderInt("frontToBackEnabled", &frontToBackEnabled, 0, 1);
+  ImGui::Text("geometry pass %.2f ms (GPU)", geometryTimer.getMilliseconds());
+  ImGui::Text("SSAO to lighting %.2f ms (GPU)",
+              lightingTimer.getMilliseconds());
+  if (pointShadow.available()) {
+    ImGui::SliderInt("shadowEnabled", &shadowEnabled, 0, 1);
+    ImGui::Text("shadow map rendered %u times, reused %u frames",
+                pointShadow.getStats().renders,
+                pointShadow.getStats().cachedFrames);
+  }
+}
+
+std::string textureCacheDirectory() {
+  std::error_code ec;
+  std::filesystem::path directory = std::filesystem::temp_directory_path(ec);
+  if (ec)
+    return std::string();
+  return (directory / "SSDO" / "texture_cache").string();
 }
 
 int main(int argc, char** argv) {
@@ -228,6 +629,8 @@ int main(int argc, char** argv) {
   if (glewInit() != GLEW_OK) {
     std::exit(EXIT_FAILURE);
   }
+  // 绑定都经过状态缓存，重复的绑定不再发给驱动
+  GLState::Cache& glState = GLState::Cache::current();
   ImGui::CreateContext();
   ImGuiIO& io = ImGui::GetIO();
   (void)io;
@@ -238,123 +641,122 @@ int main(int argc, char** argv) {
   ImGui_ImplOpenGL3_Init("#version 150");
 
   // 编译链接着色器
-  unsigned geometryProgram = createProgram(geometryVS, geometryFS);
-  unsigned ssaoProgram = createProgram(ssaoVS, ssaoFS);
+  // 按顶点的骨骼影响数编译蒙皮变体，归一化后的权重按大小排在前面，
+  // 影响少的网格只读取前几个；刚体网格不做蒙皮。切换对偶四元数蒙皮时
+  // 调色板布局改变，整组变体重新编译
+  unsigned geometryPrograms[SkeletalMesh::SKIN_CLASS_NUM] = {0};
+  unsigned depthPrograms[SkeletalMesh::SKIN_CLASS_NUM] = {0};
+  unsigned shadowPrograms[SkeletalMesh::SKIN_CLASS_NUM] = {0};
+  unsigned geometryProgram = 0;
+  auto buildGeometryPrograms = [&](bool dualQuat) {
+    for (int c = 0; c < SkeletalMesh::SKIN_CLASS_NUM; c++) {
+      std::string source =
+          "#version 410\n#define BONE_INFLUENCES " +
+          std::to_string(
+              SkeletalMesh::skinInfluences((SkeletalMesh::SkinClass)c)) +
+          "\n" + (dualQuat ? "#define DUAL_QUATERNION_SKINNING\n" : "") +
+          geometryVS;
+      glState.forgetProgram(geometryPrograms[c]);
+      glDeleteProgram(geometryPrograms[c]);
+      geometryPrograms[c] = createProgram(source.c_str(), geometryFS);
+      glState.useProgram(geometryPrograms[c]);
+      glUniform1i(glGetUniformLocation(geometryPrograms[c], "diffuseMap"),
+                  SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL);
+      glUniform1i(glGetUniformLocation(geometryPrograms[c], "bonePalette"),
+                  SCENE_RESOURCE_SHADER_BONE_CHANNEL);
+      glState.forgetProgram(depthPrograms[c]);
+      glDeleteProgram(depthPrograms[c]);
+      depthPrograms[c] = createProgram(source.c_str(), depthFS);
+      glState.useProgram(depthPrograms[c]);
+      glUniform1i(glGetUniformLocation(depthPrograms[c], "bonePalette"),
+                  SCENE_RESOURCE_SHADER_BONE_CHANNEL);
+      // 阴影变体与几何变体共用蒙皮代码
+      source.insert(source.find('\n') + 1, "#define SHADOW_PASS\n");
+      glState.forgetProgram(shadowPrograms[c]);
+      glDeleteProgram(shadowPrograms[c]);
+      shadowPrograms[c] = createProgram(source.c_str(), shadowFS, shadowGS);
+      glState.useProgram(shadowPrograms[c]);
+      glUniform1i(glGetUniformLocation(shadowPrograms[c], "bonePalette"),
+                  SCENE_RESOURCE_SHADER_BONE_CHANNEL);
+    }
+    geometryProgram = geometryPrograms[SkeletalMesh::SKIN_RIGID];
+    SkeletalMesh::Scene::setSkinningMode(
+        dualQuat ? SkeletalMesh::SKINNING_DUAL_QUATERNION
+                 : SkeletalMesh::SKINNING_LINEAR);
+  };
+  buildGeometryPrograms(dualQuatSkinning != 0);
+  int builtDualQuatSkinning = dualQuatSkinning;
+  unsigned ssaoProgram =
+      createProgram(ssaoVS, (std::string(gBufferDecode) + ssaoFS).c_str());
   unsigned ssaoBlurProgram = createProgram(ssaoVS, ssaoBlurFS);
-  unsigned lightingProgram = createProgram(ssaoVS, lightingFS);
-
-  // 导入模型
-  SkeletalMesh::Scene& sr =
-      SkeletalMesh::Scene::loadScene(modelName, "resources/" + modelName + ".fbx");
-  if (&sr == &SkeletalMesh::Scene::error)
+  unsigned lightingProgram =
+      createProgram(ssaoVS, (std::string(gBufferDecode) + lightingFS).c_str());
+
+  // 有 TextureCompressor 生成的 .dds 时直接上传压缩贴图
+  TextureImage::Texture::preferCompressed =
+      GLEW_EXT_texture_compression_s3tc != 0;
+
+  // 导入模型，在后台线程解析，完成后在主循环中上传
+  SkeletalMesh::Scene::Handle sceneHandle =
+      SkeletalMesh::Scene::loadSceneAsync(modelName,
+                                          "resources/" + modelName + ".fbx");
+  if (sceneHandle.isNull())
     std::cout << "Error occured in loadMesh()" << std::endl;
 
-  sr.setShaderInput(geometryProgram, "aPos", "aTexCoords", "aNormal",
-                    "aBoneIndex", "aBoneWeight");
-
-  // 创建 gBuffer 以及贴图
-  unsigned gBuffer;
-  glGenFramebuffers(1, &gBuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
-  unsigned gPosition, gNormal, gAlbedo;
-  // position color buffer
-  glGenTextures(1, &gPosition);
-  glBindTexture(GL_TEXTURE_2D, gPosition);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA,
-               GL_FLOAT, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                         gPosition, 0);
-  // normal color buffer
-  glGenTextures(1, &gNormal);
-  glBindTexture(GL_TEXTURE_2D, gNormal);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, SCREEN_WIDTH, SCREEN_HEIGHT, 0,
-               GL_RGBA,
-               GL_FLOAT, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
-                         gNormal, 0);
-  // color + specular color buffer
-  glGenTextures(1, &gAlbedo);
-  glBindTexture(GL_TEXTURE_2D, gAlbedo);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0,
-               GL_RGBA,
-               GL_UNSIGNED_BYTE, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D,
-                         gAlbedo, 0);
-  // tell OpenGL which color attachments we'll use (of this framebuffer) for
-  // rendering
-  unsigned attachments[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
-                                 GL_COLOR_ATTACHMENT2};
-  glDrawBuffers(3, attachments);
-  // create and attach depth buffer (renderbuffer)
-  unsigned rboDepth;
-  glGenRenderbuffers(1, &rboDepth);
-  glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, SCREEN_WIDTH,
-                        SCREEN_HEIGHT);
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                            GL_RENDERBUFFER, rboDepth);
-  // finally check if framebuffer is complete
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-    std::cout << "Framebuffer not complete!" << std::endl;
-
-  unsigned ssaoBuffer;
-  glGenFramebuffers(1, &ssaoBuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, ssaoBuffer);
-  unsigned ssaoColorBuffer;
-  // SSAO color buffer
-  glGenTextures(1, &ssaoColorBuffer);
-  glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RED,
-               GL_FLOAT, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                         ssaoColorBuffer, 0);
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-    std::cout << "SSAO Framebuffer not complete!" << std::endl;
-
-  unsigned ssaoBlurBuffer;
-  glGenFramebuffers(1, &ssaoBlurBuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurBuffer);
-  unsigned ssaoBlurColorBuffer;
-  // SSAO Blur color buffer
-  glGenTextures(1, &ssaoBlurColorBuffer);
-  glBindTexture(GL_TEXTURE_2D, ssaoBlurColorBuffer);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RED,
-               GL_FLOAT, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                         ssaoBlurColorBuffer, 0);
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-    std::cout << "SSAO Blur Framebuffer not complete!" << std::endl;
-
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  SkeletalMesh::Scene::getScene(sceneHandle)
+      .setShaderInput(geometryProgram, "aPos", "aTexCoords", "aNormal",
+                      "aBoneIndex", "aBoneWeight", "aTexLayer");
+  SkeletalMesh::Scene::getScene(sceneHandle).setSkinPrograms(geometryPrograms);
+
+  // 渲染图：各 pass 声明读写的贴图，临时贴图每帧从贴图池取用，
+  // 生命周期不重叠且格式相同的贴图共用同一张；结果没人用的 pass 被剔除
+  RenderGraph::Graph renderGraph;
+  // 贴图格式按用途由 formatFor() 统一决定，全部是显式的 sized 格式
+  // G-buffer 每像素 12 字节：不单独存位置，着色时由深度重建
+  const RenderGraph::TextureDesc gNormalDesc(SCREEN_WIDTH, SCREEN_HEIGHT,
+                                             RenderGraph::USAGE_NORMAL);
+  const RenderGraph::TextureDesc gAlbedoDesc(SCREEN_WIDTH, SCREEN_HEIGHT,
+                                             RenderGraph::USAGE_ALBEDO);
+  // 深度用贴图，遮挡剔除从它建立深度金字塔，后续 pass 由它重建位置
+  const RenderGraph::TextureDesc gDepthDesc(SCREEN_WIDTH, SCREEN_HEIGHT,
+                                            RenderGraph::USAGE_DEPTH);
+  // 遮蔽只有 [0, 1] 一个值，R8 足够，未指定大小的 GL_RED 可能被存成 32 位
+  const RenderGraph::TextureDesc ssaoDesc(SCREEN_WIDTH, SCREEN_HEIGHT,
+                                          RenderGraph::USAGE_OCCLUSION);
+
+  occlusionCuller.init(SCREEN_WIDTH, SCREEN_HEIGHT);
+  meshletCuller.init();
+  // 每帧变化的 uniform 块写入环形缓冲，三帧轮流使用，以 fence 保护
+  uniformRing.init(GL_UNIFORM_BUFFER, 64 * 1024);
+  clusterGrid.init();
+  // 阴影贴图存的是线性距离，16 位精度均匀分布在光照范围内，内存减半
+  pointShadow.init(SHADOW_SIZE,
+                   RenderGraph::formatFor(RenderGraph::USAGE_SHADOW_DISTANCE));
+  geometryTimer.init();
+  lightingTimer.init();
 
   glEnable(GL_DEPTH_TEST);
+  // 阴影的 PCF 采样会跨越立方体贴图的面
+  glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-  glUseProgram(ssaoProgram);
-  glUniform1i(glGetUniformLocation(ssaoProgram, "gPosition"), 0);
+  glState.useProgram(ssaoProgram);
+  glUniform1i(glGetUniformLocation(ssaoProgram, "gDepth"), 0);
   glUniform1i(glGetUniformLocation(ssaoProgram, "gNormal"), 1);
   glUniform1i(glGetUniformLocation(ssaoProgram, "texNoise"), 2);
 
-  glUseProgram(ssaoBlurProgram);
+  glState.useProgram(ssaoBlurProgram);
   glUniform1i(glGetUniformLocation(ssaoBlurProgram, "ssaoInput"), 0);
 
-  glUseProgram(lightingProgram);
-  glUniform1i(glGetUniformLocation(lightingProgram, "gPosition"), 0);
+  glState.useProgram(lightingProgram);
+  glUniform1i(glGetUniformLocation(lightingProgram, "gDepth"), 0);
   glUniform1i(glGetUniformLocation(lightingProgram, "gNormal"), 1);
   glUniform1i(glGetUniformLocation(lightingProgram, "gAlbedo"), 2);
   glUniform1i(glGetUniformLocation(lightingProgram, "ssao"), 3);
+  glUniform1i(glGetUniformLocation(lightingProgram, "lightData"), 4);
+  glUniform1i(glGetUniformLocation(lightingProgram, "clusterData"), 5);
+  glUniform1i(glGetUniformLocation(lightingProgram, "lightIndex"), 6);
+  glUniform1i(glGetUniformLocation(lightingProgram, "shadowMap"), 7);
 
   // 随机取样
   std::uniform_real_distribution<float> randomFloats(0.0f, 1.0f);
@@ -373,6 +775,23 @@ int main(int argc, char** argv) {
 
     ssaoKernel[i] = sample;
   }
+  // 采样核不变，只有半径和偏移每帧更新
+  SsaoUniforms ssaoUniforms;
+  for (int i = 0; i < 64; i++)
+    ssaoUniforms.kernel[i] = glm::vec4(ssaoKernel[i], 0.0f);
+
+  // 额外的点光源散布在场景周围，用于测试大量光源时的开销
+  std::vector<Lighting::PointLight> extraLights(EXTRA_LIGHT_MAX);
+  for (Lighting::PointLight& light : extraLights) {
+    light.position = glm::vec3(randomFloats(generator) * 16.0f - 8.0f,
+                               randomFloats(generator) * 6.0f - 4.0f,
+                               randomFloats(generator) * 16.0f);
+    light.radius = 1.5f;
+    light.color = glm::vec3(randomFloats(generator), randomFloats(generator),
+                            randomFloats(generator)) * 0.5f;
+    light.shadowMap = -1;
+  }
+  std::vector<Lighting::PointLight> frameLights;
 
   // 随机旋转
   std::vector<glm::vec3> ssaoNoise;
@@ -383,14 +802,26 @@ int main(int argc, char** argv) {
     ssaoNoise.push_back(noise);
   }
   unsigned noiseTexture;
-  glGenTextures(1, &noiseTexture);
-  glBindTexture(GL_TEXTURE_2D, noiseTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 4, 4, 0, GL_RGB, GL_FLOAT,
-               &ssaoNoise[0]);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  // 支持 DSA 时按名字创建和修改贴图，不必先绑定
+  if (GLState::hasDirectStateAccess()) {
+    glCreateTextures(GL_TEXTURE_2D, 1, &noiseTexture);
+    glTextureStorage2D(noiseTexture, 1, GL_RGBA32F, 4, 4);
+    glTextureSubImage2D(noiseTexture, 0, 0, 0, 4, 4, GL_RGB, GL_FLOAT,
+                        &ssaoNoise[0]);
+    glTextureParameteri(noiseTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(noiseTexture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(noiseTexture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTextureParameteri(noiseTexture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  } else {
+    glGenTextures(1, &noiseTexture);
+    glState.bindTexture(GL_TEXTURE_2D, noiseTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 4, 4, 0, GL_RGB, GL_FLOAT,
+                 &ssaoNoise[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  }
 
   cameraPos = glm::vec3(-4.79442f, 1.11827f, 0.0814787f);
   yaw = 50.8499f;
@@ -407,6 +838,33 @@ int main(int argc, char** argv) {
 
     glfwPollEvents();
     doMovement(curTime - lastTime);
+    // 重新导入模型，用于比较串行与并行导入的耗时
+    if (reloadRequested) {
+      reloadRequested = false;
+      SkeletalMesh::Scene::parallelImport = parallelImport != 0;
+      SkeletalMesh::Scene::unloadScene(modelName);
+      // 解码后的贴图缓存在系统临时目录，不写入 resources；
+      // 旧场景已卸载，此时没有解码线程在读缓存目录
+      TextureImage::Texture::setCacheDirectory(
+          textureCacheEnabled ? textureCacheDirectory() : std::string());
+      sceneHandle = SkeletalMesh::Scene::loadSceneAsync(
+          modelName, "resources/" + modelName + ".fbx");
+      SkeletalMesh::Scene::getScene(sceneHandle)
+          .setShaderInput(geometryProgram, "aPos", "aTexCoords", "aNormal",
+                          "aBoneIndex", "aBoneWeight", "aTexLayer");
+      SkeletalMesh::Scene::getScene(sceneHandle)
+          .setSkinPrograms(geometryPrograms);
+      pointShadow.invalidate();
+    }
+    if (dualQuatSkinning != builtDualQuatSkinning) {
+      builtDualQuatSkinning = dualQuatSkinning;
+      buildGeometryPrograms(dualQuatSkinning != 0);
+      SkeletalMesh::Scene::getScene(sceneHandle)
+          .setSkinPrograms(geometryPrograms);
+    }
+    SkeletalMesh::Scene::updatePendingScenes();
+    // 加载失败的场景会被销毁，句柄随之失效，因此每帧重新取
+    SkeletalMesh::Scene& sr = SkeletalMesh::Scene::getScene(sceneHandle);
 
     lastTime = curTime;
 
@@ -423,10 +881,7 @@ int main(int argc, char** argv) {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Geometry Pass
-    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
-    glUseProgram(geometryProgram);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // 每帧重新声明各 pass 及其读写的贴图，执行时按需分配
     glm::mat4 model(1.0f), view(1.0f), projection(1.0f);
     model = glm::translate(model, glm::vec3(0.0f, -3.0f, 8.0f));
     model = glm::scale(model, glm::vec3(0.02f));
@@ -435,96 +890,266 @@ int main(int argc, char** argv) {
     view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
     projection = glm::perspective(glm::radians(fov), ratio,
                                   0.1f, 100.0f);
-    glUniformMatrix4fv(glGetUniformLocation(geometryProgram, "model"), 1,
-                       GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(glGetUniformLocation(geometryProgram, "view"), 1,
-                       GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(geometryProgram, "projection"), 1,
-                       GL_FALSE, glm::value_ptr(projection));
-    glUniform1i(glGetUniformLocation(geometryProgram, "invertedNormals"), 0);
-    sr.render();
-    model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 8.0f));
-    model = glm::scale(model, glm::vec3(10.0f));
-    glUniformMatrix4fv(glGetUniformLocation(geometryProgram, "model"), 1,
-                       GL_FALSE, glm::value_ptr(model));
-    glUniform1i(glGetUniformLocation(geometryProgram, "invertedNormals"), 1);
-    renderCube();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    uniformRing.beginFrame();
+    FrameUniforms frameUniforms = {view, projection};
+    uniformRing.pushAndBind(FRAME_BLOCK_BINDING, frameUniforms);
+    // 原来的单个光源作为第一个光源，影响范围取衰减低于 8 位精度的距离
+    Lighting::PointLight mainLight = {
+        lightPos,
+        Lighting::attenuationRadius(lightColor, lightLinear, lightQuadratic),
+        lightColor, shadowEnabled && pointShadow.available() ? 0 : -1};
+    frameLights.assign(1, mainLight);
+    frameLights.insert(frameLights.end(), extraLights.begin(),
+                       extraLights.begin() + extraLightNum);
+    clusterGrid.build(frameLights, view, projection);
+    clusterStats = clusterGrid.getStats();
+    // 阴影贴图只在光源移动或场景变化后重画，加载中的场景还没有几何体
+    if (mainLight.shadowMap >= 0 && !sr.isLoading() &&
+        pointShadow.needsUpdate(lightPos, mainLight.radius)) {
+      pointShadow.begin(lightPos, mainLight.radius);
+      ShadowUniforms shadowUniforms;
+      for (int face = 0; face < Shadow::PointShadowMap::FACE_NUM; face++)
+        shadowUniforms.faceMatrix[face] = pointShadow.faceMatrix(face);
+      shadowUniforms.lightPosFar = glm::vec4(lightPos, mainLight.radius);
+      uniformRing.pushAndBind(PASS_BLOCK_BINDING, shadowUniforms);
+      ObjectUniforms shadowObject = {model, 0, 0, {0, 0}};
+      uniformRing.pushAndBind(OBJECT_BLOCK_BINDING, shadowObject);
+      // 相机的剔除结果不适用于光源，全部绘制；绘制列表里还留着上一帧
+      // 相机选的细节层级，缓存的阴影贴图要用最精细的一级
+      sr.resetCulling();
+      sr.selectLevels(glm::vec3(0.0f), 1.0f, 0.0f);
+      sr.setSkinPrograms(shadowPrograms);
+      sr.render();
+      sr.setSkinPrograms(geometryPrograms);
+      pointShadow.end();
+      glState.bindFramebuffer(0);
+      glViewport(0, 0, width, height);
+    }
+    RenderGraph::ResourceId gNormal =
+        renderGraph.createTexture("gNormal", gNormalDesc);
+    RenderGraph::ResourceId gAlbedo =
+        renderGraph.createTexture("gAlbedo", gAlbedoDesc);
+    RenderGraph::ResourceId gDepth =
+        renderGraph.createTexture("gDepth", gDepthDesc);
+    RenderGraph::ResourceId ssaoColor =
+        renderGraph.createTexture("ssao", ssaoDesc);
+    RenderGraph::ResourceId ssaoBlurColor =
+        renderGraph.createTexture("ssaoBlur", ssaoDesc);
+    RenderGraph::ResourceId backbuffer = renderGraph.importBackbuffer();
+
+    // Geometry Pass
+    auto geometryPass = [&](const RenderGraph::Graph& graph) {
+      geometryTimer.begin();
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      // 所有蒙皮变体共用同一份 uniform，不必逐个程序设置
+      ObjectUniforms sceneObject = {model, 0, diffuseEnabled, {0, 0}};
+      uniformRing.pushAndBind(OBJECT_BLOCK_BINDING, sceneObject);
+      glState.useProgram(geometryProgram);
+      glm::mat4 modelViewProj = projection * view * model;
+      // 开启网格簇剔除时，每次绘制前先剔除背向和视锥外的簇并压缩索引
+      // 加载中的场景网格簇还在后台线程生成，不能剔除
+      bool meshletCulling = meshletCullingEnabled &&
+                            meshletCuller.available() && !sr.isLoading();
+      glm::vec3 modelEye = glm::vec3(glm::inverse(view * model) *
+                                     glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+      auto renderScene = [&](GLuint commandBuffer) {
+        GLuint drawCommands = commandBuffer;
+        GLuint drawIndices = 0;
+        if (meshletCulling) {
+          meshletCuller.cull(sr, commandBuffer, modelViewProj, modelEye);
+          glState.useProgram(geometryProgram);
+          drawCommands = meshletCuller.drawCommandBuffer();
+          drawIndices = meshletCuller.drawIndexBuffer();
+        }
+        // 开启深度预渲染时先只写深度，再以 GL_EQUAL 写 G-buffer，
+        // 被遮挡的片元不再写三张贴图
+        if (depthPrepassEnabled) {
+          glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+          sr.setSkinPrograms(depthPrograms);
+          sr.render(drawCommands, 0, drawIndices);
+          sr.setSkinPrograms(geometryPrograms);
+          glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+          glDepthFunc(GL_EQUAL);
+          glDepthMask(GL_FALSE);
+        }
+        sr.render(drawCommands, 0, drawIndices);
+        if (depthPrepassEnabled) {
+          glDepthFunc(GL_LESS);
+          glDepthMask(GL_TRUE);
+        }
+      };
+      // 按投影到屏幕上的简化误差为每个网格选择细节层级
+      sr.selectLevels(modelEye, projection[1][1] * height * 0.5f,
+                      lodEnabled ? lodPixelError : 0.0f);
+      // 由近到远绘制，提前深度测试能挡掉更多后画的片元
+      if (frontToBackEnabled)
+        sr.sortFrontToBack(modelEye);
+      if (meshletCulling)
+        meshletCuller.prepare(sr);
+      if (occlusionCullingEnabled && occlusionCuller.available()) {
+        // 第一阶段用上一帧的深度金字塔剔除，第二阶段用本帧深度重测被剔除的网格
+        sr.resetCulling();
+        occlusionCuller.prepare(sr);
+        occlusionCuller.cullPhase(0, modelViewProj);
+        glState.useProgram(geometryProgram);
+        renderScene(occlusionCuller.commandBuffer(0));
+        occlusionCuller.buildPyramid(graph.getTexture(gDepth));
+        occlusionCuller.cullPhase(1, modelViewProj);
+        glState.useProgram(geometryProgram);
+        renderScene(occlusionCuller.commandBuffer(1));
+        cullStats.drawn =
+            occlusionCuller.visibleCount(0) + occlusionCuller.visibleCount(1);
+        cullStats.culled = occlusionCuller.totalCount() - cullStats.drawn;
+        drawnTriangles = sr.getDrawnTriangles();
+      } else {
+        if (frustumCullingEnabled)
+          sr.cull(modelViewProj);
+        else
+          sr.resetCulling();
+        cullStats = sr.getCullStats();
+        renderScene(0);
+        drawnTriangles = sr.getDrawnTriangles();
+      }
+      // 异步加载期间容器仍在后台线程写入，加载完成后再统计
+      if (!sr.isLoading()) {
+        sceneMemory = sr.getMemoryUsage();
+        loadTiming = sr.getLoadTiming();
+      }
+      // 场景绘制会切换蒙皮变体，立方体用刚体变体
+      glState.useProgram(geometryProgram);
+      glm::mat4 cubeModel =
+          glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 8.0f));
+      cubeModel = glm::scale(cubeModel, glm::vec3(10.0f));
+      ObjectUniforms cubeObject = {cubeModel, 1, 0, {0, 0}};
+      uniformRing.pushAndBind(OBJECT_BLOCK_BINDING, cubeObject);
+      const Culling::AABB cubeBounds(glm::vec3(-1.0f), glm::vec3(1.0f));
+      Culling::Frustum cubeFrustum(projection * view * cubeModel);
+      if (!frustumCullingEnabled || cubeFrustum.testAABB(cubeBounds)) {
+        renderCube();
+        cullStats.drawn++;
+      } else {
+        cullStats.culled++;
+      }
+      // 模型还在后台加载时，在它的位置画一个旋转的方块占位，
+      // 画面照常着色和响应操作
+      if (sr.isLoading()) {
+        glm::mat4 proxyModel =
+            glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 8.0f));
+        proxyModel =
+            glm::rotate(proxyModel, curTime, glm::vec3(0.0f, 1.0f, 0.0f));
+        ObjectUniforms proxyObject = {proxyModel, 0, 0, {0, 0}};
+        uniformRing.pushAndBind(OBJECT_BLOCK_BINDING, proxyObject);
+        renderCube();
+      }
+      geometryTimer.end();
+    };
+    renderGraph.addPass("geometry", {}, {gNormal, gAlbedo, gDepth},
+                        geometryPass);
 
     // SSAO PASS
-    glBindFramebuffer(GL_FRAMEBUFFER, ssaoBuffer);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(ssaoProgram);
-    glUniform1f(glGetUniformLocation(ssaoProgram, "radius"), radius);
-    glUniform1f(glGetUniformLocation(ssaoProgram, "bias"), bias);
-    glUniform3fv(glGetUniformLocation(ssaoProgram, "kernel"), 64,
-                 glm::value_ptr(ssaoKernel[0]));
-    glUniformMatrix4fv(glGetUniformLocation(ssaoProgram, "projection"), 1,
-                       GL_FALSE, glm::value_ptr(projection));
-    glUniform1i(glGetUniformLocation(ssaoProgram, "ssaoEnabled"),
-                ssaoEnabled);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gPosition);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gNormal);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, noiseTexture);
-    renderQuad();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    auto ssaoPass = [&](const RenderGraph::Graph& graph) {
+      lightingTimer.begin();
+      glClear(GL_COLOR_BUFFER_BIT);
+      glState.useProgram(ssaoProgram);
+      ssaoUniforms.radius = radius;
+      ssaoUniforms.bias = bias;
+      uniformRing.pushAndBind(PASS_BLOCK_BINDING, ssaoUniforms);
+      glState.bindTexture(0, GL_TEXTURE_2D, graph.getTexture(gDepth));
+      glState.bindTexture(1, GL_TEXTURE_2D, graph.getTexture(gNormal));
+      glState.bindTexture(2, GL_TEXTURE_2D, noiseTexture);
+      renderQuad();
+    };
+    renderGraph.addPass("ssao", {gDepth, gNormal}, {ssaoColor}, ssaoPass);
 
     // SSAO Blur PASS
-    glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurBuffer);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(ssaoBlurProgram);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
-    glUniform1i(glGetUniformLocation(ssaoBlurProgram, "ssaoBlurEnabled"),
-                ssaoBlurEnabled);
-    renderQuad();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    // Lighting Pass
-    glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(lightingProgram);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gPosition);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gNormal);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, gAlbedo);
-    glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, ssaoBlurColorBuffer);
-    glUniform1f(glGetUniformLocation(lightingProgram, "shininess"), shininess);
-    glUniform3fv(glGetUniformLocation(lightingProgram, "lightPos"), 1,
-                 glm::value_ptr(glm::vec3(view * glm::vec4(lightPos, 1.0f))));
-    glUniform3fv(glGetUniformLocation(lightingProgram, "lightColor"), 1,
-                 glm::value_ptr(lightColor));
-    glUniform1f(glGetUniformLocation(lightingProgram, "ambientStrength"),
-                ambientStrength);
-    glUniform1f(glGetUniformLocation(lightingProgram, "diffuseStrength"),
-                diffuseStrength);
-    glUniform1f(glGetUniformLocation(lightingProgram, "specularStrength"),
-                specularStrength);
-    const float linear = 0.09f;
-    const float quadratic = 0.032f;
-    glUniform1f(glGetUniformLocation(lightingProgram, "lightLinear"),
-                linear);
-    glUniform1f(glGetUniformLocation(lightingProgram, "lightQuadratic"),
-                quadratic);
-    glUniform1i(glGetUniformLocation(lightingProgram, "lightingEnabled"),
-                lightingEnabled);
-    renderQuad();
-
+    auto ssaoBlurPass = [&](const RenderGraph::Graph& graph) {
+      glClear(GL_COLOR_BUFFER_BIT);
+      glState.useProgram(ssaoBlurProgram);
+      glState.bindTexture(0, GL_TEXTURE_2D, graph.getTexture(ssaoColor));
+      renderQuad();
+    };
+    renderGraph.addPass("ssaoBlur", {ssaoColor}, {ssaoBlurColor},
+                        ssaoBlurPass);
+
+    // Lighting Pass，关闭 SSAO 时不读取遮蔽结果，关闭模糊或在光照中
+    // 合并模糊时直接读取未模糊的结果，渲染图据此剔除用不到的 pass
+    bool ssaoBlurInline = ssaoBlurEnabled && ssaoBlurFused;
+    RenderGraph::ResourceId ssaoResult =
+        ssaoBlurEnabled && !ssaoBlurInline ? ssaoBlurColor : ssaoColor;
+    std::vector<RenderGraph::ResourceId> lightingReads = {gDepth, gNormal,
+                                                          gAlbedo};
+    if (ssaoEnabled)
+      lightingReads.push_back(ssaoResult);
+    auto lightingPass = [&](const RenderGraph::Graph& graph) {
+      lightingTimer.begin();
+      glClear(GL_COLOR_BUFFER_BIT);
+      glState.useProgram(lightingProgram);
+      glState.bindTexture(0, GL_TEXTURE_2D, graph.getTexture(gDepth));
+      glState.bindTexture(1, GL_TEXTURE_2D, graph.getTexture(gNormal));
+      glState.bindTexture(2, GL_TEXTURE_2D, graph.getTexture(gAlbedo));
+      glState.bindTexture(3, GL_TEXTURE_2D,
+                          ssaoEnabled ? graph.getTexture(ssaoResult) : 0);
+      clusterGrid.bind(4);
+      glState.bindTexture(7, GL_TEXTURE_CUBE_MAP,
+                          mainLight.shadowMap >= 0 ? pointShadow.getTexture()
+                                                   : 0);
+      LightingUniforms lighting;
+      lighting.clusterGrid = glm::uvec4(
+          Lighting::ClusterGrid::CLUSTER_X, Lighting::ClusterGrid::CLUSTER_Y,
+          Lighting::ClusterGrid::CLUSTER_Z, clusterStats.lightNum);
+      lighting.clusterDepth = glm::vec4(
+          clusterGrid.getNear(), clusterGrid.depthScale(),
+          width / (float)Lighting::ClusterGrid::CLUSTER_X,
+          height / (float)Lighting::ClusterGrid::CLUSTER_Y);
+      lighting.shininess = shininess;
+      lighting.lightLinear = lightLinear;
+      lighting.lightQuadratic = lightQuadratic;
+      lighting.ambientStrength = ambientStrength;
+      lighting.diffuseStrength = diffuseStrength;
+      lighting.specularStrength = specularStrength;
+      lighting.lightingEnabled = lightingEnabled;
+      lighting.ssaoEnabled = ssaoEnabled;
+      lighting.clusteredEnabled = clusteredLightingEnabled;
+      lighting.viewToWorld = glm::inverse(view);
+      lighting.shadowLight = glm::vec4(lightPos, pointShadow.getFar());
+      lighting.shadowEnabled =
+          mainLight.shadowMap >= 0 && pointShadow.isValid();
+      lighting.ssaoBlurInline = ssaoBlurInline;
+      uniformRing.pushAndBind(PASS_BLOCK_BINDING, lighting);
+      renderQuad();
+      lightingTimer.end();
+    };
+    renderGraph.addPass("lighting", lightingReads, {backbuffer}, lightingPass);
+    renderGraph.execute();
+    uniformRing.endFrame();
+    graphStats = renderGraph.getStats();
+    graphTargets = renderGraph.getTargets();
+    ringStats = uniformRing.getStats();
+    stateStats = glState.getStats();
+    glState.resetStats();
+    glState.setEnabled(stateCacheEnabled);
     draw_ui();
+    if (sr.isLoading())
+      ImGui::Text("Loading %s ...", modelName.c_str());
 
     ImGui::Render();
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    // ImGui 绕过缓存直接绑定
+    glState.invalidate();
 
     glfwSwapBuffers(window);
   }
 
   ImGui::DestroyContext();
-  SkeletalMesh::Scene::unloadScene(modelName);
+  renderGraph.clear();
+  uniformRing.clear();
+  clusterGrid.clear();
+  pointShadow.clear();
+  geometryTimer.clear();
+  lightingTimer.clear();
+  occlusionCuller.clear();
+  meshletCuller.clear();
+  SkeletalMesh::Scene::releaseScene(sceneHandle);
   glfwDestroyWindow(window);
   glfwTerminate();
   exit(EXIT_SUCCESS);
@@ -621,8 +1246,10 @@ void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
   cameraFront = glm::normalize(front);
 }
 
-unsigned createProgram(const char* VSSource, const char* FSSource) {
-  unsigned VS, FS, program;
+unsigned createProgram(const char* VSSource,
+                       const char* FSSource,
+                       const char* GSSource) {
+  unsigned VS, FS, GS = 0, program;
   int status;
   char infoLog[512];
 
@@ -648,9 +1275,24 @@ unsigned createProgram(const char* VSSource, const char* FSSource) {
               << infoLog << std::endl;
   }
 
+  if (GSSource != NULL) {
+    GS = glCreateShader(GL_GEOMETRY_SHADER);
+    glShaderSource(GS, 1, &GSSource, nullptr);
+    glCompileShader(GS);
+
+    glGetShaderiv(GS, GL_COMPILE_STATUS, &status);
+    if (!status) {
+      glGetShaderInfoLog(GS, 512, NULL, infoLog);
+      std::cout << "ERROR::SHADER::GEOMETRY::COMPILATION_FAILED\n"
+                << infoLog << std::endl;
+    }
+  }
+
   program = glCreateProgram();
   glAttachShader(program, VS);
   glAttachShader(program, FS);
+  if (GS != 0)
+    glAttachShader(program, GS);
   glLinkProgram(program);
 
   glGetProgramiv(program, GL_LINK_STATUS, &status);
@@ -661,6 +1303,18 @@ unsigned createProgram(const char* VSSource, const char* FSSource) {
 
   glDeleteShader(VS);
   glDeleteShader(FS);
+  if (GS != 0)
+    glDeleteShader(GS);
+
+  // uniform block 按名字对应到固定的绑定点
+  const char* blockNames[] = {"FrameBlock", "ObjectBlock", "PassBlock"};
+  const GLuint blockBindings[] = {FRAME_BLOCK_BINDING, OBJECT_BLOCK_BINDING,
+                                  PASS_BLOCK_BINDING};
+  for (int i = 0; i < 3; i++) {
+    GLuint index = glGetUniformBlockIndex(program, blockNames[i]);
+    if (index != GL_INVALID_INDEX)
+      glUniformBlockBinding(program, index, blockBindings[i]);
+  }
 
   return program;
 }
@@ -679,7 +1333,7 @@ void renderQuad() {
     // setup plane VAO
     glGenVertexArrays(1, &quadVAO);
     glGenBuffers(1, &quadVBO);
-    glBindVertexArray(quadVAO);
+    GLState::Cache::current().bindVertexArray(quadVAO);
     glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices,
                  GL_STATIC_DRAW);
@@ -690,9 +1344,8 @@ void renderQuad() {
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float),
                           (void*)(3 * sizeof(float)));
   }
-  glBindVertexArray(quadVAO);
+  GLState::Cache::current().bindVertexArray(quadVAO);
   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  glBindVertexArray(0);
 }
 
 // renderCube() renders a 1x1 3D cube in NDC.
@@ -752,7 +1405,7 @@ void renderCube() {
     glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
     // link vertex attributes
-    glBindVertexArray(cubeVAO);
+    GLState::Cache::current().bindVertexArray(cubeVAO);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
                           (void*)0);
@@ -763,10 +1416,8 @@ void renderCube() {
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
                           (void*)(3 * sizeof(float)));
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
   }
   // render Cube
-  glBindVertexArray(cubeVAO);
+  GLState::Cache::current().bindVertexArray(cubeVAO);
   glDrawArrays(GL_TRIANGLES, 0, 36);
-  glBindVertexArray(0);
 }
\ No newline at end of file
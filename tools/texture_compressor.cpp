@@ -0,0 +1,100 @@
+// Offline texture compressor: image files -> BC1/BC3 .dds with full mip chain
+//
+// Usage: TextureCompressor [--bc1 | --bc3] <image>...
+// Each image is written next to its source with the .dds extension, which is
+// where TextureImage::Texture looks for it. Without a format flag BC3 is used
+// for images with non-opaque alpha and BC1 otherwise. Images have to be a
+// power of two in both dimensions, so every level flips exactly on load.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <texture_compress.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+std::string ddsFilename(const std::string& filename) {
+  size_t dotpos = filename.rfind('.');
+  size_t slashpos = filename.find_last_of("/\\");
+  if (dotpos == std::string::npos ||
+      (slashpos != std::string::npos && dotpos < slashpos))
+    return filename + ".dds";
+  return filename.substr(0, dotpos) + ".dds";
+}
+
+bool compressFile(const std::string& filename, int forcedFormat) {
+  // DDS stores the top row first, the loader flips it for GL
+  stbi_set_flip_vertically_on_load(0);
+  int width = 0, height = 0, channels = 0;
+  stbi_uc* bits = stbi_load(filename.c_str(), &width, &height, &channels, 4);
+  if (bits == NULL) {
+    std::cout << "Error reading " << filename << ": " << stbi_failure_reason()
+              << std::endl;
+    return false;
+  }
+  // Blocks of a level whose height is not a multiple of 4 cannot be flipped
+  // exactly at load time, which only power of two chains avoid throughout
+  if ((width & (width - 1)) != 0 || (height & (height - 1)) != 0) {
+    std::cout << "Skipping " << filename << ": " << width << "x" << height
+              << " is not a power of two" << std::endl;
+    stbi_image_free(bits);
+    return false;
+  }
+  TextureCompress::Level base;
+  base.width = width;
+  base.height = height;
+  base.data.assign(bits, bits + size_t(width) * height * 4);
+  stbi_image_free(bits);
+
+  TextureCompress::Format format =
+      forcedFormat != 0 ? TextureCompress::Format(forcedFormat)
+      : TextureCompress::hasAlpha(base) ? TextureCompress::FORMAT_BC3
+                                        : TextureCompress::FORMAT_BC1;
+
+  std::vector<TextureCompress::Level> chain =
+      TextureCompress::buildMipChain(base);
+  size_t rawSize = 0, compressedSize = 0;
+  for (size_t i = 0; i < chain.size(); i++) {
+    rawSize += chain[i].data.size();
+    chain[i] = TextureCompress::compressLevel(chain[i], format);
+    compressedSize += chain[i].data.size();
+  }
+
+  std::string output = ddsFilename(filename);
+  if (!TextureCompress::writeDDS(output, format, chain)) {
+    std::cout << "Error writing " << output << std::endl;
+    return false;
+  }
+  std::cout << filename << " -> " << output << " (BC" << int(format) << ", "
+            << chain.size() << " levels, " << rawSize / 1024 << " KiB -> "
+            << compressedSize / 1024 << " KiB)" << std::endl;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  int forcedFormat = 0;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--bc1")
+      forcedFormat = TextureCompress::FORMAT_BC1;
+    else if (arg == "--bc3")
+      forcedFormat = TextureCompress::FORMAT_BC3;
+    else
+      inputs.push_back(arg);
+  }
+  if (inputs.empty()) {
+    std::cout << "Usage: " << argv[0] << " [--bc1 | --bc3] <image>..."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < inputs.size(); i++)
+    if (!compressFile(inputs[i], forcedFormat))
+      failed++;
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}